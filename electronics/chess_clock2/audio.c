@@ -9,6 +9,7 @@
 
 #include "audio.h"
 #include "timer.h"
+#include "trace.h"
 
 /* f = F_CPU/PRESCALER/2/(TOP+1) */
 /* TOP = F_CPU/PRESCALER/2/f - 1 */
@@ -39,7 +40,6 @@ enum
 #define AUDIO_CMD(tone_id, period, last) (((tone_id) & TONE_MASK) | (((period) & PERIOD_MASK)<<PERIOD_SHIFT) | (((last)==LAST)<<LAST_SHIFT))
 
 static const prog_uint8_t* audio_cmd_ptr;
-static uint8_t cycle_count;
 
 const prog_uint8_t tick[] =
 {
@@ -93,46 +93,46 @@ void init_audio(void)
 
 void play (const prog_uint8_t * cmds)
 {
+  trace_mark(TRACE_PLAY, 0);
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
     audio_cmd_ptr = cmds;
     PRR &= ~(1<<PRTIM1);  /* Turn on Timer1 */
     process_one_command();
-    enable_task(AUDIO_TASK);
   }
 }
 
+/* Called when the current command's period has passed */
 void process_audio(void)
 {
   uint8_t cmd;
-  if (cycle_count > 0)
+  cmd = pgm_read_byte(audio_cmd_ptr);
+  if ((cmd & (1<<LAST_SHIFT)) == CONTINUE)
   {
-    cycle_count --;
+    audio_cmd_ptr++;
+    process_one_command();
   }
-  if (cycle_count == 0)
+  else
   {
-    cmd = pgm_read_byte(audio_cmd_ptr);
-    if ((cmd & (1<<LAST_SHIFT)) == CONTINUE)
-    {
-      audio_cmd_ptr++;
-      process_one_command();
-    }
-    else
-    {
-      TCCR1A = (0<<COM1A1) | (0<<COM1A0)    /* Disconnect OC1A from output */
-             | (0<<COM1B1) | (0<<COM1B0)    /* Disconnect OC1B from output */
-             | (1<<WGM11) | (1<<WGM10);     /* Together with WGM13 and WGM12: Fast PWM mode, OCR1A sets top */
-      disable_task(AUDIO_TASK);
-      PRR |= (1<<PRTIM1);  /* Turn off Timer1 */
-    }
+    TCCR1A = (0<<COM1A1) | (0<<COM1A0)    /* Disconnect OC1A from output */
+           | (0<<COM1B1) | (0<<COM1B0)    /* Disconnect OC1B from output */
+           | (1<<WGM11) | (1<<WGM10);     /* Together with WGM13 and WGM12: Fast PWM mode, OCR1A sets top */
+    disable_task(AUDIO_TASK);
+    PRR |= (1<<PRTIM1);  /* Turn off Timer1 */
   }
 }
 
 static void process_one_command(void)
 {
   uint8_t cmd;
+  uint8_t period;
   cmd = pgm_read_byte(audio_cmd_ptr);
-  cycle_count = (cmd >> PERIOD_SHIFT) & PERIOD_MASK;
+  period = (cmd >> PERIOD_SHIFT) & PERIOD_MASK;
+  if (period == 0)
+  {
+    period = 1;
+  }
+  schedule_task(AUDIO_TASK, period);
   cmd &= TONE_MASK;
   if (cmd < TONE_NONE)
   {
@@ -0,0 +1,489 @@
+/*
+ * bench.c - counts the cycles taken by each function and interrupt handler of the firmware
+ *
+ * Runs the real ELF under simavr, one instruction at a time, driving the input pins
+ * from a script. A function is entered when the program counter reaches its address,
+ * and returns when the stack pointer rises above where it was on entry. The cycles
+ * of interrupt handlers that run in the middle of a function are not counted against it.
+ *
+ * Each stretch of time with interrupts disabled is also measured, from the instruction
+ * that disabled them to the one that enabled them again, and counted against the function
+ * that disabled them, or against the interrupt handler if it was the hardware. These show
+ * up as irqoff:<function>, and the longest is how late an interrupt can be for the inputs
+ * of the script. It is printed, and a longest stretch over max-irqoff makes the exit status 1.
+ * There is no measured bound on the latency of the timer interrupt yet, as this has never
+ * been run (see below), and none should be quoted until it has.
+ *
+ * Usage: bench firmware.out symbols.txt script.txt max-irqoff [baseline.txt [tolerance%]]
+ *   symbols.txt is the output of avr-nm for the firmware
+ *   script.txt  has a line "ms pin level" for each change of an input pin, e.g. "1500 D1 1"
+ *   max-irqoff  the most cycles that interrupts may be disabled for at a stretch, or 0 for
+ *               no limit
+ *   baseline    if given, the results are compared with it and any function whose mean
+ *               or maximum has risen by more than the tolerance makes the exit status 1
+ *
+ * The results are printed in the format of the baseline file: name calls min mean max
+ *
+ * There is no bench/baseline.txt in the tree yet, and 'make bench' then runs this without
+ * one, so that only the figures are printed. This has not been run, as it was written without
+ * simavr or avr-gcc to hand, so the first run with them should record a baseline with
+ * 'make bench-baseline' and check it in.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_ioport.h>
+
+#define SIM_MCU       "atmega88"   /* simavr has no ATmega88PA, but the registers are the same */
+#define SIM_FREQUENCY 1000000
+
+#define MAX_SYMBOLS   256
+#define MAX_DEPTH     32
+#define MAX_NAME      48
+#define MAX_EVENTS    1024
+
+#define NUM_VECTORS   26
+#define IRQOFF_PREFIX "irqoff:"
+
+/* Names of the interrupt vectors of the ATmega88PA that the firmware uses */
+static const struct
+{
+  const char * symbol;
+  const char * name;
+} VectorNames[] =
+{
+  { "__vector_3",  "PCINT0_vect" },
+  { "__vector_5",  "PCINT2_vect" },
+  { "__vector_7",  "TIMER2_COMPA_vect" },
+  { "__vector_8",  "TIMER2_COMPB_vect" },
+  { "__vector_9",  "TIMER2_OVF_vect" },
+  { "__vector_14", "TIMER0_COMPA_vect" },
+  { "__vector_18", "USART_RX_vect" },
+  { "__vector_19", "USART_UDRE_vect" },
+  { "__vector_20", "USART_TX_vect" },
+  { "__vector_22", "EE_READY_vect" }
+};
+
+typedef struct
+{
+  char name[MAX_NAME];
+  uint32_t addr;
+  uint8_t is_isr;
+  uint8_t is_irqoff;
+  unsigned long calls;
+  unsigned long min;
+  unsigned long max;
+  double total;
+} FunctionType;
+
+typedef struct
+{
+  FunctionType * function_ptr;
+  uint16_t sp;
+  avr_cycle_count_t start;
+  avr_cycle_count_t isr_cycles_at_start;
+} FrameType;
+
+typedef struct
+{
+  unsigned long ms;
+  char port;
+  int pin;
+  int level;
+} EventType;
+
+static FunctionType Functions[MAX_SYMBOLS];
+static int NumFunctions;
+
+static FrameType Frames[MAX_DEPTH];
+static int Depth;
+static avr_cycle_count_t IsrCycles;
+
+static FunctionType * IrqOffSite;  /* where interrupts were disabled, or NULL */
+static avr_cycle_count_t IrqOffStart;
+static FunctionType * LongestIrqOffSite;
+
+static EventType Events[MAX_EVENTS];
+static int NumEvents;
+
+static void load_symbols(const char * path)
+{
+  FILE * f;
+  char line[256];
+  unsigned long addr;
+  char type;
+  char name[MAX_NAME];
+  unsigned int i;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    exit(2);
+  }
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    if ((sscanf(line, "%lx %c %47s", &addr, &type, name) == 3) &&
+        ((type == 'T') || (type == 't')) && (NumFunctions < MAX_SYMBOLS) &&
+        (strncmp(name, "__", 2) != 0 || strncmp(name, "__vector_", 9) == 0))
+    {
+      FunctionType * function_ptr = &Functions[NumFunctions++];
+      memset(function_ptr, 0, sizeof(*function_ptr));
+      strcpy(function_ptr->name, name);
+      function_ptr->addr = addr;
+      for (i = 0; i < sizeof(VectorNames) / sizeof(VectorNames[0]); i++)
+      {
+        if (strcmp(name, VectorNames[i].symbol) == 0)
+        {
+          strcpy(function_ptr->name, VectorNames[i].name);
+        }
+      }
+      function_ptr->is_isr = (strncmp(name, "__vector_", 9) == 0);
+    }
+  }
+  fclose(f);
+}
+
+static void load_script(const char * path)
+{
+  FILE * f;
+  char line[256];
+  EventType * event_ptr;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    exit(2);
+  }
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    if ((line[0] == '#') || (NumEvents >= MAX_EVENTS))
+    {
+      continue;
+    }
+    event_ptr = &Events[NumEvents];
+    if (sscanf(line, "%lu %c%d %d", &event_ptr->ms, &event_ptr->port, &event_ptr->pin, &event_ptr->level) == 4)
+    {
+      NumEvents++;
+    }
+  }
+  fclose(f);
+}
+
+static FunctionType * find_function(uint32_t addr)
+{
+  int i;
+  for (i = 0; i < NumFunctions; i++)
+  {
+    if ((Functions[i].addr == addr) && !Functions[i].is_irqoff)
+    {
+      return &Functions[i];
+    }
+  }
+  return NULL;
+}
+
+/* Returns the name of the function that addr is in */
+static const char * function_name(uint32_t addr)
+{
+  FunctionType * function_ptr;
+  int i;
+
+  function_ptr = NULL;
+  for (i = 0; i < NumFunctions; i++)
+  {
+    if ((!Functions[i].is_irqoff) && (Functions[i].addr <= addr) &&
+        ((function_ptr == NULL) || (Functions[i].addr > function_ptr->addr)))
+    {
+      function_ptr = &Functions[i];
+    }
+  }
+  return (function_ptr != NULL) ? function_ptr->name : "?";
+}
+
+/* Returns the name of the handler of an interrupt vector */
+static const char * vector_name(int vector)
+{
+  char symbol[16];
+  unsigned int i;
+
+  snprintf(symbol, sizeof(symbol), "__vector_%d", vector);
+  for (i = 0; i < sizeof(VectorNames) / sizeof(VectorNames[0]); i++)
+  {
+    if (strcmp(symbol, VectorNames[i].symbol) == 0)
+    {
+      return VectorNames[i].name;
+    }
+  }
+  return "?";
+}
+
+/* Finds the entry that counts the stretches with interrupts disabled by the named function */
+static FunctionType * irqoff_site(const char * name)
+{
+  FunctionType * function_ptr;
+  char site[MAX_NAME];
+  int i;
+
+  snprintf(site, sizeof(site), IRQOFF_PREFIX "%s", name);
+  for (i = 0; i < NumFunctions; i++)
+  {
+    if (Functions[i].is_irqoff && (strcmp(Functions[i].name, site) == 0))
+    {
+      return &Functions[i];
+    }
+  }
+  if (NumFunctions >= MAX_SYMBOLS)
+  {
+    fprintf(stderr, "bench: too many functions\n");
+    exit(2);
+  }
+  function_ptr = &Functions[NumFunctions++];
+  memset(function_ptr, 0, sizeof(*function_ptr));
+  strcpy(function_ptr->name, site);
+  function_ptr->is_irqoff = 1;
+  return function_ptr;
+}
+
+static void count_cycles(FunctionType * function_ptr, unsigned long cycles)
+{
+  if ((function_ptr->calls == 0) || (cycles < function_ptr->min))
+  {
+    function_ptr->min = cycles;
+  }
+  if (cycles > function_ptr->max)
+  {
+    function_ptr->max = cycles;
+  }
+  function_ptr->total += cycles;
+  function_ptr->calls++;
+}
+
+/* Times the stretches with interrupts disabled, given the program counter before an instruction */
+static void watch_interrupts_disabled(avr_t * avr, uint32_t pc)
+{
+  if ((IrqOffSite == NULL) && !avr->sreg[S_I])
+  {
+    /* The hardware disables interrupts when it calls a handler through the vector table */
+    if (avr->pc < NUM_VECTORS * avr->vector_size)
+    {
+      IrqOffSite = irqoff_site(vector_name(avr->pc / avr->vector_size));
+    }
+    else
+    {
+      IrqOffSite = irqoff_site(function_name(pc));
+    }
+    IrqOffStart = avr->cycle;
+  }
+  else if ((IrqOffSite != NULL) && avr->sreg[S_I])
+  {
+    count_cycles(IrqOffSite, avr->cycle - IrqOffStart);
+    if ((LongestIrqOffSite == NULL) || (IrqOffSite->max > LongestIrqOffSite->max))
+    {
+      LongestIrqOffSite = IrqOffSite;
+    }
+    IrqOffSite = NULL;
+  }
+}
+
+static uint16_t stack_pointer(avr_t * avr)
+{
+  return avr->data[R_SPL] | (avr->data[R_SPH] << 8);
+}
+
+/* Closes the frames of the functions that have returned */
+static void leave_functions(avr_t * avr)
+{
+  FrameType * frame_ptr;
+  FunctionType * function_ptr;
+  unsigned long cycles;
+
+  while ((Depth > 0) && (stack_pointer(avr) > Frames[Depth - 1].sp))
+  {
+    frame_ptr = &Frames[--Depth];
+    function_ptr = frame_ptr->function_ptr;
+    cycles = (avr->cycle - frame_ptr->start) - (IsrCycles - frame_ptr->isr_cycles_at_start);
+    if (function_ptr->is_isr)
+    {
+      IsrCycles += cycles;
+    }
+    count_cycles(function_ptr, cycles);
+  }
+}
+
+/* Opens a frame if the program counter is at the start of a function */
+static void enter_function(avr_t * avr)
+{
+  FunctionType * function_ptr;
+  uint16_t sp;
+
+  function_ptr = find_function(avr->pc);
+  sp = stack_pointer(avr);
+  if ((function_ptr == NULL) || (Depth >= MAX_DEPTH))
+  {
+    return;
+  }
+  /* A jump back to the start of the function that is running is not a call */
+  if ((Depth > 0) && (Frames[Depth - 1].function_ptr == function_ptr) && (Frames[Depth - 1].sp == sp))
+  {
+    return;
+  }
+  Frames[Depth].function_ptr = function_ptr;
+  Frames[Depth].sp = sp;
+  Frames[Depth].start = avr->cycle;
+  Frames[Depth].isr_cycles_at_start = IsrCycles;
+  Depth++;
+}
+
+static void run(avr_t * avr)
+{
+  unsigned long end_ms;
+  int next_event;
+  int state;
+  uint32_t pc;
+
+  end_ms = (NumEvents > 0) ? Events[NumEvents - 1].ms + 1000 : 1000;
+  next_event = 0;
+  state = cpu_Running;
+  while ((state != cpu_Done) && (state != cpu_Crashed) &&
+         (avr->cycle < (avr_cycle_count_t)end_ms * (SIM_FREQUENCY / 1000)))
+  {
+    while ((next_event < NumEvents) &&
+           (avr->cycle >= (avr_cycle_count_t)Events[next_event].ms * (SIM_FREQUENCY / 1000)))
+    {
+      avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(Events[next_event].port), Events[next_event].pin),
+                    Events[next_event].level);
+      next_event++;
+    }
+    pc = avr->pc;
+    state = avr_run(avr);
+    watch_interrupts_disabled(avr, pc);
+    if (avr->pc != pc)
+    {
+      leave_functions(avr);
+      enter_function(avr);
+    }
+  }
+  if (state == cpu_Crashed)
+  {
+    fprintf(stderr, "bench: the firmware crashed at 0x%04x\n", avr->pc);
+    exit(2);
+  }
+}
+
+/* Returns the number of functions that have got slower than the baseline */
+static int compare(const char * path, double tolerance)
+{
+  FILE * f;
+  char line[256];
+  char name[MAX_NAME];
+  unsigned long calls;
+  unsigned long min;
+  double mean;
+  unsigned long max;
+  int regressions;
+  int i;
+
+  f = fopen(path, "r");
+  if (f == NULL)
+  {
+    perror(path);
+    exit(2);
+  }
+  regressions = 0;
+  while (fgets(line, sizeof(line), f) != NULL)
+  {
+    if ((line[0] == '#') || (sscanf(line, "%47s %lu %lu %lf %lu", name, &calls, &min, &mean, &max) != 5))
+    {
+      continue;
+    }
+    for (i = 0; (i < NumFunctions) && (strcmp(Functions[i].name, name) != 0); i++)
+    {
+    }
+    if ((i == NumFunctions) || (Functions[i].calls == 0))
+    {
+      fprintf(stderr, "bench: %s is in the baseline but was not called\n", name);
+      continue;
+    }
+    if ((Functions[i].total / Functions[i].calls > mean * (1 + tolerance / 100)) ||
+        (Functions[i].max > max * (1 + tolerance / 100)))
+    {
+      fprintf(stderr, "bench: %s has got slower: mean %.1f max %lu, baseline mean %.1f max %lu\n",
+              name, Functions[i].total / Functions[i].calls, Functions[i].max, mean, max);
+      regressions++;
+    }
+  }
+  fclose(f);
+  return regressions;
+}
+
+int main(int argc, char ** argv)
+{
+  elf_firmware_t firmware;
+  avr_t * avr;
+  unsigned long max_irqoff;
+  int status;
+  int i;
+
+  if ((argc < 5) || (argc > 7))
+  {
+    fprintf(stderr, "usage: %s firmware.out symbols.txt script.txt max-irqoff [baseline.txt [tolerance%%]]\n",
+            argv[0]);
+    return 2;
+  }
+  max_irqoff = strtoul(argv[4], NULL, 10);
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(argv[1], &firmware) != 0)
+  {
+    fprintf(stderr, "bench: cannot read %s\n", argv[1]);
+    return 2;
+  }
+  avr = avr_make_mcu_by_name(SIM_MCU);
+  if (avr == NULL)
+  {
+    fprintf(stderr, "bench: simavr does not know the %s\n", SIM_MCU);
+    return 2;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = SIM_FREQUENCY;
+
+  load_symbols(argv[2]);
+  load_script(argv[3]);
+  run(avr);
+
+  printf("# name calls min mean max (cycles at %d Hz)\n", SIM_FREQUENCY);
+  status = 0;
+  if (LongestIrqOffSite != NULL)
+  {
+    printf("# interrupts were disabled for at most %lu cycles, in %s, against at most %lu\n",
+           LongestIrqOffSite->max, LongestIrqOffSite->name + strlen(IRQOFF_PREFIX), max_irqoff);
+    if ((max_irqoff != 0) && (LongestIrqOffSite->max > max_irqoff))
+    {
+      fprintf(stderr, "bench: interrupts were disabled for too long in %s\n",
+              LongestIrqOffSite->name + strlen(IRQOFF_PREFIX));
+      status = 1;
+    }
+  }
+  for (i = 0; i < NumFunctions; i++)
+  {
+    if (Functions[i].calls > 0)
+    {
+      printf("%s %lu %lu %.1f %lu\n", Functions[i].name, Functions[i].calls,
+             Functions[i].min, Functions[i].total / Functions[i].calls, Functions[i].max);
+    }
+  }
+
+  if ((argc >= 6) && (compare(argv[5], (argc == 7) ? atof(argv[6]) : 0) != 0))
+  {
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,324 @@
+/*
+ * latency.c - measures the time from an end-of-turn press to the tick and the turn marker
+ *
+ * Runs the real ELF under simavr and presses end-of-turn inputs 1 and 2 in turn, at random
+ * intervals and with random contact bounce. For each press it times, from the first edge,
+ * the first toggle of OC1A (the tick) and the first write of a '*' turn marker to a place
+ * on the display that did not already show one. The display is followed by decoding the
+ * HD44780 commands and data on the LCD pins.
+ *
+ * Usage: latency firmware.out [presses [seed]]
+ *
+ * This has never been run, as it was written without simavr or avr-gcc to hand, so there are
+ * no figures from it yet, and nothing in the tree depends on any. 'make crediting' gives the
+ * figures of the host simulation, which are to within a timer count and leave out the cycles
+ * that the code takes.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/sim_irq.h>
+#include <simavr/avr_ioport.h>
+#include <simavr/avr_eeprom.h>
+
+#define SIM_MCU       "atmega88"   /* simavr has no ATmega88PA, but the registers are the same */
+#define SIM_FREQUENCY 1000000
+#define US(us)        ((avr_cycle_count_t)(us) * (SIM_FREQUENCY / 1000000))
+#define MS(ms)        ((avr_cycle_count_t)(ms) * (SIM_FREQUENCY / 1000))
+
+/* Register addresses in data space */
+#define ADDR_PORTC 0x28
+
+/* LCD pins (see lcd.h): data on PC0 to PC3, RS on PC4, RW on PC5, E on PD0 */
+#define LCD_DATA_MASK 0x0F
+#define LCD_RS_BIT    4
+#define LCD_RW_BIT    5
+
+/* A press that shows nothing within this long is counted as missed */
+#define TIMEOUT_MS 500
+
+/* The minutes that each countdown is given, long enough for no flag to fall */
+#define START_MINUTES 99
+
+static avr_t * avr;
+
+/* Last levels of the pins that are watched */
+static uint8_t lcd_enable_level;
+static uint8_t oc1a_level;
+
+/* Display state decoded from the LCD pins */
+static uint8_t lcd_four_bit;
+static uint8_t lcd_phase;
+static uint8_t lcd_high_nibble;
+static uint8_t lcd_addr;
+static uint8_t lcd_ddram[0x80];
+
+/* Times of the first tick and marker since the last press, or 0 */
+static avr_cycle_count_t press_time;
+static avr_cycle_count_t tick_time;
+static avr_cycle_count_t marker_time;
+
+static void lcd_byte(uint8_t rs, uint8_t value)
+{
+  if (rs)
+  {
+    if ((value == '*') && (lcd_ddram[lcd_addr] != '*') && (marker_time == 0))
+    {
+      marker_time = avr->cycle;
+    }
+    lcd_ddram[lcd_addr] = value;
+    lcd_addr = (lcd_addr + 1) & 0x7F;
+  }
+  else if (value & 0x80)
+  {
+    lcd_addr = value & 0x7F;   /* set DDRAM address */
+  }
+  else if (value == 0x01)
+  {
+    memset(lcd_ddram, ' ', sizeof(lcd_ddram));   /* clear display */
+    lcd_addr = 0;
+  }
+  else if ((value & 0xFE) == 0x02)
+  {
+    lcd_addr = 0;   /* return home */
+  }
+}
+
+/* The LCD latches the bus on the falling edge of E */
+static void lcd_enable_changed(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+  uint8_t port;
+  uint8_t nibble;
+  uint8_t rs;
+  uint8_t rw;
+
+  if ((value != 0) || (lcd_enable_level == 0))
+  {
+    lcd_enable_level = value;
+    return;
+  }
+  lcd_enable_level = 0;
+  port = avr->data[ADDR_PORTC];
+  nibble = port & LCD_DATA_MASK;
+  rs = (port >> LCD_RS_BIT) & 1;
+  rw = (port >> LCD_RW_BIT) & 1;
+
+  if (!lcd_four_bit)
+  {
+    /* Until it is told otherwise the LCD takes a byte for each E pulse,
+       and only sees the high nibble */
+    if (!rw && !rs && (nibble == 0x2))
+    {
+      lcd_four_bit = 1;
+      lcd_phase = 0;
+    }
+    return;
+  }
+
+  if (lcd_phase == 0)
+  {
+    lcd_high_nibble = nibble;
+    lcd_phase = 1;
+  }
+  else
+  {
+    lcd_phase = 0;
+    if (!rw)
+    {
+      lcd_byte(rs, (lcd_high_nibble << 4) | nibble);
+    }
+  }
+}
+
+static void oc1a_changed(struct avr_irq_t * irq, uint32_t value, void * param)
+{
+  if (value == oc1a_level)
+  {
+    return;
+  }
+  oc1a_level = value;
+  if ((press_time != 0) && (tick_time == 0))
+  {
+    tick_time = avr->cycle;
+  }
+}
+
+static void run_until(avr_cycle_count_t cycle)
+{
+  int state;
+  while (avr->cycle < cycle)
+  {
+    state = avr_run(avr);
+    if ((state == cpu_Done) || (state == cpu_Crashed))
+    {
+      fprintf(stderr, "latency: the firmware stopped at 0x%04x\n", avr->pc);
+      exit(2);
+    }
+  }
+}
+
+/* Changes the level of an input, with bounce */
+static void set_input(avr_irq_t * irq, uint8_t level)
+{
+  int bounces;
+  bounces = rand() % 4;
+  avr_raise_irq(irq, level);
+  while (bounces-- > 0)
+  {
+    run_until(avr->cycle + US(50 + rand() % 750));
+    avr_raise_irq(irq, !level);
+    run_until(avr->cycle + US(50 + rand() % 750));
+    avr_raise_irq(irq, level);
+  }
+}
+
+static int compare_cycles(const void * a, const void * b)
+{
+  avr_cycle_count_t x = *(const avr_cycle_count_t *)a;
+  avr_cycle_count_t y = *(const avr_cycle_count_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void report(const char * name, avr_cycle_count_t * latencies, int count)
+{
+  if (count == 0)
+  {
+    printf("%-8s    -       -       -\n", name);
+    return;
+  }
+  qsort(latencies, count, sizeof(latencies[0]), compare_cycles);
+  printf("%-8s %7.2f %7.2f %7.2f\n", name,
+         latencies[count / 2] * 1000.0 / SIM_FREQUENCY,
+         latencies[(count * 99) / 100] * 1000.0 / SIM_FREQUENCY,
+         latencies[count - 1] * 1000.0 / SIM_FREQUENCY);
+}
+
+static void set_pin(char port, int pin, uint8_t level)
+{
+  avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), pin), level);
+}
+
+int main(int argc, char ** argv)
+{
+  elf_firmware_t firmware;
+  avr_eeprom_desc_t eeprom;
+  uint8_t eeprom_settings[8];
+  avr_irq_t * eot_irq[2];
+  avr_cycle_count_t * tick_latencies;
+  avr_cycle_count_t * marker_latencies;
+  avr_cycle_count_t * both_latencies;
+  int presses;
+  int press;
+  int player;
+  int count;
+  int missed;
+  int i;
+
+  if ((argc < 2) || (argc > 4))
+  {
+    fprintf(stderr, "usage: %s firmware.out [presses [seed]]\n", argv[0]);
+    return 2;
+  }
+  presses = (argc >= 3) ? atoi(argv[2]) : 5000;
+  srand((argc >= 4) ? atoi(argv[3]) : 1);
+
+  memset(&firmware, 0, sizeof(firmware));
+  if (elf_read_firmware(argv[1], &firmware) != 0)
+  {
+    fprintf(stderr, "latency: cannot read %s\n", argv[1]);
+    return 2;
+  }
+  avr = avr_make_mcu_by_name(SIM_MCU);
+  if (avr == NULL)
+  {
+    fprintf(stderr, "latency: simavr does not know the %s\n", SIM_MCU);
+    return 2;
+  }
+  avr_init(avr);
+  avr_load_firmware(avr, &firmware);
+  avr->frequency = SIM_FREQUENCY;
+
+  /* With no settings log in the EEPROM, the firmware takes the minutes and seconds
+     of each countdown from bytes 0 to 7 */
+  for (i = 0; i < 4; i++)
+  {
+    eeprom_settings[i * 2] = START_MINUTES;
+    eeprom_settings[i * 2 + 1] = 0;
+  }
+  eeprom.ee = eeprom_settings;
+  eeprom.offset = 0;
+  eeprom.size = sizeof(eeprom_settings);
+  avr_ioctl(avr, AVR_IOCTL_EEPROM_SET, &eeprom);
+
+  /* Idle levels: end-of-turn inputs 3 and 4 are not fitted, restart, pause and copy are
+     active low, and the LCD busy flag always reads as ready */
+  set_pin('D', 1, 0);
+  set_pin('D', 2, 0);
+  set_pin('D', 4, 0);
+  set_pin('D', 7, 1);
+  set_pin('B', 0, 1);
+  set_pin('B', 2, 0);
+  set_pin('B', 3, 1);
+  set_pin('B', 4, 1);
+  set_pin('B', 5, 1);
+  set_pin('C', 3, 0);
+
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 0), lcd_enable_changed, NULL);
+  avr_irq_register_notify(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), 1), oc1a_changed, NULL);
+  eot_irq[0] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 1);
+  eot_irq[1] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), 2);
+
+  tick_latencies = malloc(presses * sizeof(avr_cycle_count_t));
+  marker_latencies = malloc(presses * sizeof(avr_cycle_count_t));
+  both_latencies = malloc(presses * sizeof(avr_cycle_count_t));
+  if ((tick_latencies == NULL) || (marker_latencies == NULL) || (both_latencies == NULL))
+  {
+    return 2;
+  }
+
+  run_until(MS(1000));
+
+  count = 0;
+  missed = 0;
+  player = 0;
+  for (press = 0; press < presses; press++)
+  {
+    /* The player to move ends their turn */
+    tick_time = 0;
+    marker_time = 0;
+    press_time = avr->cycle;
+    set_input(eot_irq[player], 1);
+    run_until(press_time + MS(60 + rand() % 190));
+    set_input(eot_irq[player], 0);
+    run_until(press_time + MS(TIMEOUT_MS));
+
+    if ((tick_time != 0) && (marker_time != 0))
+    {
+      tick_latencies[count] = tick_time - press_time;
+      marker_latencies[count] = marker_time - press_time;
+      both_latencies[count] = (tick_time > marker_time ? tick_time : marker_time) - press_time;
+      count++;
+      player = !player;
+    }
+    else
+    {
+      missed++;
+    }
+    press_time = 0;
+
+    /* Think */
+    run_until(avr->cycle + MS(rand() % 700));
+  } /* end for all presses */
+
+  printf("%d presses, %d missed\n", presses, missed);
+  printf("latency      p50     p99     max (ms)\n");
+  report("tick", tick_latencies, count);
+  report("marker", marker_latencies, count);
+  report("both", both_latencies, count);
+  return (missed != 0);
+}
@@ -0,0 +1,271 @@
+/*
+ * checkpoint.c
+ */
+
+#include <stdint.h>
+#include <util/crc16.h>
+
+#include "timer.h"
+#include "checkpoint.h"
+#include "eeprom.h"
+
+/* The state of the game is kept in EEPROM as a log of small records, one for each field
+   that has changed, written into the record after the last one and round the log again.
+
+   Record layout:
+     0     sequence number, one more than that of the record before
+     1     field: COUNTDOWN_1 to COUNTDOWN_4 for the remaining time, FIELD_MOVES for the moves
+           made on countdowns 1 and 2, FIELD_MOVES + 1 for 3 and 4, FIELD_TURN_START for the
+           time at the start of the turn on countdowns 1 and 2, FIELD_TURN_START + 1 for 3
+           and 4, or FIELD_FLAGS
+     2..4  value, low byte first
+     5     CRC-8 of all of the above
+
+   Each checkpoint ends with a FIELD_FLAGS record, which commits it. Records after the last
+   commit are from a checkpoint that was cut short, and are not used. A record that has not
+   changed is rewritten now and then anyway, so that the log always holds its latest value.
+
+   Time: a move changes the remaining time and the moves of the player who moved, the
+   remaining time of the other player under a delay, the start of the turn and the running
+   flags, and one more record is refreshed, so it takes at most 6 records, or 36 bytes. Each
+   byte takes 3.4ms to write, so that is about 120ms of writing, and more than twice what the
+   queue in eeprom.c holds. So the records
+   are queued only while there is room for a whole one, and the rest once the queue has been
+   written, from poll_eeprom(). write_eeprom() then never has to wait for room. A checkpoint
+   that changes nothing, such as a second RESTART or turning on with a new game, writes nothing.
+
+   Endurance: pausing and resuming take 2 or 3 records, and each of them is between two moves,
+   so count 6 records a move. The 63 records of the log then go round once every 10.5 moves, so
+   each byte of the log is written once every 10.5 moves. A 6 hour game at one move every 10
+   seconds by either player is 2160 moves, or about 210 writes to each byte. The EEPROM is good
+   for 100000 writes, which is about 480 such games. Giving some of the log to the move log
+   (MOVE_LOG_EEPROM_SIZE) shortens that in proportion. */
+#define RECORD_SIZE 6
+#define NUM_RECORDS (CHECKPOINT_LOG_SIZE / RECORD_SIZE)
+
+#define RECORD_SEQUENCE 0
+#define RECORD_FIELD    1
+#define RECORD_VALUE    2
+#define RECORD_CRC      5
+
+#define FIELD_MOVES      NUM_COUNTDOWNS
+#define FIELD_TURN_START (FIELD_MOVES + NUM_COUNTDOWNS / 2)
+#define FIELD_FLAGS      (FIELD_TURN_START + NUM_COUNTDOWNS / 2)
+#define NUM_FIELDS       (FIELD_FLAGS + 1)
+
+/* Not a value that fits in a record, so a field with it is always written */
+#define NOT_SAVED       0xFFFFFFFFUL
+
+static uint32_t saved[NUM_FIELDS];  /* values in the log */
+static uint8_t next_record;
+static uint8_t next_sequence;
+static uint8_t refresh_field;
+
+static CheckpointType pending;      /* the checkpoint being written */
+static uint8_t pending_field;       /* its next field to write, or NUM_FIELDS once committed */
+
+static uint16_t record_addr(uint8_t record)
+{
+  return CHECKPOINT_LOG_START + (uint16_t)record * RECORD_SIZE;
+}
+
+/* Reads a record. Returns non-zero if it is valid */
+static uint8_t read_record(uint8_t record, uint8_t * sequence_ptr, uint8_t * field_ptr, uint32_t * value_ptr)
+{
+  uint8_t bytes[RECORD_SIZE];
+  uint8_t crc;
+  uint8_t i;
+
+  crc = 0;
+  for (i = 0; i < RECORD_SIZE; i++)
+  {
+    bytes[i] = read_eeprom(record_addr(record) + i);
+    if (i < RECORD_CRC)
+    {
+      crc = _crc_ibutton_update(crc, bytes[i]);
+    }
+  }
+  *sequence_ptr = bytes[RECORD_SEQUENCE];
+  *field_ptr = bytes[RECORD_FIELD];
+  *value_ptr = bytes[RECORD_VALUE] | ((uint16_t)bytes[RECORD_VALUE + 1] << 8) |
+               ((uint32_t)bytes[RECORD_VALUE + 2] << 16);
+  return ((crc == bytes[RECORD_CRC]) && (bytes[RECORD_FIELD] < NUM_FIELDS));
+}
+
+static void write_record(uint8_t field, uint32_t value)
+{
+  uint8_t bytes[RECORD_SIZE];
+  uint8_t crc;
+  uint8_t i;
+
+  bytes[RECORD_SEQUENCE] = next_sequence;
+  bytes[RECORD_FIELD] = field;
+  bytes[RECORD_VALUE] = value;
+  bytes[RECORD_VALUE + 1] = value >> 8;
+  bytes[RECORD_VALUE + 2] = value >> 16;
+  crc = 0;
+  for (i = 0; i < RECORD_CRC; i++)
+  {
+    crc = _crc_ibutton_update(crc, bytes[i]);
+  }
+  bytes[RECORD_CRC] = crc;
+
+  for (i = 0; i < RECORD_SIZE; i++)
+  {
+    write_eeprom(record_addr(next_record) + i, bytes[i]);
+  }
+  saved[field] = value;
+  next_record = (next_record + 1) % NUM_RECORDS;
+  next_sequence++;
+}
+
+uint8_t init_checkpoint(CheckpointType * checkpoint_ptr)
+{
+  uint8_t record;
+  uint8_t sequence;
+  uint8_t field;
+  uint32_t value;
+  uint8_t commit_sequence;
+  uint8_t commit_record;
+  uint8_t found;
+  int8_t newest[NUM_FIELDS];
+
+  /* Find the last commit. The log is shorter than half the range of the sequence numbers,
+     so the last is the one that the others are all behind */
+  found = 0;
+  commit_sequence = 0;
+  commit_record = NUM_RECORDS - 1;
+  for (record = 0; record < NUM_RECORDS; record++)
+  {
+    if (read_record(record, &sequence, &field, &value) && (field == FIELD_FLAGS))
+    {
+      if ((!found) || ((int8_t)(sequence - commit_sequence) > 0))
+      {
+        found = 1;
+        commit_sequence = sequence;
+        commit_record = record;
+      }
+    }
+  } /* end for all records */
+
+  /* Carry on after it, writing over anything that was cut short */
+  next_record = (commit_record + 1) % NUM_RECORDS;
+  next_sequence = commit_sequence + 1;
+  pending_field = NUM_FIELDS;
+  for (field = 0; field < NUM_FIELDS; field++)
+  {
+    saved[field] = NOT_SAVED;
+    newest[field] = -1;
+  }
+  if (!found)
+  {
+    return 0;
+  }
+
+  /* Take the latest value of each field up to the commit */
+  for (record = 0; record < NUM_RECORDS; record++)
+  {
+    uint8_t record_field;
+    if (read_record(record, &sequence, &record_field, &value))
+    {
+      int8_t age;
+      age = commit_sequence - sequence;
+      if ((age >= 0) && ((newest[record_field] < 0) || (age < newest[record_field])))
+      {
+        newest[record_field] = age;
+        saved[record_field] = value;
+      }
+    }
+  } /* end for all records */
+
+  for (field = 0; field < NUM_FIELDS; field++)
+  {
+    if (newest[field] < 0)
+    {
+      return 0;
+    }
+  }
+
+  for (field = 0; field < NUM_COUNTDOWNS; field++)
+  {
+    checkpoint_ptr->remaining[field] = saved[field];
+  }
+  for (field = 0; field < NUM_COUNTDOWNS; field++)
+  {
+    checkpoint_ptr->moves[field] = saved[FIELD_MOVES + field / 2] >> ((field % 2) * 8);
+  }
+  for (field = 0; field < NUM_COUNTDOWNS / 2; field++)
+  {
+    checkpoint_ptr->turn_start[field] = saved[FIELD_TURN_START + field];
+  }
+  checkpoint_ptr->running = saved[FIELD_FLAGS] & 0x0F;
+  checkpoint_ptr->was_running = (saved[FIELD_FLAGS] >> 4) & 0x0F;
+  return ((checkpoint_ptr->running | checkpoint_ptr->was_running) != 0);
+}
+
+static uint32_t field_value(const CheckpointType * checkpoint_ptr, uint8_t field)
+{
+  if (field < FIELD_MOVES)
+  {
+    return checkpoint_ptr->remaining[field];
+  }
+  if (field < FIELD_TURN_START)
+  {
+    return checkpoint_ptr->moves[(field - FIELD_MOVES) * 2] |
+           ((uint16_t)checkpoint_ptr->moves[(field - FIELD_MOVES) * 2 + 1] << 8);
+  }
+  if (field < FIELD_FLAGS)
+  {
+    return checkpoint_ptr->turn_start[field - FIELD_TURN_START];
+  }
+  return (checkpoint_ptr->running & 0x0F) | ((checkpoint_ptr->was_running & 0x0F) << 4);
+}
+
+/* Queues the records of the pending checkpoint that there is room for, and has the rest
+   queued once the EEPROM has written them */
+static void write_pending(void)
+{
+  uint32_t value;
+
+  while ((pending_field < NUM_FIELDS) && (eeprom_queue_space() >= RECORD_SIZE))
+  {
+    value = field_value(&pending, pending_field);
+    if ((pending_field == FIELD_FLAGS) || (value != saved[pending_field]) ||
+        (pending_field == refresh_field))
+    {
+      write_record(pending_field, value);
+    }
+    if (pending_field == FIELD_FLAGS)
+    {
+      refresh_field = (refresh_field + 1) % FIELD_FLAGS;
+    }
+    pending_field++;
+  }
+  if (pending_field < NUM_FIELDS)
+  {
+    eeprom_when_written(write_pending);
+  }
+}
+
+void save_checkpoint(const CheckpointType * checkpoint_ptr)
+{
+  uint8_t field;
+
+  /* Nothing to do if it is what the log already holds */
+  if (pending_field >= NUM_FIELDS)
+  {
+    for (field = 0; (field < NUM_FIELDS) && (field_value(checkpoint_ptr, field) == saved[field]); field++)
+    {
+    }
+    if (field == NUM_FIELDS)
+    {
+      return;
+    }
+  }
+
+  /* A checkpoint that is still being written has not been committed, so it is
+     replaced, and any of its records that are still right are not written again */
+  pending = *checkpoint_ptr;
+  pending_field = 0;
+  write_pending();
+}
@@ -0,0 +1,24 @@
+/*
+ * checkpoint.h
+ *
+ * Needs timer.h
+ */
+
+typedef struct
+{
+  uint32_t remaining[NUM_COUNTDOWNS];  /* milliseconds */
+  uint8_t running;                     /* bit for each running countdown */
+  uint8_t was_running;                 /* bit for each countdown that was running when paused */
+  uint8_t moves[NUM_COUNTDOWNS];       /* moves made on each countdown, for the time control */
+  uint32_t turn_start[NUM_COUNTDOWNS / 2];  /* time_control_turn_start() of the player to move
+                                               on countdowns 1 and 2, and on 3 and 4 */
+} CheckpointType;
+
+/* Loads the last checkpoint from EEPROM.
+   Returns non-zero if there is one of a game that was still being played */
+uint8_t init_checkpoint(CheckpointType * checkpoint_ptr);
+
+/* Saves the parts of the checkpoint that have changed since the last one. The records are
+   written in the background, a few at a time, so this returns at once. Needs init_checkpoint()
+   to have been called */
+void save_checkpoint(const CheckpointType * checkpoint_ptr);
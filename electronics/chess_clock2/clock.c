@@ -12,18 +12,20 @@
 #include "input.h"
 #include "audio.h"
 #include "turnled.h"
-#include "eeprom.h"
+#include "settings.h"
+#include "timecontrols.h"
+#include "timecontrol.h"
+#include "checkpoint.h"
+#include "serial.h"
+#include "movelog.h"
+#include "diagnostics.h"
+#include "profile.h"
+#include "trace.h"
 #include "clock.h"
 
 /* Saves which countdowns were running when paused */
 static uint8_t was_running;
 
-enum {
-  PLAY_MODE, /* default mode */
-  WON_MODE,
-  SETUP_MODE,
-  NUM_MODES
-};
 static uint8_t mode;
 
 /* Flag that indicates if the whole display should be updated in PLAY mode */
@@ -37,6 +39,10 @@ static uint8_t selected_countdown;
 #define MAX_DIGITS 4
 static uint8_t selected_digit;
 
+/* Time control chosen in SETUP mode, and whether UP and DOWN are choosing it */
+static uint8_t selected_control;
+static uint8_t selecting_control;
+
 enum {
   CODE_1,
   CODE_2,
@@ -158,44 +164,92 @@ static const PROGMEM uint8_t charmaps [NUM_CODES*BYTES_PER_CHAR] =
     PATTERN______,
 };
 
+/* Saves the state of the game, so that it can be resumed after a loss of power */
+static void checkpoint_game(void)
+{
+  CheckpointType checkpoint;
+  CountdownSnapshotType snapshot;
+  uint8_t id;
+  snapshot_countdowns(&snapshot);
+  for (id = 0; id < NUM_COUNTDOWNS / 2; id++)
+  {
+    checkpoint.turn_start[id] = 0;
+  }
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    checkpoint.remaining[id] = snapshot.remaining[id];
+    checkpoint.moves[id] = time_control_moves(id);
+    if ((snapshot.running | was_running) & (1<<id))
+    {
+      checkpoint.turn_start[id / 2] = time_control_turn_start(id);
+    }
+  }
+  checkpoint.running = snapshot.running;
+  checkpoint.was_running = was_running;
+  save_checkpoint(&checkpoint);
+}
+
 static void restart(void)
 {
   uint8_t id;
-  uint8_t addr;
   uint8_t minutes;
   uint8_t seconds;
-  addr = 0;
+  save_move_log();
+  clear_move_log();
   for (id = 0; id < NUM_COUNTDOWNS; id++)
   {
-    minutes = read_eeprom(addr);
-    addr++;
-    seconds = read_eeprom(addr);
-    addr++;
-
-    if (minutes > 99)
-    {
-      minutes = 10; /* a sensible arbitrary default */
-    }
-    if (seconds > 59)
-    {
-      seconds = 0; /* a sensible arbitrary default */
-    }
-    set_countdown(id, minutes, seconds);
+    settings_time(id, &minutes, &seconds);
+    start_time_control(id, settings_control(), (minutes * 60U + seconds) * 1000UL);
     turnled_off(id);
   }
   was_running = 0;
   update_display = 1;
+  checkpoint_game();
 }
 
 void init_clock(void)
 {
   uint8_t i;
+  CheckpointType checkpoint;
   lcd_command(_BV(LCD_CGRAM));  /* set CG RAM start address 0 */
   for(i=0; i<NUM_CODES*BYTES_PER_CHAR; i++)
   {
     lcd_data(pgm_read_byte_near(&charmaps[i]));
   }
-  restart();
+
+  if (init_checkpoint(&checkpoint))
+  {
+    /* A game was cut short, so offer to resume it as if it had been paused.
+       PAUSE carries on with it, and RESTART starts a new one */
+    for (i = 0; i < NUM_COUNTDOWNS; i++)
+    {
+      set_countdown_remaining(i, checkpoint.remaining[i]);
+      resume_time_control(i, settings_control(), checkpoint.moves[i]);
+    }
+    was_running = checkpoint.running | checkpoint.was_running;
+    for (i = 0; i < NUM_COUNTDOWNS; i++)
+    {
+      if (was_running & (1<<i))
+      {
+        resume_turn(i, checkpoint.turn_start[i / 2]);
+        turnled_on(i);
+      }
+    }
+    update_display = 1;
+  }
+  else
+  {
+    restart();
+  }
+}
+
+/* Gets the time to show for a countdown, in whole minutes and seconds */
+static void display_time(uint8_t id, uint8_t * minutes_ptr, uint8_t * seconds_ptr)
+{
+  uint16_t seconds;
+  seconds = time_control_remaining(id) / 1000;
+  *minutes_ptr = seconds / 60;
+  *seconds_ptr = seconds % 60;
 }
 
 static void showturn(uint8_t id)
@@ -242,6 +296,10 @@ static void showplaytime(uint8_t minutes, uint8_t seconds, uint8_t invert)
     }
     else
     {
+      if (minutes >= 100)
+      {
+        lcd_putc(pgm_read_byte_near(&invertmap[buffer[2]-'0']));
+      }
       lcd_putc(pgm_read_byte_near(&invertmap[buffer[1]-'0']));
       lcd_putc(pgm_read_byte_near(&invertmap[buffer[0]-'0']));
     }
@@ -266,17 +324,15 @@ static void showplaytime(uint8_t minutes, uint8_t seconds, uint8_t invert)
   }
 }
 
-static void update_play(uint8_t id)
+/* Kept out of line for bench/bench.c, which only sees functions that have a symbol */
+static __attribute__((noinline)) void update_play(uint8_t id)
 {
   uint8_t minutes;
   uint8_t seconds;
   uint8_t invert;
 
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-  {
-    minutes = Countdown[id].minutes;
-    seconds = Countdown[id].seconds;
-  }
+  /* From 100 minutes the time takes the space between it and the edge of the display */
+  display_time(id, &minutes, &seconds);
 
   lcd_gotoxy(8 * (id%2), id/2);
 
@@ -299,7 +355,10 @@ static void update_play(uint8_t id)
   }
   else
   {
-    lcd_putc(' ');
+    if (minutes < 100)
+    {
+      lcd_putc(' ');
+    }
     invert = 1;
   }
 
@@ -315,7 +374,7 @@ static void update_play(uint8_t id)
     showturn(3);
     lcd_putc(CODE_B);
   }
-  else
+  else if (minutes < 100)
   {
     lcd_putc(' ');
   }
@@ -355,6 +414,40 @@ static void setup_cursor(void)
   lcd_gotoxy(x,y);
 }      
 
+uint8_t clock_mode(void)
+{
+  return mode;
+}
+
+/* A dump holds up the main loop for seconds, so it is only made once the game is won or
+   while it is paused. Not on a bus, where it would talk over the other clocks, and a board
+   made for the bus has no other way out */
+static uint8_t can_dump(void)
+{
+  uint8_t id;
+  if (((mode != WON_MODE) && (was_running == 0)) || serial_on_bus())
+  {
+    return 0;
+  }
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    if (countdown_is_running(id))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* A press of a player's end-of-turn input that began before their flag fell is only passed
+   on once it has been debounced, and then it undoes the flag (see end_turn()). Until then
+   the flag waits for it. Countdown id is timed by end-of-turn input id */
+static uint8_t flag_waits_for_press(uint8_t id)
+{
+  TickTimeType pressed;
+  return input_pending_time(id, &pressed) && !countdown_expired_by(id, &pressed);
+}
+
 void poll_clock(void)
 {
   if (mode == PLAY_MODE)
@@ -377,86 +470,85 @@ void poll_clock(void)
       }
     }
 
+    /* The flag is a single byte, so it can be read with interrupts enabled.
+       Each of the calls below disables them only for as long as it needs to,
+       and the countdowns are read without disabling them at all */
     id = 0;
     while (id < num_ids)
     {
-      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      if (countdown_has_expired(id) && !flag_waits_for_press(id))
       {
-        if (countdown_has_expired(id))
+        mode = WON_MODE;
+        log_flag(id);
+        for (id = 0; id < NUM_COUNTDOWNS; id++)
         {
-          mode = WON_MODE;
-          for (id = 0; id < NUM_COUNTDOWNS; id++)
-          {
-            stop_countdown(id);
-            turnled_off(id);
-          }
-          update_display = 1;
-          play(tada);
+          stop_turn(id);
+          turnled_off(id);
         }
+        was_running = 0;
+        update_display = 1;
+        play(tada);
+        save_move_log();
       }
       id++;
     } /* end for all countdowns */
 
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    if (mode == WON_MODE)
     {
-      force_update = update_display;
-      update_display = 0;
+      /* The game is over, so there is nothing to resume */
+      checkpoint_game();
     }
+
+    force_update = update_display;
+    update_display = 0;
     for (id = 0; id < NUM_COUNTDOWNS; id++)
     {
-      if (force_update || prev_second[id] != Countdown[id].seconds)
+      uint8_t minutes;
+      uint8_t seconds;
+      display_time(id, &minutes, &seconds);
+      if (force_update || prev_second[id] != seconds)
       {
         update_play(id);
-        prev_second[id] = Countdown[id].seconds;
+        prev_second[id] = seconds;
       }
     } /* end for all countdowns */
   } /* end if play mode */
 }
 
+/* Passes the move to the other player as at the moment the input was pressed,
+   so that the debounce time is not charged to the player who moved. If their flag
+   fell after that moment, but before the press was debounced, the move still counts */
+static void end_turn(uint8_t input, uint8_t stop_id, uint8_t start_id)
+{
+  TickTimeType pressed;
+  input_time(input, &pressed);
+  if (countdown_expired_by(stop_id, &pressed))
+  {
+    return;
+  }
+  play(tick);
+  turnled_off(stop_id);
+  turnled_on(start_id);
+  pass_turn(stop_id, start_id, &pressed);
+  checkpoint_game();
+}
+
 static void play_mode_input_asserted(uint8_t id)
 {
   update_display = 1;
   switch(id)
   {
   case INPUT_EOT1:
-    if (! countdown_has_expired(COUNTDOWN_1))
-    {
-      play(tick);
-      turnled_off(TURNLED_1);
-      turnled_on(TURNLED_2);
-      stop_countdown(COUNTDOWN_1);
-      start_countdown(COUNTDOWN_2);
-    }
+    end_turn(INPUT_EOT1, COUNTDOWN_1, COUNTDOWN_2);
     break;
   case INPUT_EOT2:
-    if (! countdown_has_expired(COUNTDOWN_2))
-    {
-      play(tick);
-      turnled_off(TURNLED_2);
-      turnled_on(TURNLED_1);
-      stop_countdown(COUNTDOWN_2);
-      start_countdown(COUNTDOWN_1);
-    }
+    end_turn(INPUT_EOT2, COUNTDOWN_2, COUNTDOWN_1);
     break;
   case INPUT_EOT3:
-    if (! countdown_has_expired(COUNTDOWN_3))
-    {
-      play(tick);
-      turnled_off(TURNLED_3);
-      turnled_on(TURNLED_4);
-      stop_countdown(COUNTDOWN_3);
-      start_countdown(COUNTDOWN_4);
-    }
+    end_turn(INPUT_EOT3, COUNTDOWN_3, COUNTDOWN_4);
     break;
   case INPUT_EOT4:
-    if (! countdown_has_expired(COUNTDOWN_4))
-    {
-      play(tick);
-      turnled_off(TURNLED_4);
-      turnled_on(TURNLED_3);
-      stop_countdown(COUNTDOWN_4);
-      start_countdown(COUNTDOWN_3);
-    }
+    end_turn(INPUT_EOT4, COUNTDOWN_4, COUNTDOWN_3);
     break;
   case INPUT_PAUSE:
     if (was_running == 0)
@@ -479,7 +571,9 @@ static void play_mode_input_asserted(uint8_t id)
           start_countdown(id);
         }
       }
+      was_running = 0;
     }
+    checkpoint_game();
     break;
   case INPUT_RESTART:
     restart();
@@ -498,10 +592,70 @@ static void add_to_digit(uint8_t * digit_ptr, int8_t delta)
   }
 }
 
+static void add_to_selected_digit(int8_t delta)
+{
+  uint8_t minutes;
+  uint8_t seconds;
+  countdown_time(selected_countdown, &minutes, &seconds);
+  if (selected_digit < FIRST_SECONDS_DIGIT)
+  {
+    add_to_digit(&minutes, delta);
+  }
+  else
+  {
+    add_to_digit(&seconds, delta);
+  }
+  set_countdown(selected_countdown, minutes, seconds);
+}
+
+static void copy_countdown(uint8_t to, uint8_t from)
+{
+  uint8_t minutes;
+  uint8_t seconds;
+  countdown_time(from, &minutes, &seconds);
+  set_countdown(to, minutes, seconds);
+}
+
+/* Shows the time control being chosen on the second line, with the cursor at its start */
+static void show_control(void)
+{
+  lcd_gotoxy(0, 1);
+  lcd_puts_p(time_control_name(selected_control));
+  lcd_gotoxy(0, 1);
+}
+
 static void setup_mode_input_asserted(uint8_t id)
 {
   int8_t delta;
   uint8_t other_countdown;
+
+  /* PAUSE switches UP and DOWN between setting the times and choosing the time control */
+  if (selecting_control)
+  {
+    if (id == INPUT_UP)
+    {
+      selected_control = (selected_control + 1) % NUM_TIME_CONTROLS;
+      show_control();
+      return;
+    }
+    if (id == INPUT_DOWN)
+    {
+      selected_control = (selected_control + NUM_TIME_CONTROLS - 1) % NUM_TIME_CONTROLS;
+      show_control();
+      return;
+    }
+
+    /* Put the second line back */
+    selecting_control = 0;
+    update_play(COUNTDOWN_3);
+    update_play(COUNTDOWN_4);
+    if (id == INPUT_PAUSE)
+    {
+      setup_cursor();
+      return;
+    }
+  }
+
   switch(id)
   {
   case INPUT_EOT1:
@@ -591,14 +745,7 @@ static void setup_mode_input_asserted(uint8_t id)
         delta = -1;
       }
     }
-    if (selected_digit < FIRST_SECONDS_DIGIT)
-    {
-      add_to_digit(&Countdown[selected_countdown].minutes, delta);
-    }
-    else
-    {
-      add_to_digit(&Countdown[selected_countdown].seconds, delta);
-    }
+    add_to_selected_digit(delta);
     update_play(selected_countdown);
     setup_cursor();
     break;
@@ -625,24 +772,20 @@ static void setup_mode_input_asserted(uint8_t id)
         delta = 1;
       }
     }
-    if (selected_digit < FIRST_SECONDS_DIGIT)
-    {
-      add_to_digit(&Countdown[selected_countdown].minutes, delta);
-    }
-    else
-    {
-      add_to_digit(&Countdown[selected_countdown].seconds, delta);
-    }
+    add_to_selected_digit(delta);
     update_play(selected_countdown);
     setup_cursor();
     break;
   case INPUT_COPY:
     other_countdown = selected_countdown ^ 1;
-    Countdown[other_countdown].minutes = Countdown[selected_countdown].minutes;
-    Countdown[other_countdown].seconds = Countdown[selected_countdown].seconds;
+    copy_countdown(other_countdown, selected_countdown);
     update_play(other_countdown);
     setup_cursor();
     break;
+  case INPUT_PAUSE:
+    selecting_control = 1;
+    show_control();
+    break;
   case INPUT_RESTART:
     mode = PLAY_MODE;
 
@@ -662,37 +805,25 @@ void input_asserted(uint8_t id)
   switch (mode)
   {
   case PLAY_MODE:
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-    {
-      play_mode_input_asserted(id);
-    } /* end of atomic block */
+    play_mode_input_asserted(id);
     break;
 
   case WON_MODE:
     if (id == INPUT_RESTART)
     {
-      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-      {
-        mode = PLAY_MODE;
-        restart();
-      }
+      mode = PLAY_MODE;
+      restart();
     }
     break;
 
   case SETUP_MODE:
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-    {
-      setup_mode_input_asserted(id);
-    } /* end of atomic block */
+    setup_mode_input_asserted(id);
     break;
 
   default:
     /* recover from illegal mode */
-    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
-    {
-      restart();
-      mode = PLAY_MODE;
-    } /* end of atomic block */
+    restart();
+    mode = PLAY_MODE;
     break;
     
   }
@@ -711,32 +842,66 @@ void input_long_push(uint8_t id)
       mode = SETUP_MODE;
       selected_countdown = 0;
       selected_digit = 0;
+      selected_control = settings_control();
+      selecting_control = 0;
       for (countdown = 0; countdown < NUM_COUNTDOWNS; countdown++)
       {
-        stop_countdown(countdown);
+        stop_turn(countdown);
         turnled_off(countdown);
       }
+      checkpoint_game();
 
       /* turn on cursor */
       lcd_command(LCD_DISP_ON_CURSOR);
       setup_cursor();
     }
+    else if (id == INPUT_UP)
+    {
+      /* Show the lost tick count on the second line, until the next input redraws it */
+      char buffer[4];
+      lcd_gotoxy(0, 1);
+      lcd_puts_P("Lost ticks      ");
+      lcd_gotoxy(11, 1);
+      lcd_puts(utoa(lost_tick_count(), buffer, 10));
+    }
+    else if ((id == INPUT_DOWN) && can_dump())
+    {
+      dump_move_log();
+      dump_diagnostics();
+    }
+#if defined(PROFILE) || defined(TRACE)
+    else if (id == INPUT_COPY)
+    {
+#ifdef PROFILE
+      if (can_dump())
+      {
+        dump_profile();
+      }
+#endif
+#ifdef TRACE
+      if (can_dump())
+      {
+        dump_trace();
+      }
+#endif
+    }
+#endif
     break;
 
   case SETUP_MODE:
     if (id == INPUT_PAUSE)
     {
-      uint8_t addr;
+      uint8_t minutes;
+      uint8_t seconds;
       mode = PLAY_MODE;
 
-      addr = 0;
       for (countdown = 0; countdown < NUM_COUNTDOWNS; countdown++)
       {
-        write_eeprom(addr, Countdown[countdown].minutes);
-        addr++;
-        write_eeprom(addr, Countdown[countdown].seconds);
-        addr++;
+        countdown_time(countdown, &minutes, &seconds);
+        set_settings_time(countdown, minutes, seconds);
       }
+      set_settings_control(selected_control);
+      save_settings();
 
       /* turn off cursor */
       lcd_command(LCD_DISP_ON);
@@ -750,8 +915,7 @@ void input_long_push(uint8_t id)
       {
         if (other_countdown != selected_countdown)
         {
-          Countdown[other_countdown].minutes = Countdown[selected_countdown].minutes;
-          Countdown[other_countdown].seconds = Countdown[selected_countdown].seconds;
+          copy_countdown(other_countdown, selected_countdown);
           update_play(other_countdown);
         }
       }
@@ -6,4 +6,13 @@ void init_clock(void);
 
 void poll_clock(void);
 
+enum {
+  PLAY_MODE, /* default mode */
+  WON_MODE,
+  SETUP_MODE,
+  NUM_MODES
+};
+
+uint8_t clock_mode(void);
+
 
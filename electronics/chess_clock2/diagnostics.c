@@ -0,0 +1,67 @@
+/*
+ * diagnostics.c
+ */
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "diagnostics.h"
+#include "eeprom.h"
+#include "timer.h"
+#include "dump.h"
+
+/* Layout:
+     0     number of lost ticks, inverted so that erased EEPROM reads as none
+     1..2  spare
+   The count is a single byte, so it cannot be left half written, and it saturates.
+   It is only written when ticks are lost, which should be never. */
+#define LOST_TICKS_ADDR (DIAGNOSTICS_START + 0)
+
+static uint8_t LostTicks;
+
+void init_diagnostics(void)
+{
+  LostTicks = ~read_eeprom(LOST_TICKS_ADDR);
+}
+
+void poll_diagnostics(void)
+{
+  uint8_t lost;
+
+  lost = take_lost_ticks();
+  if (lost != 0)
+  {
+    LostTicks = ((uint8_t)(LostTicks + lost) < LostTicks) ? 0xFF : LostTicks + lost;
+    write_eeprom(LOST_TICKS_ADDR, ~LostTicks);
+  }
+}
+
+uint8_t lost_tick_count(void)
+{
+  return LostTicks;
+}
+
+/* Dump format, one line each:
+     LOST <lost ticks>
+     ISR <handler, as timer.h numbers them> <longest run in cycles>   for each timed handler
+     END
+   The runs are only kept since the clock was turned on */
+void dump_diagnostics(void)
+{
+  uint8_t isr;
+
+  begin_dump();
+  dump_string_P("LOST ");
+  dump_number(LostTicks, 10);
+  dump_string_P("\r\n");
+  for (isr = 0; isr < NUM_TIMED_ISRS; isr++)
+  {
+    dump_string_P("ISR ");
+    dump_number(isr, 10);
+    dump_char(' ');
+    dump_number(isr_max_cycles(isr), 10);
+    dump_string_P("\r\n");
+  }
+  dump_string_P("END\r\n");
+  end_dump();
+}
@@ -0,0 +1,17 @@
+/*
+ * diagnostics.h
+ *
+ * Counts kept in EEPROM for checking a clock after it has been used, such as after a tournament
+ */
+
+/* Loads the counts from EEPROM */
+void init_diagnostics(void);
+
+/* Adds any ticks that the timer has lost to the count in EEPROM */
+void poll_diagnostics(void);
+
+/* Number of ticks lost since the EEPROM was last erased, up to 255 */
+uint8_t lost_tick_count(void);
+
+/* Sends the lost tick count and the longest run of each interrupt handler (dump.h) */
+void dump_diagnostics(void);
@@ -0,0 +1,52 @@
+/*
+ * dump.c
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <avr/pgmspace.h>
+
+#include "serial.h"
+#include "dump.h"
+
+void begin_dump(void)
+{
+  flush_serial();
+}
+
+/* Waits for room in the queue, as a byte that does not fit would be dropped */
+void dump_char(char c)
+{
+  while (serial_tx_space() == 0)
+  {
+  }
+  serial_putc(c);
+}
+
+void dump_string(const char * s)
+{
+  while (*s)
+  {
+    dump_char(*s++);
+  }
+}
+
+void dump_string_p(const char * s)
+{
+  char c;
+  while ((c = pgm_read_byte(s++)) != 0)
+  {
+    dump_char(c);
+  }
+}
+
+void dump_number(uint16_t value, uint8_t radix)
+{
+  char buffer[8];
+  dump_string(utoa(value, buffer, radix));
+}
+
+void end_dump(void)
+{
+  flush_serial();
+}
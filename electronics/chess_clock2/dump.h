@@ -0,0 +1,23 @@
+/*
+ * dump.h
+ *
+ * Blocking text output, for the move log and the debugging builds (PROFILE, TRACE). The bytes
+ * go through the queue of serial.c, out of PD3 at 1200 baud as the telemetry does. A dump
+ * blocks the main loop for as long as it takes to send, seconds for the move log, so the
+ * clock only asks for one while no countdown runs. Strings in program memory need
+ * avr/pgmspace.h
+ */
+
+/* Waits for anything already queued, such as a telemetry frame, to go */
+void begin_dump(void);
+
+void dump_char(char c);
+void dump_string(const char * s);
+void dump_number(uint16_t value, uint8_t radix);
+
+/* Sends a string in program memory */
+void dump_string_p(const char * s);
+#define dump_string_P(__s) dump_string_p(PSTR(__s))
+
+/* Waits for the last byte to go and the transmitter to stop */
+void end_dump(void);
@@ -4,46 +4,162 @@
 
 #include <stdint.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/atomic.h>
 
-/* These only give access to the lower 256 bytes of EEPROM */
-uint8_t read_eeprom(uint8_t addr)
+#include "eeprom.h"
+#include "timer.h"
+#include "trace.h"
+
+/* Writes are queued and done one byte at a time by the EEPROM ready interrupt,
+   so that interrupts stay enabled for the 3.4ms that each byte takes to write */
+#define WRITE_QUEUE_SIZE 16
+static uint16_t WriteAddr[WRITE_QUEUE_SIZE];
+static uint8_t WriteValue[WRITE_QUEUE_SIZE];
+static volatile uint8_t WriteIn;
+static volatile uint8_t WriteOut;
+
+static void (*WrittenCallback)(void);
+
+uint8_t read_eeprom(uint16_t addr)
 {
   uint8_t value;
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  uint8_t done;
+  uint8_t i;
+
+  done = 0;
+  while (!done)
   {
-    /* Wait for completion of previous write */
-    while(EECR & (1<<EEPE))
-      ;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      /* A byte cannot be read while one is being written */
+      if ((EECR & (1<<EEPE)) == 0)
+      {
+        /* Set up address register */
+        EEAR = addr;
 
-    /* Set up address register */
-    EEAR = addr;
+        /* Start eeprom read by writing EERE */
+        EECR |= (1<<EERE);
 
-    /* Start eeprom read by writing EERE */
-    EECR |= (1<<EERE);
+        /* Return data from Data Register */
+        value = EEDR;
 
-    /* Return data from Data Register */
-    value = EEDR;
-  }
+        /* Unless a write to the byte is still queued */
+        for (i = WriteOut; i != WriteIn; i = (i + 1) % WRITE_QUEUE_SIZE)
+        {
+          if (WriteAddr[i] == addr)
+          {
+            value = WriteValue[i];
+          }
+        }
+        done = 1;
+      }
+    }
+  } /* end while not read */
   return value;
 }
 
-void write_eeprom(uint8_t addr, uint8_t value)
+void write_eeprom(uint16_t addr, uint8_t value)
 {
-  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  uint8_t done;
+  uint8_t i;
+
+  trace_mark(TRACE_EEPROM_WRITE, addr);
+  done = 0;
+  while (!done)
   {
-    /* Wait for completion of previous write */
-    while(EECR & (1<<EEPE))
-      ;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      /* Replace the value if a write to the byte is already queued */
+      for (i = WriteOut; i != WriteIn; i = (i + 1) % WRITE_QUEUE_SIZE)
+      {
+        if (WriteAddr[i] == addr)
+        {
+          WriteValue[i] = value;
+          done = 1;
+        }
+      }
 
-    /* Set up address and Data Registers */
-    EEAR = addr;
-    EEDR = value;
+      /* Otherwise queue it, if there is room */
+      if ((!done) && (((WriteIn + 1) % WRITE_QUEUE_SIZE) != WriteOut))
+      {
+        WriteAddr[WriteIn] = addr;
+        WriteValue[WriteIn] = value;
+        WriteIn = (WriteIn + 1) % WRITE_QUEUE_SIZE;
+        done = 1;
+      }
 
-    /* Write logical one to EEMPE */
-    EECR |= (1<<EEMPE);
+      /* The interrupt happens as soon as the EEPROM is ready */
+      EECR |= (1<<EERIE);
+    }
+    /* If the queue is full, wait with interrupts enabled for a byte to be written */
+  } /* end while not queued */
+}
+
+uint8_t eeprom_queue_space(void)
+{
+  /* One entry is always left empty, to tell a full queue from an empty one */
+  return (WRITE_QUEUE_SIZE - 1) - (uint8_t)(WriteIn - WriteOut + WRITE_QUEUE_SIZE) % WRITE_QUEUE_SIZE;
+}
 
-    /* Start eeprom write by setting EEPE */
-    EECR |= (1<<EEPE);
+uint8_t eeprom_write_pending(void)
+{
+  return ((EECR & (1<<EERIE)) != 0);
+}
+
+void eeprom_when_written(void (*callback)(void))
+{
+  WrittenCallback = callback;
+  request_poll();
+}
+
+void poll_eeprom(void)
+{
+  void (*callback)(void);
+  callback = WrittenCallback;
+  if ((callback != 0) && !eeprom_write_pending())
+  {
+    WrittenCallback = 0;
+    callback();
   }
 }
+
+/* Interrupt handler for EEPROM ready, to start writing the next byte that needs it */
+ISR(EE_READY_vect)
+{
+  uint16_t addr;
+  uint8_t value;
+  IsrStartType isr_start;
+
+  isr_begin(&isr_start);
+  trace_begin(TRACE_EEPROM_READY, 0);
+  while (WriteOut != WriteIn)
+  {
+    addr = WriteAddr[WriteOut];
+    value = WriteValue[WriteOut];
+    WriteOut = (WriteOut + 1) % WRITE_QUEUE_SIZE;
+
+    /* Skip the byte if it already has the value, which saves both time and wear */
+    EEAR = addr;
+    EECR |= (1<<EERE);
+    if (EEDR != value)
+    {
+      EEDR = value;
+
+      /* Write logical one to EEMPE */
+      EECR |= (1<<EEMPE);
+
+      /* Start eeprom write by setting EEPE */
+      EECR |= (1<<EEPE);
+      trace_end(TRACE_EEPROM_READY, 0);
+      isr_end(ISR_EEPROM_READY, &isr_start);
+      return;
+    }
+  } /* end while writes are queued */
+
+  /* Everything has been written */
+  EECR &= ~(1<<EERIE);
+  request_poll();
+  trace_end(TRACE_EEPROM_READY, 0);
+  isr_end(ISR_EEPROM_READY, &isr_start);
+}
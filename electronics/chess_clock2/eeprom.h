@@ -2,6 +2,47 @@
  * eeprom.h
  */
 
-/* These only give access to the lower 256 bytes of EEPROM */
-uint8_t read_eeprom(uint8_t addr);
-void write_eeprom(uint8_t addr, uint8_t value);
+/* The ATmega88PA has 512 bytes of EEPROM */
+#define EEPROM_SIZE 512
+
+/* Bytes for the move log of the last game (see movelog.h), taken from the checkpoint log */
+#ifndef MOVE_LOG_EEPROM_SIZE
+#define MOVE_LOG_EEPROM_SIZE 0
+#endif
+
+/* How the EEPROM is shared out */
+#define SETTINGS_LOG_START   0
+#define SETTINGS_LOG_SIZE    128
+#define CHECKPOINT_LOG_START (SETTINGS_LOG_START + SETTINGS_LOG_SIZE)
+#define CHECKPOINT_LOG_SIZE  (MOVE_LOG_START - CHECKPOINT_LOG_START)
+#define MOVE_LOG_START       (DIAGNOSTICS_START - MOVE_LOG_EEPROM_SIZE)
+#define DIAGNOSTICS_SIZE     3
+#define DIAGNOSTICS_START    (BUS_ADDRESS_ADDR - DIAGNOSTICS_SIZE)
+
+/* The address of the clock on a multi-drop serial bus (serial.h), or 0xFF as erased when it
+   is not to be polled. Only a clock built with BUS_BOARD reads it. The last byte, so that
+   'make writeaddress' has a fixed place to put it */
+#define BUS_ADDRESS_ADDR     (EEPROM_SIZE - 1)
+
+uint8_t read_eeprom(uint16_t addr);
+
+/* Queues a byte to be written in the background, skipping it if the EEPROM already holds it.
+   Only waits if the queue is full, so must not be called with interrupts disabled. The wait
+   is a spin with interrupts enabled, 3.4ms for each byte that it needs room for, and holds
+   up the main loop. Checkpoints never wait, as they only queue what there is room for
+   (eeprom_queue_space()). A settings record (13 bytes) fits in the 15 that the queue holds,
+   so a save only waits for a checkpoint that is still being written. Saving the move log
+   queues far more */
+void write_eeprom(uint16_t addr, uint8_t value);
+
+/* Returns the number of bytes that can be queued without waiting */
+uint8_t eeprom_queue_space(void);
+
+/* Returns non-zero until all of the queued bytes have been written */
+uint8_t eeprom_write_pending(void);
+
+/* Has poll_eeprom() call callback once all of the queued bytes have been written */
+void eeprom_when_written(void (*callback)(void));
+
+/* Calls the callback given to eeprom_when_written(), when it is due */
+void poll_eeprom(void);
@@ -0,0 +1,10 @@
+/*
+ * host/avr/cpufunc.h - stands in for <avr/cpufunc.h> when building for the host
+ */
+
+#ifndef HOST_AVR_CPUFUNC_H
+#define HOST_AVR_CPUFUNC_H
+
+#define _NOP() do { } while (0)
+
+#endif
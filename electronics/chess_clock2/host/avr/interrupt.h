@@ -0,0 +1,26 @@
+/*
+ * host/avr/interrupt.h - stands in for <avr/interrupt.h> when building for the host
+ *
+ * Interrupt handlers become ordinary functions, named after their vectors,
+ * for the program that drives the firmware to call
+ */
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define SREG_I 0x80
+
+/* Called whenever interrupts may have been enabled, so that a program that drives
+   the firmware can run the interrupt handlers that are pending (see host/sim.c) */
+extern void (*host_interrupts_enabled)(void);
+
+#define sei() do { SREG |= SREG_I; if (host_interrupts_enabled) host_interrupts_enabled(); } while (0)
+#define cli() (SREG &= (uint8_t)~SREG_I)
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+#define ISR_NAKED
+#define EMPTY_INTERRUPT(vector) void vector(void); void vector(void) {}
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * host/avr/pgmspace.h - stands in for <avr/pgmspace.h> when building for the host,
+ * where program memory is ordinary memory
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+
+typedef char prog_char;
+typedef uint8_t prog_uint8_t;
+
+#define pgm_read_byte(addr)      (*(const uint8_t *)(addr))
+#define pgm_read_byte_near(addr) pgm_read_byte(addr)
+#define pgm_read_word(addr)      (*(const uint16_t *)(addr))
+
+#endif
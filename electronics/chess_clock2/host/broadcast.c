@@ -0,0 +1,218 @@
+/*
+ * host/broadcast.c - records the telemetry frames of a game, for host/broadcast.py to check
+ *
+ * Plays a game on end-of-turn inputs 1 and 2 with a pause, lets the flag of player 2 fall,
+ * goes into setup mode to change a time and back, and plays a few more moves. Everything
+ * sent out of PD3 is written to the stream file. As each frame starts, the state of the
+ * clock is written to the truth file, one line per frame:
+ *   <SEQ> <mode> <running> <expired> <seconds 1> <seconds 2> <seconds 3> <seconds 4>
+ * The seconds of a running countdown may have ticked on by one since the frame was made.
+ * Fails if two frames start less than a second apart.
+ *
+ * Usage: broadcast stream-file truth-file [seed]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "timer.h"
+#include "clock.h"
+#include "telemetry.h"
+
+#define MS_TO_COUNTS(ms) (((ms) * 1000) / 1024)
+
+#define PLAYER_1_START ((uint32_t)5 * 60 * 1000)
+#define PLAYER_2_START ((uint32_t)90 * 1000)
+#define FIRST_MOVES  14
+#define PAUSE_MOVE   6
+#define LATER_MOVES  6
+
+static const struct
+{
+  char port;
+  uint8_t bit;
+} EotPins[2] = { { 'D', 1 }, { 'D', 2 } };
+
+#define PAUSE_PORT 'B'
+#define PAUSE_BIT  4   /* active low */
+#define UP_PORT    'D'
+#define UP_BIT     4
+
+static FILE * Stream;
+static FILE * Truth;
+
+/* Where the stream is in the current frame */
+static uint8_t FrameIndex;
+static uint8_t FrameLength;
+static unsigned long Frames;
+static unsigned long Bytes;
+static uint64_t LastFrameStart;
+static char TruthLine[80];
+
+static void capture_truth(void)
+{
+  uint8_t running;
+  uint8_t expired;
+  uint8_t id;
+  running = expired = 0;
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    running |= countdown_is_running(id) << id;
+    expired |= countdown_has_expired(id) << id;
+  }
+  snprintf(TruthLine, sizeof(TruthLine), "%u %u %u %lu %lu %lu %lu", clock_mode(), running, expired,
+           (unsigned long)countdown_remaining(0) / 1000, (unsigned long)countdown_remaining(1) / 1000,
+           (unsigned long)countdown_remaining(2) / 1000, (unsigned long)countdown_remaining(3) / 1000);
+}
+
+static void uart_byte(uint8_t byte, uint64_t end_us)
+{
+  (void)end_us;
+  fputc(byte, Stream);
+  Bytes++;
+  if (FrameIndex == 0)
+  {
+    if (byte != TELEMETRY_SOF)
+    {
+      fprintf(stderr, "broadcast: 0x%02x where a frame should start\n", byte);
+      exit(1);
+    }
+    if ((Frames > 0) && (sim_time() - LastFrameStart < MS_TO_COUNTS(1000)))
+    {
+      fprintf(stderr, "broadcast: frame %lu started %.0fms after the last\n",
+              Frames, (sim_time() - LastFrameStart) * 1.024);
+      exit(1);
+    }
+    LastFrameStart = sim_time();
+    capture_truth();
+  }
+  else if (FrameIndex == 1)
+  {
+    FrameLength = 2 + byte + 2;
+  }
+  else if (FrameIndex == 2)
+  {
+    fprintf(Truth, "%u %s\n", byte, TruthLine);
+  }
+  FrameIndex++;
+  if ((FrameIndex > 1) && (FrameIndex == FrameLength))
+  {
+    FrameIndex = 0;
+    Frames++;
+  }
+}
+
+/* Changes the level of an input, with a bounce in each of the next two timer counts */
+static void bounce_pin(char port, uint8_t bit, uint8_t level)
+{
+  sim_set_pin(port, bit, level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, !level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, level);
+}
+
+static void move(uint8_t player)
+{
+  bounce_pin(EotPins[player].port, EotPins[player].bit, 1);
+  sim_run_until(sim_time() + MS_TO_COUNTS(60 + rand() % 190));
+  bounce_pin(EotPins[player].port, EotPins[player].bit, 0);
+}
+
+static void think(void)
+{
+  sim_run_until(sim_time() + MS_TO_COUNTS(1000 + rand() % 9000));
+}
+
+static void push(char port, uint8_t bit, uint8_t pressed_level, unsigned long ms)
+{
+  sim_set_pin(port, bit, pressed_level);
+  sim_run_until(sim_time() + MS_TO_COUNTS(ms));
+  sim_set_pin(port, bit, !pressed_level);
+  sim_run_until(sim_time() + MS_TO_COUNTS(500));
+}
+
+int main(int argc, char ** argv)
+{
+  uint8_t player;
+  uint8_t n;
+
+  if (argc < 3)
+  {
+    fprintf(stderr, "usage: broadcast stream-file truth-file [seed]\n");
+    return 2;
+  }
+  Stream = fopen(argv[1], "wb");
+  Truth = fopen(argv[2], "w");
+  if (!Stream || !Truth)
+  {
+    perror("broadcast");
+    return 2;
+  }
+  srand((argc >= 4) ? atoi(argv[3]) : 1);
+  sim_serial_output(uart_byte);
+
+  sim_boot();
+
+  /* Let the first frame, made as the clock started, go before the times are set */
+  sim_run_until(sim_time() + MS_TO_COUNTS(50));
+  set_countdown_remaining(COUNTDOWN_1, PLAYER_1_START);
+  set_countdown_remaining(COUNTDOWN_2, PLAYER_2_START);
+  sim_run_until(MS_TO_COUNTS(2000));
+
+  player = 0;
+  for (n = 0; n < FIRST_MOVES; n++)
+  {
+    move(player);
+    player = !player;
+    think();
+    if (n == PAUSE_MOVE)
+    {
+      push(PAUSE_PORT, PAUSE_BIT, 0, 200);
+      sim_run_until(sim_time() + MS_TO_COUNTS(10000));
+      push(PAUSE_PORT, PAUSE_BIT, 0, 200);
+      think();
+    }
+  }
+
+  /* Player 1 moves, and player 2 runs out of time */
+  if (player == 1)
+  {
+    move(player);
+    player = !player;
+    think();
+  }
+  move(player);
+  while (!countdown_has_expired(COUNTDOWN_2))
+  {
+    sim_run_until(sim_time() + MS_TO_COUNTS(1000));
+  }
+  sim_run_until(sim_time() + MS_TO_COUNTS(5000));
+
+  /* Set up a little more time, and start again */
+  push(PAUSE_PORT, PAUSE_BIT, 0, 2000);
+  for (n = 0; n < 3; n++)
+  {
+    push(UP_PORT, UP_BIT, 1, 200);
+  }
+  sim_run_until(sim_time() + MS_TO_COUNTS(3000));
+  push(PAUSE_PORT, PAUSE_BIT, 0, 2000);
+  sim_run_until(sim_time() + MS_TO_COUNTS(3000));
+
+  player = 0;
+  for (n = 0; n < LATER_MOVES; n++)
+  {
+    move(player);
+    player = !player;
+    think();
+  }
+  sim_run_until(sim_time() + MS_TO_COUNTS(3000));
+
+  fclose(Stream);
+  fclose(Truth);
+  printf("%lu frames, %lu bytes in %.1f seconds: %.1f bytes a frame, %.1f bytes a second\n",
+         Frames, Bytes, sim_time() * 1.024 / 1000, (double)Bytes / Frames, Bytes / (sim_time() * 1.024 / 1000));
+  return 0;
+}
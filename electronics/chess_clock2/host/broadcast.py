@@ -0,0 +1,330 @@
+#!/usr/bin/env python3
+#
+# host/broadcast.py - decodes the telemetry frames that the clock broadcasts (telemetry.h)
+#
+# Usage: broadcast.py /dev/ttyUSB0                 prints the state of the clock as it changes
+#        broadcast.py --test stream truth [seed]   checks the decoder on a recording
+#
+# As a library, feed the bytes from the serial port to a Decoder, which returns the state of
+# the clock after each frame that it can use:
+#
+#     decoder = Decoder()
+#     for state in decoder.feed(data):
+#         show(state.mode, state.running, state.expired, state.seconds)
+#
+# A frame that fails its CRC is dropped, and the decoder looks for the next SOF after the one
+# that it started at. The deltas of a frame are from the key frame before it, so a missed frame
+# only loses what was in it, but once a key frame has been missed nothing is returned until the
+# next. The seconds of a countdown that is running are as at the frame, and count down from
+# there until the next.
+#
+# The test reads a stream and the truth about each frame recorded by host/broadcast
+# ('make broadcast'). It decodes the stream as it is, and then sends it through a
+# pseudo-terminal set up as the serial port would be, first as it is and then with bits
+# flipped, bytes lost and noise added. Every state returned must match the truth.
+
+import os
+import random
+import select
+import sys
+import termios
+import threading
+import tty
+
+# As in telemetry.h
+SOF = 0xC5
+KEY = 0x80
+MODE_MASK = 0x03
+MIN_LEN = 4
+MAX_LEN = 16
+MODES = ["play", "won", "setup"]
+NUM_COUNTDOWNS = 4
+KEY_INTERVAL = 16
+
+BAUD = termios.B1200
+
+
+def crc16(data, crc=0xFFFF):
+    """The CRC of _crc_ccitt_update() in avr-libc"""
+    for byte in data:
+        crc ^= byte
+        for _ in range(8):
+            crc = (crc >> 1) ^ 0x8408 if crc & 1 else crc >> 1
+    return crc
+
+
+class ClockState:
+    def __init__(self, seq, mode, running, expired, seconds, key):
+        self.seq = seq
+        self.mode = mode
+        self.running = running
+        self.expired = expired
+        self.seconds = list(seconds)
+        self.key = key
+
+    def __str__(self):
+        countdowns = []
+        for id, seconds in enumerate(self.seconds):
+            minutes, seconds = divmod(seconds, 60)
+            mark = "*" if self.running & (1 << id) else "F" if self.expired & (1 << id) else " "
+            countdowns.append("%3d:%02d%s" % (minutes, seconds, mark))
+        mode = MODES[self.mode] if self.mode < len(MODES) else str(self.mode)
+        return "%3d %-5s %s" % (self.seq, mode, " ".join(countdowns))
+
+
+class Decoder:
+    def __init__(self):
+        self.buffer = bytearray()
+        self.key_seconds = None  # as at the last key frame, or None until there is one
+        self.key_seq = None
+        self.last_seq = None
+        self.frames = 0         # frames that passed their CRC
+        self.bad = 0            # SOFs that did not start a good frame
+        self.gaps = 0           # times that frames were missed
+        self.waiting = 0        # good frames whose key frame was missed
+        self.skipped = 0        # bytes outside any frame
+
+    def feed(self, data):
+        """Takes bytes from the serial port, and returns the state after each frame in them"""
+        self.buffer += data
+        states = []
+        while True:
+            start = self.buffer.find(SOF)
+            if start < 0:
+                self.skipped += len(self.buffer)
+                del self.buffer[:]
+                break
+            self.skipped += start
+            del self.buffer[:start]
+            if len(self.buffer) < 2:
+                break
+            length = self.buffer[1]
+            if not MIN_LEN <= length <= MAX_LEN:
+                self.bad += 1
+                del self.buffer[:1]
+                continue
+            if len(self.buffer) < length + 4:
+                break
+            frame = bytes(self.buffer[:length + 4])
+            body = frame[2:2 + length]
+            if (crc16(frame[1:2 + length]) != frame[2 + length] | (frame[3 + length] << 8)
+                    or not self._well_formed(body)):
+                self.bad += 1
+                del self.buffer[:1]
+                continue
+            del self.buffer[:length + 4]
+            state = self._apply(body)
+            if state:
+                states.append(state)
+        return states
+
+    @staticmethod
+    def _well_formed(body):
+        mask = body[3]
+        present = mask & 0x0F
+        absolute = mask >> 4
+        if absolute & ~present or (body[1] & MODE_MASK) >= len(MODES):
+            return False
+        size = sum((3 if absolute & (1 << id) else 1) for id in range(NUM_COUNTDOWNS) if present & (1 << id))
+        return len(body) == 4 + size
+
+    def _apply(self, body):
+        seq, state, turn, mask = body[:4]
+        self.frames += 1
+        if self.last_seq is not None and seq != (self.last_seq + 1) % 256:
+            self.gaps += 1
+        self.last_seq = seq
+        key = bool(state & KEY)
+        if key:
+            self.key_seconds = [0] * NUM_COUNTDOWNS
+            self.key_seq = seq
+        elif self.key_seq != seq - seq % KEY_INTERVAL:
+            self.waiting += 1
+            return None
+
+        seconds = list(self.key_seconds)
+        values = body[4:]
+        for id in range(NUM_COUNTDOWNS):
+            if mask & (1 << id):
+                if mask & (0x10 << id):
+                    seconds[id] = values[0] | (values[1] << 8) | (values[2] << 16)
+                    values = values[3:]
+                else:
+                    delta = values[0] - 256 if values[0] >= 128 else values[0]
+                    seconds[id] += delta
+                    values = values[1:]
+        if key:
+            self.key_seconds = list(seconds)
+        return ClockState(seq, state & MODE_MASK, turn & 0x0F, turn >> 4, seconds, key)
+
+
+def open_serial(path):
+    """Opens a serial port, or the far end of a pseudo-terminal, raw at the baud rate of the clock"""
+    fd = os.open(path, os.O_RDONLY | os.O_NOCTTY)
+    tty.setraw(fd)
+    attributes = termios.tcgetattr(fd)
+    attributes[4] = attributes[5] = BAUD
+    attributes[2] = (attributes[2] & ~(termios.CSIZE | termios.PARENB | termios.CSTOPB)) | termios.CS8 | termios.CLOCAL | termios.CREAD
+    termios.tcsetattr(fd, termios.TCSANOW, attributes)
+    return fd
+
+
+def monitor(path):
+    fd = open_serial(path)
+    decoder = Decoder()
+    while True:
+        data = os.read(fd, 256)
+        if not data:
+            break
+        for state in decoder.feed(data):
+            print(state, flush=True)
+
+
+# The test
+
+def read_truth(path):
+    truth = []
+    with open(path) as f:
+        for line in f:
+            fields = [int(field) for field in line.split()]
+            truth.append((fields[0], fields[1], fields[2], fields[3], fields[4:8]))
+    return truth
+
+
+def split_frames(stream):
+    """Splits a clean stream into its frames"""
+    frames = []
+    while stream:
+        length = stream[1] + 4
+        frames.append(stream[:length])
+        stream = stream[length:]
+    return frames
+
+
+def impair(stream, rng):
+    """Damages about one frame in eight, in a way that the decoder must get over.
+    Returns the damaged stream and the SEQs of the frames that were left whole, and
+    whose key frame was left whole too"""
+    out = bytearray()
+    whole = set()
+    whole_keys = set()
+    for frame in split_frames(stream):
+        frame = bytearray(frame)
+        damage = rng.randrange(32)
+        if damage >= 2:
+            whole.add(frame[2])
+            if frame[3] & KEY:
+                whole_keys.add(frame[2])
+        if damage == 0:
+            frame[rng.randrange(len(frame))] ^= 1 << rng.randrange(8)
+        elif damage == 1:
+            del frame[rng.randrange(len(frame))]
+        elif damage == 2:
+            out += bytes([SOF, rng.randrange(MIN_LEN, MAX_LEN + 1)])
+        elif damage == 3:
+            out += bytes(rng.randrange(256) for _ in range(rng.randrange(1, 8)))
+        out += frame
+    return bytes(out), set(seq for seq in whole if seq - seq % KEY_INTERVAL in whole_keys)
+
+
+def through_pty(stream, rng):
+    """Sends the stream into a pseudo-terminal in pieces, and returns what comes out of the far end"""
+    master, slave = os.openpty()
+    fd = open_serial(os.ttyname(slave))
+
+    def write():
+        position = 0
+        while position < len(stream):
+            size = rng.randrange(1, 24)
+            os.write(master, stream[position:position + size])
+            position += size
+
+    writer = threading.Thread(target=write)
+    writer.start()
+    received = bytearray()
+    while len(received) < len(stream):
+        ready, _, _ = select.select([fd], [], [], 5)
+        if not ready:
+            break
+        received += os.read(fd, 1024)
+    writer.join()
+    for descriptor in (fd, slave, master):
+        os.close(descriptor)
+    return bytes(received)
+
+
+def check(name, data, truth, usable=None):
+    """Decodes data, and returns a list of what is wrong. If the data has been damaged,
+    usable are the SEQs of the frames that must still give a state"""
+    decoder = Decoder()
+    states = []
+    # In pieces, as they would come from the serial port
+    for position in range(0, len(data), 7):
+        states += decoder.feed(data[position:position + 7])
+
+    errors = []
+    index = 0
+    for state in states:
+        while index < len(truth) and truth[index][0] != state.seq:
+            index += 1
+        if index == len(truth):
+            errors.append("frame %d is not in the truth" % state.seq)
+            break
+        seq, mode, running, expired, seconds = truth[index]
+        if (state.mode, state.running, state.expired) != (mode, running, expired):
+            errors.append("frame %d: mode %d running %x expired %x, should be %d %x %x" %
+                          (seq, state.mode, state.running, state.expired, mode, running, expired))
+        for id in range(NUM_COUNTDOWNS):
+            # The truth was taken a moment after the frame was made
+            allowed = (seconds[id], seconds[id] + 1) if running & (1 << id) else (seconds[id],)
+            if state.seconds[id] not in allowed:
+                errors.append("frame %d: countdown %d is %d, should be %d" % (seq, id + 1, state.seconds[id], seconds[id]))
+        index += 1
+
+    print("%-20s %4d bytes, %3d frames, %3d states, %2d bad, %2d gaps, %2d waiting for a key, %3d bytes skipped" %
+          (name, len(data), decoder.frames, len(states), decoder.bad, decoder.gaps, decoder.waiting, decoder.skipped))
+    if usable is None:
+        if len(states) != len(truth) or decoder.bad or decoder.gaps or decoder.skipped:
+            errors.append("%d states from %d frames" % (len(states), len(truth)))
+    else:
+        if not decoder.bad or not decoder.gaps:
+            errors.append("the damage was not noticed")
+        missed = usable - set(state.seq for state in states)
+        if missed:
+            errors.append("frames %s and their key frames were whole, but did not give a state" % sorted(missed))
+    return errors
+
+
+def test(stream_path, truth_path, seed):
+    rng = random.Random(seed)
+    with open(stream_path, "rb") as f:
+        stream = f.read()
+    truth = read_truth(truth_path)
+    if len(split_frames(stream)) != len(truth):
+        sys.exit("broadcast.py: %s has %d frames and %s has %d" %
+                 (stream_path, len(split_frames(stream)), truth_path, len(truth)))
+
+    errors = []
+    errors += check("recording", stream, truth)
+    errors += check("pty", through_pty(stream, rng), truth)
+    damaged, usable = impair(stream, rng)
+    errors += check("damaged through pty", through_pty(damaged, rng), truth, usable)
+    for error in errors:
+        print("broadcast.py: " + error, file=sys.stderr)
+    return 1 if errors else 0
+
+
+def main():
+    if len(sys.argv) in (4, 5) and sys.argv[1] == "--test":
+        sys.exit(test(sys.argv[2], sys.argv[3], int(sys.argv[4]) if len(sys.argv) == 5 else 1))
+    elif len(sys.argv) == 2:
+        try:
+            monitor(sys.argv[1])
+        except KeyboardInterrupt:
+            pass
+    else:
+        sys.exit("usage: broadcast.py serial-port | broadcast.py --test stream truth [seed]")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,452 @@
+/*
+ * host/bus.c - polls a multi-drop bus of clocks (serial.h) and measures how fast it goes round
+ *
+ * Each clock is the firmware, built with BUS_BOARD, in a process of its own, forked from this
+ * one with its address in its EEPROM, playing a game of its own on end-of-turn inputs 1 and 2.
+ * This process is the bus master: it sends each address in turn at 9600 9N1, waits for the
+ * answer, and sends the next address as soon as the answer has ended. Every clock hears the
+ * whole line, the addresses and the answers. Time on the bus is kept in microseconds, and a
+ * clock runs up to the time of each frame before it hears it, so the clocks keep in step with
+ * the bus however fast each process runs. What a clock hears is held back until it is next polled, or the end.
+ *
+ * The firmware runs in no time in the simulation, so an answer starts at the timer count after
+ * the address, which is about as long as the firmware takes to make a frame with one countdown
+ * that has changed.
+ *
+ * Fails if a clock does not answer, an answer is not a good frame, a clock sends anything when
+ * it has not been polled, or a clock is woken by a frame that is not an address.
+ *
+ * Usage: bus [clocks [rounds [seed]]]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <avr/io.h>
+#include <util/crc16.h>
+
+#include "sim.h"
+#include "timer.h"
+#include "clock.h"
+#include "eeprom.h"
+#include "serial.h"
+#include "telemetry.h"
+
+#define MS_TO_COUNTS(ms) (((ms) * 1000) / 1024)
+#define US_TO_COUNTS(us) (((us) + 1023) / 1024)   /* the first count at or after */
+
+/* A start bit, 9 data bits and a stop bit at 9600 baud */
+#define FRAME_US (11 * 1000000 / 9600)
+
+/* The longest answer is 2 + TELEMETRY_MAX_LEN + 2 frames, so this allows a few ms to start */
+#define ANSWER_TIMEOUT_US 30000
+#define MAX_ANSWER 24
+
+/* Polling starts once the clocks have been going for this long */
+#define START_US 2000000
+
+#define ADDRESS_FRAME 0x100
+
+enum
+{
+  RECEIVE,  /* the clock hears frame, ending at time us */
+  ANSWER,   /* runs the clock until it has answered, or time us */
+  FINISH    /* sends back the counts and ends the clock */
+};
+
+typedef struct
+{
+  uint8_t kind;
+  uint16_t frame;
+  uint64_t us;
+} CommandType;
+
+typedef struct
+{
+  uint8_t length;
+  uint8_t bytes[MAX_ANSWER];
+  uint64_t end_us[MAX_ANSWER];
+} AnswerType;
+
+typedef struct
+{
+  unsigned long heard;        /* frames on the line while the clock was listening */
+  unsigned long addresses;    /* of them, addresses */
+  unsigned long woken;        /* frames that the firmware was given */
+  unsigned long moves;
+  unsigned long unsolicited;  /* bytes sent when not polled */
+} CountsType;
+
+static void write_all(int fd, const void * data, size_t size)
+{
+  const uint8_t * ptr = data;
+  ssize_t done;
+  while (size > 0)
+  {
+    done = write(fd, ptr, size);
+    if (done <= 0)
+    {
+      perror("bus: write");
+      exit(2);
+    }
+    ptr += done;
+    size -= done;
+  }
+}
+
+static void read_all(int fd, void * data, size_t size)
+{
+  uint8_t * ptr = data;
+  ssize_t done;
+  while (size > 0)
+  {
+    done = read(fd, ptr, size);
+    if (done <= 0)
+    {
+      fprintf(stderr, "bus: a clock has gone\n");
+      exit(2);
+    }
+    ptr += done;
+    size -= done;
+  }
+}
+
+/* The clock, in its own process */
+
+static uint8_t Address;
+static uint8_t Answering;
+static AnswerType Answer;
+static CountsType Counts;
+
+/* The game: a move is a press and a release of end-of-turn 1 or 2, each with a bounce */
+static uint64_t NextStep;
+static uint8_t Step;
+static uint8_t Player;
+
+static const uint8_t EotBits[2] = { 3, 2 };   /* port D, as on the bus board (input.c) */
+
+static void uart_byte(uint8_t byte, uint64_t end_us)
+{
+  if (!Answering)
+  {
+    Counts.unsolicited++;
+  }
+  else if (Answer.length < MAX_ANSWER)
+  {
+    Answer.bytes[Answer.length] = byte;
+    Answer.end_us[Answer.length] = end_us;
+    Answer.length++;
+  }
+}
+
+static uint8_t answer_complete(void)
+{
+  return (Answer.length >= 2) && (Answer.length >= Answer.bytes[1] + 4);
+}
+
+static void play_step(void)
+{
+  static const uint8_t Levels[6] = { 1, 0, 1, 0, 1, 0 };
+  sim_set_pin('D', EotBits[Player], Levels[Step]);
+  Step++;
+  if (Step == 3)
+  {
+    /* Held */
+    NextStep += MS_TO_COUNTS(60 + rand() % 190);
+  }
+  else if (Step == 6)
+  {
+    /* Thinks */
+    Step = 0;
+    Player = !Player;
+    Counts.moves++;
+    NextStep += MS_TO_COUNTS(2000 + rand() % 38000);
+  }
+  else
+  {
+    /* Bounces */
+    NextStep += 1;
+  }
+}
+
+static void run_until(uint64_t counts)
+{
+  while (NextStep <= counts)
+  {
+    sim_run_until(NextStep);
+    play_step();
+  }
+  sim_run_until(counts);
+}
+
+static void run_clock(uint8_t address, unsigned seed, int commands, int answers)
+{
+  CommandType command;
+
+  Address = address;
+  srand(seed * 1000 + address);
+  host_eeprom[BUS_ADDRESS_ADDR] = address;
+  sim_serial_output(uart_byte);
+  sim_boot();
+  sim_run_until(MS_TO_COUNTS(50));
+  set_countdown_remaining(COUNTDOWN_1, (uint32_t)(5 + rand() % 25) * 60 * 1000);
+  set_countdown_remaining(COUNTDOWN_2, (uint32_t)(5 + rand() % 25) * 60 * 1000);
+  NextStep = MS_TO_COUNTS(100 + rand() % 5000);
+
+  for (;;)
+  {
+    read_all(commands, &command, sizeof(command));
+    if (command.kind == RECEIVE)
+    {
+      run_until(US_TO_COUNTS(command.us));
+      Counts.heard++;
+      if (command.frame & ADDRESS_FRAME)
+      {
+        Counts.addresses++;
+        if ((command.frame & 0xFF) == Address)
+        {
+          Answering = 1;
+          Answer.length = 0;
+        }
+      }
+      Counts.woken += sim_serial_input(command.frame);
+    }
+    else if (command.kind == ANSWER)
+    {
+      while (!answer_complete() && (sim_time() < US_TO_COUNTS(command.us)))
+      {
+        run_until(sim_time() + 1);
+      }
+      Answering = 0;
+      write_all(answers, &Answer, sizeof(Answer));
+    }
+    else
+    {
+      write_all(answers, &Counts, sizeof(Counts));
+      exit(0);
+    }
+  }
+}
+
+/* The master */
+
+typedef struct
+{
+  pid_t pid;
+  int commands;
+  int answers;
+  CommandType * pending;
+  size_t num_pending;
+  size_t max_pending;
+} ClockType;
+
+static ClockType * Clocks;
+static unsigned NumClocks;
+
+static void send(unsigned id, uint8_t kind, uint16_t frame, uint64_t us)
+{
+  ClockType * clock_ptr = &Clocks[id];
+  if (clock_ptr->num_pending == clock_ptr->max_pending)
+  {
+    clock_ptr->max_pending = clock_ptr->max_pending ? 2 * clock_ptr->max_pending : 256;
+    clock_ptr->pending = realloc(clock_ptr->pending, clock_ptr->max_pending * sizeof(CommandType));
+    if (!clock_ptr->pending)
+    {
+      perror("bus");
+      exit(2);
+    }
+  }
+  clock_ptr->pending[clock_ptr->num_pending].kind = kind;
+  clock_ptr->pending[clock_ptr->num_pending].frame = frame;
+  clock_ptr->pending[clock_ptr->num_pending].us = us;
+  clock_ptr->num_pending++;
+}
+
+static void flush(unsigned id)
+{
+  ClockType * clock_ptr = &Clocks[id];
+  write_all(clock_ptr->commands, clock_ptr->pending, clock_ptr->num_pending * sizeof(CommandType));
+  clock_ptr->num_pending = 0;
+}
+
+static void start_clocks(unsigned seed)
+{
+  unsigned id;
+  int commands[2];
+  int answers[2];
+
+  Clocks = calloc(NumClocks, sizeof(ClockType));
+  for (id = 0; id < NumClocks; id++)
+  {
+    if ((pipe(commands) != 0) || (pipe(answers) != 0))
+    {
+      perror("bus: pipe");
+      exit(2);
+    }
+    fflush(stdout);
+    Clocks[id].pid = fork();
+    if (Clocks[id].pid < 0)
+    {
+      perror("bus: fork");
+      exit(2);
+    }
+    if (Clocks[id].pid == 0)
+    {
+      close(commands[1]);
+      close(answers[0]);
+      run_clock(id, seed, commands[0], answers[1]);
+    }
+    close(commands[0]);
+    close(answers[1]);
+    Clocks[id].commands = commands[1];
+    Clocks[id].answers = answers[0];
+  }
+}
+
+/* Checks that an answer is a whole telemetry frame, and returns its MASK, or -1 if it is not */
+static int check_answer(const AnswerType * answer_ptr)
+{
+  uint16_t crc;
+  uint8_t i;
+
+  if ((answer_ptr->length < 8) || (answer_ptr->bytes[0] != TELEMETRY_SOF) ||
+      (answer_ptr->bytes[1] > TELEMETRY_MAX_LEN) || (answer_ptr->length != answer_ptr->bytes[1] + 4))
+  {
+    return -1;
+  }
+  crc = 0xFFFF;
+  for (i = 1; i < answer_ptr->length - 2; i++)
+  {
+    crc = _crc_ccitt_update(crc, answer_ptr->bytes[i]);
+  }
+  if (crc != (answer_ptr->bytes[i] | (answer_ptr->bytes[i + 1] << 8)))
+  {
+    return -1;
+  }
+  return answer_ptr->bytes[5];
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned rounds;
+  unsigned round;
+  unsigned address;
+  unsigned id;
+  unsigned i;
+  unsigned seed;
+  uint64_t now_us;
+  uint64_t address_end_us;
+  uint64_t turnaround_us;
+  uint64_t max_turnaround_us;
+  uint64_t total_turnaround_us;
+  unsigned long polls;
+  unsigned long answered;
+  unsigned long answer_bytes;
+  unsigned long empty;
+  unsigned long keys;
+  unsigned long failures;
+  AnswerType answer;
+  CountsType counts;
+  CountsType total;
+  int mask;
+  double seconds;
+
+  NumClocks = (argc >= 2) ? atoi(argv[1]) : 128;
+  rounds = (argc >= 3) ? atoi(argv[2]) : 20;
+  seed = (argc >= 4) ? atoi(argv[3]) : 1;
+  if ((NumClocks < 1) || (NumClocks >= SERIAL_NO_ADDRESS) || (rounds < 1))
+  {
+    fprintf(stderr, "usage: bus [clocks (1 to %u) [rounds [seed]]]\n", SERIAL_NO_ADDRESS - 1);
+    return 2;
+  }
+  start_clocks(seed);
+
+  now_us = START_US;
+  polls = answered = answer_bytes = empty = keys = failures = 0;
+  max_turnaround_us = total_turnaround_us = 0;
+  for (round = 0; round < rounds; round++)
+  {
+    for (address = 0; address < NumClocks; address++)
+    {
+      polls++;
+      address_end_us = now_us + FRAME_US;
+      for (id = 0; id < NumClocks; id++)
+      {
+        send(id, RECEIVE, ADDRESS_FRAME | address, address_end_us);
+      }
+      send(address, ANSWER, 0, address_end_us + ANSWER_TIMEOUT_US);
+      flush(address);
+      read_all(Clocks[address].answers, &answer, sizeof(answer));
+
+      mask = check_answer(&answer);
+      if (mask < 0)
+      {
+        fprintf(stderr, "bus: clock %u gave %s at %.3fs\n", address,
+                answer.length ? "a bad answer" : "no answer", now_us / 1e6);
+        failures++;
+        now_us = address_end_us + ANSWER_TIMEOUT_US;
+        continue;
+      }
+      answered++;
+      answer_bytes += answer.length;
+      empty += ((mask & 0x0F) == 0);
+      keys += ((answer.bytes[3] & TELEMETRY_KEY) != 0);
+      turnaround_us = answer.end_us[0] - FRAME_US - address_end_us;
+      total_turnaround_us += turnaround_us;
+      if (turnaround_us > max_turnaround_us)
+      {
+        max_turnaround_us = turnaround_us;
+      }
+      for (i = 0; i < answer.length; i++)
+      {
+        for (id = 0; id < NumClocks; id++)
+        {
+          send(id, RECEIVE, answer.bytes[i], answer.end_us[i]);
+        }
+      }
+      now_us = answer.end_us[answer.length - 1];
+    }
+  }
+
+  memset(&total, 0, sizeof(total));
+  for (id = 0; id < NumClocks; id++)
+  {
+    send(id, FINISH, 0, 0);
+    flush(id);
+    read_all(Clocks[id].answers, &counts, sizeof(counts));
+    waitpid(Clocks[id].pid, NULL, 0);
+    total.heard += counts.heard;
+    total.addresses += counts.addresses;
+    total.woken += counts.woken;
+    total.moves += counts.moves;
+    total.unsolicited += counts.unsolicited;
+    if (counts.woken > counts.addresses)
+    {
+      fprintf(stderr, "bus: clock %u was woken %lu times by %lu addresses\n", id, counts.woken, counts.addresses);
+      failures++;
+    }
+    if (counts.unsolicited)
+    {
+      fprintf(stderr, "bus: clock %u sent %lu bytes when it had not been polled\n", id, counts.unsolicited);
+      failures++;
+    }
+  }
+
+  seconds = (now_us - START_US) / 1e6;
+  printf("%u clocks, %lu polls in %.1f seconds, %lu moves played\n", NumClocks, polls, seconds, total.moves);
+  printf("%.1f polls a second, so each clock is heard from every %.2f seconds\n",
+         polls / seconds, seconds / rounds);
+  if (answered)
+  {
+    printf("a poll takes %.2fms: the address %.2fms, %.2fms to start the answer (max %.2fms), and %.1f bytes of answer\n",
+           seconds * 1000 / polls, FRAME_US / 1000.0, total_turnaround_us / 1000.0 / answered,
+           max_turnaround_us / 1000.0, (double)answer_bytes / answered);
+    printf("answers: %lu key frames, %lu with nothing changed since their key frame\n", keys, empty);
+  }
+  printf("each clock heard %lu frames and was woken by %lu, the addresses\n",
+         total.heard / NumClocks, total.woken / NumClocks);
+  return failures ? 1 : 0;
+}
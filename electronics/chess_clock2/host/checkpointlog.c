@@ -0,0 +1,220 @@
+/*
+ * host/checkpointlog.c - checks that the checkpoint log (checkpoint.c) survives a save cut short
+ *
+ * Checkpoints a game of random moves, with a pause now and then, against the EEPROM of host.c.
+ * A move takes time off the player who moved and counts the move, sometimes changes the
+ * time of the other player too, as a delay that is given back does, and starts the turn of
+ * the other player. Countdowns 3 and 4 are
+ * never used, so only the refresh keeps them in the log.
+ *
+ * The EEPROM ready handler is only run once each save has returned, as the EEPROM is slow
+ * next to the code, so a save must never fill the queue of eeprom.c and leave write_eeprom()
+ * to wait. Some of the saves are also made in a process of their own, forked from this one,
+ * and cut off after a random number of bytes have been written, as a power failure would.
+ * The checkpoint loaded from what is left must be either the new one or the one before it.
+ *
+ * Usage: checkpointlog [moves [seed]]
+ * Fails if a load gives anything else, a save fills the queue, or the last checkpoint
+ * does not load.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "host.h"
+#include "timer.h"
+#include "eeprom.h"
+#include "checkpoint.h"
+
+#define START_REMAINING ((uint32_t)(99 * 60 + 59) * 1000)
+#define MOVES_PER_PAUSE 40
+#define CUT_ONE_IN      10
+
+/* Most bytes that a checkpoint writes, so that a cut can fall anywhere in one */
+#define MAX_SAVE_BYTES  (7 * 6)
+
+static unsigned long Writes[EEPROM_SIZE];
+static unsigned long Written;
+static unsigned WriteLimit;  /* bytes still to be written before the power fails */
+
+/* Interrupts are enabled whenever a byte is queued. The handler is not run then, so a queue
+   with no room left means that the next write would wait, here for ever */
+static void check_queue(void)
+{
+  if (eeprom_queue_space() == 0)
+  {
+    fprintf(stderr, "checkpointlog: a checkpoint filled the EEPROM queue\n");
+    exit(1);
+  }
+}
+
+/* Runs the EEPROM ready handler, and poll_eeprom() as the main loop would, until the
+   checkpoint has been written */
+static void write_queued(void)
+{
+  uint16_t addr;
+  do
+  {
+    while (EECR & (1<<EERIE))
+    {
+      EE_READY_vect();
+      if (EECR & (1<<EEPE))
+      {
+        if (WriteLimit > 0)
+        {
+          addr = EEAR % EEPROM_SIZE;
+          host_eeprom[addr] = EEDR;
+          Writes[addr]++;
+          Written++;
+          WriteLimit--;
+        }
+        EECR &= ~((1<<EEPE) | (1<<EEMPE));
+      }
+    }
+    poll_eeprom();
+  } while (EECR & (1<<EERIE));
+}
+
+static int same(const CheckpointType * a_ptr, const CheckpointType * b_ptr)
+{
+  return memcmp(a_ptr, b_ptr, sizeof(CheckpointType)) == 0;
+}
+
+/* In the forked process: saves the checkpoint, stopping after limit bytes, and loads what
+   is left. Exits with 0 if it gets the new checkpoint or the one before */
+static void cut_save(const CheckpointType * before_ptr, const CheckpointType * after_ptr, unsigned limit)
+{
+  CheckpointType loaded;
+
+  WriteLimit = limit;
+  save_checkpoint(after_ptr);
+  write_queued();
+  memset(&loaded, 0, sizeof(loaded));
+  if (!init_checkpoint(&loaded) || !(same(&loaded, before_ptr) || same(&loaded, after_ptr)))
+  {
+    _exit(1);
+  }
+  _exit(0);
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long moves;
+  unsigned long move;
+  unsigned long saves;
+  unsigned long cuts;
+  unsigned long failures;
+  unsigned long max_writes;
+  unsigned limit;
+  unsigned addr;
+  uint32_t used;
+  uint8_t player;
+  uint8_t id;
+  int status;
+  pid_t pid;
+  CheckpointType before;
+  CheckpointType game;
+  CheckpointType loaded;
+
+  moves = (argc >= 2) ? strtoul(argv[1], NULL, 10) : 2160;
+  srand((argc >= 3) ? atoi(argv[2]) : 1);
+
+  host_interrupts_enabled = check_queue;
+  WriteLimit = (unsigned)-1;
+  saves = cuts = failures = 0;
+
+  memset(&game, 0, sizeof(game));
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    game.remaining[id] = START_REMAINING;
+  }
+  if (init_checkpoint(&loaded))
+  {
+    fprintf(stderr, "checkpointlog: erased EEPROM has a game to resume\n");
+    failures++;
+  }
+
+  player = 0;
+  for (move = 0; move < moves; move++)
+  {
+    before = game;
+    if ((move % MOVES_PER_PAUSE) == MOVES_PER_PAUSE - 1)
+    {
+      /* Paused, then carried on */
+      game.was_running = game.running;
+      game.running = 0;
+      save_checkpoint(&game);
+      write_queued();
+      saves++;
+      before = game;
+      game.running = game.was_running;
+      game.was_running = 0;
+    }
+    else
+    {
+      used = 500 + rand() % 9000;
+      game.remaining[player] -= (used < game.remaining[player]) ? used : 0;
+      game.moves[player]++;
+      if (rand() % 3 == 0)
+      {
+        game.remaining[!player] += rand() % 5000;
+      }
+      player = !player;
+      game.running = 1 << player;
+      game.turn_start[0] = game.remaining[player];
+    }
+
+    if (rand() % CUT_ONE_IN == 0)
+    {
+      limit = rand() % MAX_SAVE_BYTES;
+      cuts++;
+      fflush(stdout);
+      pid = fork();
+      if (pid < 0)
+      {
+        perror("checkpointlog: fork");
+        return 2;
+      }
+      if (pid == 0)
+      {
+        cut_save(&before, &game, limit);
+      }
+      waitpid(pid, &status, 0);
+      if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+      {
+        fprintf(stderr, "checkpointlog: move %lu, cut after %u bytes, loaded neither the new nor the old checkpoint\n",
+                move, limit);
+        failures++;
+      }
+    }
+    save_checkpoint(&game);
+    write_queued();
+    saves++;
+  } /* end for all moves */
+
+  memset(&loaded, 0, sizeof(loaded));
+  if (!init_checkpoint(&loaded) || !same(&loaded, &game))
+  {
+    fprintf(stderr, "checkpointlog: the last checkpoint did not load\n");
+    failures++;
+  }
+
+  max_writes = 0;
+  for (addr = 0; addr < EEPROM_SIZE; addr++)
+  {
+    if (Writes[addr] > max_writes)
+    {
+      max_writes = Writes[addr];
+    }
+  }
+  printf("%lu moves, %lu checkpoints, %lu of them also cut short: %lu loads wrong\n", moves, saves, cuts, failures);
+  printf("%.1f bytes written a move, most writes to one byte: %lu, over a log of %u bytes\n",
+         (double)Written / moves, max_writes, CHECKPOINT_LOG_SIZE);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,221 @@
+/*
+ * host/crediting.c - checks that each move is charged from the first edge of the press
+ *
+ * Plays a game of random moves on end-of-turn inputs 1 and 2, with contact bounce. For each
+ * move it works out two errors in the time charged to the player who moved, against an ideal
+ * clock that runs from the first edge of one press to the first edge of the next:
+ *   handled: had the turn passed when the main loop handled the debounced press, as the clock
+ *            did before the first edge was timed
+ *   charged: as the countdown actually stands
+ * The latency of the press is reported too, from its first edge to when the main loop has
+ * started the other countdown, and with it redrawn the display in the same pass: the median,
+ * the 99th percentile and the longest. The firmware takes no time here, so these are only the
+ * debouncing and the waits for the timer, to within a timer count, without the cycles that
+ * the code would take on the chip (bench/latency.c measures those under simavr).
+ * Then it presses end-of-turn 1 just before and just after player 1's flag falls, with the
+ * press only debounced once the flag has fallen. A press that began first must still end the
+ * turn, with the time that was left at its first edge, and a later one must lose.
+ *
+ * Usage: crediting [moves [seed]]
+ * Fails if a charged error is a timer count (1.024ms) or more, or a flag race goes wrong.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "timer.h"
+#include "clock.h"
+
+/* Counts of 1.024ms, as microseconds */
+#define COUNTS_TO_US(counts) ((counts) * 1024)
+#define MS_TO_COUNTS(ms)     (((ms) * 1000) / 1024)
+
+#define START_REMAINING ((uint32_t)10 * 3600 * 1000)
+#define MAX_ERROR_MS    1.024
+
+/* The flag falls this many counts after player 1's countdown starts */
+#define FLAG_COUNTS 10000
+#define FLAG_REMAINING ((uint32_t)COUNTS_TO_US(FLAG_COUNTS) / 1000)
+
+/* First edges of the presses, in counts from the flag. The debouncer takes 4 samples of
+   5 counts, so all of them are only passed on after the flag has fallen */
+static const int8_t RaceOffsets[] = { -15, -10, -5, -2, -1, 1, 2, 5 };
+
+static const struct
+{
+  char port;
+  uint8_t bit;
+} EotPins[2] = { { 'D', 1 }, { 'D', 2 } };
+
+#define RESTART_PORT 'B'
+#define RESTART_BIT  3   /* active low */
+
+/* Changes the level of an input, with a bounce in each of the next two timer counts */
+static void bounce_pin(char port, uint8_t bit, uint8_t level)
+{
+  sim_set_pin(port, bit, level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, !level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, level);
+}
+
+static int compare_counts(const void * a, const void * b)
+{
+  uint64_t count_a = *(const uint64_t *)a;
+  uint64_t count_b = *(const uint64_t *)b;
+  return (count_a > count_b) - (count_a < count_b);
+}
+
+/* Runs until the countdown starts, and returns when that happened */
+static uint64_t wait_for_running(uint8_t id)
+{
+  while (!countdown_is_running(id))
+  {
+    sim_run_until(sim_time() + 1);
+  }
+  return sim_time();
+}
+
+/* Plays the moves, and returns the largest error charged */
+static double play_moves(unsigned long moves)
+{
+  uint64_t turn_start;
+  uint64_t press;
+  uint64_t handled;
+  uint64_t used[2];
+  uint64_t * latencies;
+  double charged_error;
+  double handled_error;
+  double max_charged;
+  double max_handled;
+  double total_charged;
+  double total_handled;
+  unsigned long move;
+  uint8_t player;
+
+  set_countdown_remaining(COUNTDOWN_1, START_REMAINING);
+  set_countdown_remaining(COUNTDOWN_2, START_REMAINING);
+  used[0] = used[1] = 0;
+  max_charged = max_handled = total_charged = total_handled = 0;
+  latencies = malloc((moves + 1) * sizeof(uint64_t));
+  if (latencies == NULL)
+  {
+    perror("crediting");
+    exit(2);
+  }
+  player = 0;
+  turn_start = 0;
+  for (move = 0; move <= moves; move++)
+  {
+    press = sim_time();
+    if (move > 0)
+    {
+      used[player] += press - turn_start;
+    }
+    turn_start = press;
+    bounce_pin(EotPins[player].port, EotPins[player].bit, 1);
+    handled = wait_for_running(!player);
+    latencies[move] = handled - press;
+    sim_run_until(press + MS_TO_COUNTS(60 + rand() % 190));
+    bounce_pin(EotPins[player].port, EotPins[player].bit, 0);
+
+    if (move > 0)
+    {
+      charged_error = (double)(START_REMAINING - countdown_remaining(player)) - COUNTS_TO_US(used[player]) / 1000.0;
+      handled_error = charged_error + COUNTS_TO_US(handled - press) / 1000.0;
+      max_charged = fmax(max_charged, fabs(charged_error));
+      max_handled = fmax(max_handled, fabs(handled_error));
+      total_charged += fabs(charged_error);
+      total_handled += fabs(handled_error);
+    }
+    player = !player;
+    sim_run_until(sim_time() + MS_TO_COUNTS(500 + rand() % 30000));
+  } /* end for all moves */
+
+  printf("%lu moves, error per move:\n", moves);
+  printf("  handled: max %.3fms, mean %.3fms\n", max_handled, total_handled / moves);
+  printf("  charged: max %.3fms, mean %.3fms\n", max_charged, total_charged / moves);
+  qsort(latencies, moves + 1, sizeof(uint64_t), compare_counts);
+  printf("latency from the first edge to the press handled: p50 %.3fms, p99 %.3fms, max %.3fms\n",
+         COUNTS_TO_US(latencies[moves / 2]) / 1000.0, COUNTS_TO_US(latencies[moves * 99 / 100]) / 1000.0,
+         COUNTS_TO_US(latencies[moves]) / 1000.0);
+  free(latencies);
+  return max_charged;
+}
+
+/* Presses end-of-turn 1 offset counts from when player 1's flag falls.
+   Returns 0 if the clock gets it right */
+static int race_flag(int8_t offset)
+{
+  uint64_t start;
+  uint32_t expected_us;
+  uint32_t remaining;
+  int wrong;
+
+  /* A new game, with player 2 starting player 1's countdown */
+  sim_set_pin(RESTART_PORT, RESTART_BIT, 0);
+  sim_run_until(sim_time() + MS_TO_COUNTS(100));
+  sim_set_pin(RESTART_PORT, RESTART_BIT, 1);
+  sim_run_until(sim_time() + MS_TO_COUNTS(100));
+  set_countdown_remaining(COUNTDOWN_1, FLAG_REMAINING);
+  set_countdown_remaining(COUNTDOWN_2, START_REMAINING);
+  start = sim_time();
+  bounce_pin(EotPins[1].port, EotPins[1].bit, 1);
+  sim_run_until(start + MS_TO_COUNTS(200));
+  bounce_pin(EotPins[1].port, EotPins[1].bit, 0);
+
+  sim_run_until(start + FLAG_COUNTS + offset);
+  bounce_pin(EotPins[0].port, EotPins[0].bit, 1);
+  sim_run_until(sim_time() + MS_TO_COUNTS(300));
+  bounce_pin(EotPins[0].port, EotPins[0].bit, 0);
+  sim_run_until(sim_time() + MS_TO_COUNTS(300));
+
+  remaining = countdown_remaining(COUNTDOWN_1);
+  if (offset < 0)
+  {
+    /* Only whole milliseconds are charged, so it may be up to one over */
+    expected_us = COUNTS_TO_US(-offset);
+    wrong = (clock_mode() != PLAY_MODE) || countdown_has_expired(COUNTDOWN_1) ||
+            !countdown_is_running(COUNTDOWN_2) || (remaining * 1000 < expected_us) ||
+            (remaining * 1000 >= expected_us + 1000);
+    printf("  %+3d counts: %s, %lums left (%.3fms at the first edge)\n", offset,
+           (clock_mode() == PLAY_MODE) ? "moved" : "lost", (unsigned long)remaining, expected_us / 1000.0);
+  }
+  else
+  {
+    wrong = (clock_mode() != WON_MODE) || !countdown_has_expired(COUNTDOWN_1);
+    printf("  %+3d counts: %s\n", offset, (clock_mode() == WON_MODE) ? "lost" : "moved");
+  }
+  return wrong;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long moves;
+  double max_error;
+  int failed;
+  uint8_t i;
+
+  moves = (argc >= 2) ? strtoul(argv[1], NULL, 10) : 500;
+  srand((argc >= 3) ? atoi(argv[2]) : 1);
+
+  sim_boot();
+  sim_run_until(MS_TO_COUNTS(2000));
+  max_error = play_moves(moves);
+  failed = (max_error >= MAX_ERROR_MS);
+
+  printf("press against the flag:\n");
+  for (i = 0; i < sizeof(RaceOffsets); i++)
+  {
+    if (race_flag(RaceOffsets[i]))
+    {
+      fprintf(stderr, "crediting: the press %+d counts from the flag went wrong\n", RaceOffsets[i]);
+      failed = 1;
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,70 @@
+/*
+ * host/events.c - checks that a release gets through a full queue of input events
+ *
+ * While the main loop is held up, as a slow pass of it would be, UP is held until its long
+ * push and repeats have filled the queue of input events in input.c. PAUSE is then held for
+ * longer than a long push and let go, and UP after it. The press and long push of PAUSE find
+ * the queue full and are lost, but its release must still get in, or its long-push counter
+ * is left where it stopped. Once the main loop has caught up, PAUSE is held again, and its
+ * long push must come as the counter reaches the threshold from zero, and put the clock
+ * into setup mode.
+ *
+ * Usage: events
+ * Fails if the long push of the second hold of PAUSE is not seen, or that of the first is.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "clock.h"
+
+/* Counts of 1.024ms */
+#define MS_TO_COUNTS(ms) (((ms) * 1000) / 1024)
+
+#define UP_PORT    'D'
+#define UP_BIT     4   /* active high */
+#define PAUSE_PORT 'B'
+#define PAUSE_BIT  4   /* active low */
+
+/* A long push comes after 10 ticks of 128ms, and a repeat every 3 from the 9th, so UP
+   held for FILL_MS posts 9 events, more than the 7 that the queue holds */
+#define FILL_MS 3500
+#define HOLD_MS 2000
+
+int main(void)
+{
+  sim_boot();
+  sim_run_until(MS_TO_COUNTS(2000));
+
+  sim_begin_busy();
+  sim_set_pin(UP_PORT, UP_BIT, 1);
+  sim_run_until(sim_time() + MS_TO_COUNTS(FILL_MS));
+  sim_set_pin(PAUSE_PORT, PAUSE_BIT, 0);
+  sim_run_until(sim_time() + MS_TO_COUNTS(HOLD_MS));
+  sim_set_pin(PAUSE_PORT, PAUSE_BIT, 1);
+  sim_run_until(sim_time() + MS_TO_COUNTS(100));
+  sim_set_pin(UP_PORT, UP_BIT, 0);
+  sim_run_until(sim_time() + MS_TO_COUNTS(100));
+  sim_end_busy();
+  if (clock_mode() != PLAY_MODE)
+  {
+    fprintf(stderr, "events: the long push of PAUSE got into the full queue\n");
+    return 1;
+  }
+
+  sim_run_until(sim_time() + MS_TO_COUNTS(1000));
+  sim_set_pin(PAUSE_PORT, PAUSE_BIT, 0);
+  sim_run_until(sim_time() + MS_TO_COUNTS(HOLD_MS));
+  sim_set_pin(PAUSE_PORT, PAUSE_BIT, 1);
+  sim_run_until(sim_time() + MS_TO_COUNTS(100));
+  printf("PAUSE held for %dms after its release met a full queue: %s\n", HOLD_MS,
+         (clock_mode() == SETUP_MODE) ? "long push" : "no long push");
+  if (clock_mode() != SETUP_MODE)
+  {
+    fprintf(stderr, "events: the release of PAUSE was lost in the full queue\n");
+    return 1;
+  }
+  return 0;
+}
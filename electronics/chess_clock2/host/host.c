@@ -0,0 +1,107 @@
+/*
+ * host.c - what the stand-in headers need when the firmware is built for the host
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include <util/delay_basic.h>
+
+/* The I/O registers and extended I/O registers, at their data memory addresses */
+volatile uint8_t host_registers[0x100];
+
+/* The EEPROM, and the data register that it is read into */
+uint8_t host_eeprom[E2END + 1] = { [0 ... E2END] = 0xFF };  /* erased */
+static volatile uint8_t eeprom_data;
+
+volatile uint16_t host_udr0_data = HOST_UDR0_EMPTY;
+
+void (*host_interrupts_enabled)(void);
+
+uint64_t host_delay_cycles;
+
+volatile uint8_t * host_eeprom_data(void)
+{
+  if (EECR & (1<<EERE))
+  {
+    EECR &= ~(1<<EERE);
+    eeprom_data = host_eeprom[EEAR % (E2END + 1)];
+  }
+  return &eeprom_data;
+}
+
+volatile uint16_t * host_udr0(void)
+{
+  UCSR0A &= ~(1<<RXC0);
+  return &host_udr0_data;
+}
+
+/* Delays take no time, but the cycles that they would take are counted. A count of
+   zero is the longest loop, as on the AVR */
+void _delay_ms(double ms)
+{
+  host_delay_cycles += ms * (F_CPU / 1000.0);
+}
+
+void _delay_us(double us)
+{
+  host_delay_cycles += us * (F_CPU / 1000000.0);
+}
+
+void _delay_loop_1(uint8_t count)
+{
+  host_delay_cycles += 3 * ((count == 0) ? 256 : count);
+}
+
+void _delay_loop_2(uint16_t count)
+{
+  host_delay_cycles += 4 * ((count == 0) ? 65536UL : count);
+}
+
+char * utoa(unsigned int value, char * buffer, int radix)
+{
+  if (radix == 16)
+  {
+    sprintf(buffer, "%x", value);
+  }
+  else if (radix == 8)
+  {
+    sprintf(buffer, "%o", value);
+  }
+  else
+  {
+    sprintf(buffer, "%u", value);
+  }
+  return buffer;
+}
+
+char * ultoa(unsigned long value, char * buffer, int radix)
+{
+  if (radix == 16)
+  {
+    sprintf(buffer, "%lx", value);
+  }
+  else if (radix == 8)
+  {
+    sprintf(buffer, "%lo", value);
+  }
+  else
+  {
+    sprintf(buffer, "%lu", value);
+  }
+  return buffer;
+}
+
+char * itoa(int value, char * buffer, int radix)
+{
+  /* As in avr-libc, only base 10 has a minus sign */
+  if (radix == 10)
+  {
+    sprintf(buffer, "%d", value);
+    return buffer;
+  }
+  return utoa(value, buffer, radix);
+}
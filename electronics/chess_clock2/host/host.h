@@ -0,0 +1,24 @@
+/*
+ * host/host.h - for a program that drives the firmware when it is built for the host
+ */
+
+#include <stdint.h>
+
+/* The I/O registers and extended I/O registers, at their data memory addresses */
+extern volatile uint8_t host_registers[0x100];
+
+/* CPU cycles that _delay_ms(), _delay_us() and the delay loops would have taken, which
+   they do not take on the host */
+extern uint64_t host_delay_cycles;
+
+/* The interrupt handlers, to be called when the interrupts would happen */
+void TIMER2_COMPA_vect(void);
+void TIMER2_COMPB_vect(void);
+void TIMER2_OVF_vect(void);
+void TIMER0_COMPB_vect(void);
+void PCINT0_vect(void);
+void PCINT2_vect(void);
+void USART_RX_vect(void);
+void USART_UDRE_vect(void);
+void USART_TX_vect(void);
+void EE_READY_vect(void);
@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+#
+# host/moves.py - turns a dump of the move log (movelog.c) into a table of the moves
+#
+# Usage: moves.py dump.txt
+#
+# The dump is the text that the clock sends out of PD3 at 1200 baud after a long push of
+# DOWN, once the game is won or while it is paused, captured with any terminal program.
+# Each move gives the countdown that was stopped, how long the turn took from the press
+# that started it to the press that ended it (including any pause), and the time left on
+# the countdown just after the press, before any bonus. A time left of 0 is a flag that fell.
+
+import sys
+
+TICK_MS = 128
+REMAINING_UNIT_MS = 256
+ELAPSED_MAX = 0x3FFF
+PLAYERS = ["1", "2", "3", "4"]
+
+
+def format_ms(ms):
+    seconds, ms = divmod(int(ms), 1000)
+    minutes, seconds = divmod(seconds, 60)
+    hours, minutes = divmod(minutes, 60)
+    if hours:
+        return "%d:%02d:%02d.%03d" % (hours, minutes, seconds, ms)
+    return "%d:%02d.%03d" % (minutes, seconds, ms)
+
+
+def read_dump(path):
+    """Returns a list of (title, size, [(id, elapsed ticks, remaining units)]) for each log in
+    the dump, where size is the most moves that the log holds"""
+    logs = []
+    moves = None
+    with open(path, errors="replace") as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 4 and fields[0] in ("MOVES", "SAVED") and fields[2] == "OF":
+                moves = []
+                logs.append(("this game" if fields[0] == "MOVES" else "last game saved",
+                             int(fields[3]), moves))
+            elif fields == ["END"]:
+                break
+            elif moves is not None and len(fields) == 3:
+                moves.append(tuple(int(field) for field in fields))
+    if not logs:
+        sys.exit("moves.py: no MOVES line in " + path)
+    return logs
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: moves.py dump.txt")
+    for title, size, moves in read_dump(sys.argv[1]):
+        if len(moves) >= size:
+            print("%s: the last %d moves, as the log holds no more" % (title, len(moves)))
+        else:
+            print("%s: %d moves" % (title, len(moves)))
+        print("    #  player  turn          left")
+        for number, (player, elapsed, remaining) in enumerate(moves, 1):
+            turn = format_ms(elapsed * TICK_MS)
+            if elapsed >= ELAPSED_MAX:
+                turn = ">" + turn
+            if remaining == 0:
+                left = "flag fell"
+            else:
+                # Rounded up to the unit, so the time left is within one unit below this
+                left = "<= " + format_ms(remaining * REMAINING_UNIT_MS)
+            print("%5d  %-6s  %-12s  %s" % (number, PLAYERS[player], turn, left))
+        print()
+
+
+if __name__ == "__main__":
+    main()
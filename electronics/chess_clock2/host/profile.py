@@ -0,0 +1,85 @@
+#!/usr/bin/env python3
+#
+# host/profile.py - turns a dump from the sampling profiler (profile.c) into a flat profile
+#
+# Usage: profile.py chess_clock2.out dump.txt
+#
+# The dump is the text that a PROFILE build sends out of PD3 at 1200 baud, captured with any
+# terminal program. The function addresses come from running avr-nm (or $NM) on the ELF file.
+# Each sample only says which bucket of flash the program was in, so where a bucket holds
+# more than one function its samples are shared out by how many of its bytes each one has.
+
+import os
+import subprocess
+import sys
+
+
+def read_functions(elf):
+    nm = os.environ.get("NM", "avr-nm")
+    output = subprocess.run([nm, "-S", "--defined-only", elf],
+                            check=True, capture_output=True, text=True).stdout
+    functions = []
+    for line in output.splitlines():
+        fields = line.split()
+        if len(fields) == 4 and fields[2] in "Tt":
+            functions.append((int(fields[0], 16), int(fields[1], 16), fields[3]))
+        elif len(fields) == 3 and fields[1] in "Tt":
+            functions.append((int(fields[0], 16), None, fields[2]))
+    functions.sort()
+
+    # A symbol with no size runs up to the next one
+    sized = []
+    for i, (addr, size, name) in enumerate(functions):
+        if size is None:
+            size = (functions[i + 1][0] - addr) if i + 1 < len(functions) else 2
+        sized.append((addr, max(size, 2), name))
+    return sized
+
+
+def read_dump(path):
+    bucket_size = None
+    buckets = {}
+    with open(path, errors="replace") as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 2 and fields[0] == "PROFILE":
+                bucket_size = int(fields[1])
+                buckets = {}
+            elif fields == ["END"]:
+                break
+            elif bucket_size is not None and len(fields) == 2:
+                buckets[int(fields[0], 16)] = int(fields[1])
+    if bucket_size is None:
+        sys.exit("profile.py: no PROFILE line in " + path)
+    return bucket_size, buckets
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: profile.py firmware.out dump.txt")
+    functions = read_functions(sys.argv[1])
+    bucket_size, buckets = read_dump(sys.argv[2])
+
+    samples = {}
+    for start, count in buckets.items():
+        end = start + bucket_size
+        overlaps = []
+        for addr, size, name in functions:
+            overlap = min(end, addr + size) - max(start, addr)
+            if overlap > 0:
+                overlaps.append((overlap, name))
+        if not overlaps:
+            overlaps = [(1, "?%04x" % start)]
+        total = sum(overlap for overlap, name in overlaps)
+        for overlap, name in overlaps:
+            samples[name] = samples.get(name, 0) + count * overlap / total
+
+    total = sum(buckets.values())
+    print("%d samples, %d bytes per bucket" % (total, bucket_size))
+    print("    %   samples  function")
+    for name, count in sorted(samples.items(), key=lambda item: -item[1]):
+        print("%5.1f %9.1f  %s" % (100.0 * count / total, count, name))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,358 @@
+/*
+ * host/resume.c - checks that a game resumed after a loss of power carries on as it would have
+ *
+ * For each time control, plays games of quick random moves on end-of-turn inputs 1 and 2,
+ * long enough to reach the second stage of "40/120m SD/30m". In each game the clock is paused
+ * at a random moment in a random turn, and the power is cut while it is paused. The firmware
+ * is then started again in a new process, from what was left in the EEPROM, and PAUSE carries
+ * on with the game as it was offered. A reference process plays the same game with the same
+ * pause, but no cut. At the end both are paused, and the remaining times and the moves made
+ * must agree.
+ *
+ * The pause often falls inside a US delay, or part way through a turn whose time a Bronstein
+ * bonus gives back, and the cut game must still take back the delay that was not used, and
+ * give back the time used before the pause. A pause just after a move stands in for a cut
+ * while the clock runs, as a running clock is only checkpointed at the moves.
+ *
+ * Each game is in processes of their own, forked from this one before the firmware has run.
+ *
+ * Usage: resume [games [seed]]
+ * Fails if a resumed game ends with a remaining time more than MAX_ERROR_MS out, with other
+ * moves made, or is not offered at all.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <avr/io.h>
+
+#include "sim.h"
+#include "timer.h"
+#include "eeprom.h"
+#include "clock.h"
+#include "settings.h"
+#include "timecontrol.h"
+#include "timecontrols.h"
+
+/* Counts of 1.024ms */
+#define MS_TO_COUNTS(ms) (((ms) * 1000) / 1024)
+
+#define NUM_MOVES       90
+#define SET_MINUTES     10
+#define MIN_THINK_MS    300
+#define MAX_THINK_MS    9000
+#define HOLD_MS         100   /* how long a key is held down */
+#define PAUSED_MS       1000
+#define MAX_ERROR_MS    1     /* only whole milliseconds are charged */
+
+static const struct
+{
+  char port;
+  uint8_t bit;
+} EotPins[2] = { { 'D', 1 }, { 'D', 2 } };
+
+#define PAUSE_PORT   'B'
+#define PAUSE_BIT    4   /* active low */
+#define RESTART_PORT 'B'
+#define RESTART_BIT  3   /* active low */
+
+/* A game: how long each player thinks before each move, and where it is paused */
+typedef struct
+{
+  uint8_t control;
+  uint16_t think_ms[NUM_MOVES];
+  uint8_t pause_move;     /* paused in the turn after this move */
+  uint16_t pause_ms;      /* this long after the move */
+} GameType;
+
+/* What a game ends with */
+typedef struct
+{
+  uint8_t offered;
+  uint32_t remaining[2];
+  uint32_t shown[2];
+  uint8_t moves[2];
+} ResultType;
+
+static GameType Game;
+static uint8_t Eeprom[EEPROM_SIZE];
+
+/* Changes the level of an input, with a bounce in each of the next two timer counts */
+static void bounce_pin(char port, uint8_t bit, uint8_t level)
+{
+  sim_set_pin(port, bit, level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, !level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, level);
+}
+
+static void push(char port, uint8_t bit, uint8_t active)
+{
+  bounce_pin(port, bit, active);
+  sim_run_until(sim_time() + MS_TO_COUNTS(HOLD_MS));
+  bounce_pin(port, bit, !active);
+}
+
+/* Sets up the control, and a new game under it */
+static void start_game(void)
+{
+  uint8_t id;
+
+  sim_boot();
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    set_settings_time(id, SET_MINUTES, 0);
+  }
+  set_settings_control(Game.control);
+  save_settings();
+  sim_run_until(sim_time() + MS_TO_COUNTS(1000));
+  push(RESTART_PORT, RESTART_BIT, 0);
+  sim_run_until(sim_time() + MS_TO_COUNTS(1000));
+}
+
+/* Makes move, then lets the other player think for think_ms of their turn */
+static void play_move(uint8_t move, uint16_t think_ms)
+{
+  uint64_t press;
+  press = sim_time();
+  push(EotPins[move % 2].port, EotPins[move % 2].bit, 1);
+  sim_run_until(press + MS_TO_COUNTS(think_ms));
+}
+
+/* Pushes PAUSE, to stop or carry on */
+static void pause_clock(void)
+{
+  uint64_t press;
+  press = sim_time();
+  push(PAUSE_PORT, PAUSE_BIT, 0);
+  sim_run_until(press + MS_TO_COUNTS(PAUSED_MS));
+}
+
+/* Plays the moves up to the pause, and pauses */
+static void play_to_pause(void)
+{
+  uint8_t move;
+  for (move = 0; move < Game.pause_move; move++)
+  {
+    play_move(move, Game.think_ms[move]);
+  }
+  play_move(Game.pause_move, Game.pause_ms);
+  pause_clock();
+}
+
+/* Carries on from the pause to the end of the game, pauses and sends back where it stands */
+static void play_from_pause(int fd)
+{
+  ResultType result;
+  uint8_t move;
+  uint8_t id;
+
+  pause_clock();
+  sim_run_until(sim_time() + MS_TO_COUNTS(Game.think_ms[Game.pause_move] - Game.pause_ms));
+  for (move = Game.pause_move + 1; move < NUM_MOVES; move++)
+  {
+    play_move(move, Game.think_ms[move]);
+  }
+  pause_clock();
+
+  memset(&result, 0, sizeof(result));
+  result.offered = 1;
+  for (id = 0; id < 2; id++)
+  {
+    result.remaining[id] = countdown_remaining(id);
+    result.shown[id] = time_control_remaining(id);
+    result.moves[id] = time_control_moves(id);
+  }
+  if (write(fd, &result, sizeof(result)) != sizeof(result))
+  {
+    _exit(2);
+  }
+  _exit(0);
+}
+
+/* The processes of a game */
+static void reference_game(int fd)
+{
+  start_game();
+  play_to_pause();
+  sim_run_until(sim_time() + MS_TO_COUNTS(PAUSED_MS));
+  play_from_pause(fd);
+}
+
+static void cut_game(int fd)
+{
+  start_game();
+  play_to_pause();
+  if (write(fd, host_eeprom, EEPROM_SIZE) != EEPROM_SIZE)
+  {
+    _exit(2);
+  }
+  _exit(0);
+}
+
+static void resumed_game(int fd)
+{
+  ResultType result;
+
+  memcpy(host_eeprom, Eeprom, EEPROM_SIZE);
+  sim_boot();
+  sim_run_until(sim_time() + MS_TO_COUNTS(1000));
+  if ((clock_mode() != PLAY_MODE) || countdown_is_running(COUNTDOWN_1) || countdown_is_running(COUNTDOWN_2))
+  {
+    memset(&result, 0, sizeof(result));
+    if (write(fd, &result, sizeof(result)) != sizeof(result))
+    {
+      _exit(2);
+    }
+    _exit(0);
+  }
+  play_from_pause(fd);
+}
+
+static void read_all(int fd, void * data, size_t size)
+{
+  uint8_t * ptr = data;
+  ssize_t done;
+  while (size > 0)
+  {
+    done = read(fd, ptr, size);
+    if (done <= 0)
+    {
+      fprintf(stderr, "resume: a game went wrong\n");
+      exit(2);
+    }
+    ptr += done;
+    size -= done;
+  }
+}
+
+/* Runs one of the processes of the game, and reads what it sends back */
+static void run(void (*process)(int fd), void * data, size_t size)
+{
+  int fds[2];
+  pid_t pid;
+
+  if (pipe(fds) != 0)
+  {
+    perror("resume: pipe");
+    exit(2);
+  }
+  fflush(stdout);
+  pid = fork();
+  if (pid < 0)
+  {
+    perror("resume: fork");
+    exit(2);
+  }
+  if (pid == 0)
+  {
+    close(fds[0]);
+    process(fds[1]);
+  }
+  close(fds[1]);
+  read_all(fds[0], data, size);
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+}
+
+static uint32_t difference(uint32_t a, uint32_t b)
+{
+  return (a > b) ? a - b : b - a;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long games;
+  unsigned long game;
+  unsigned long failures;
+  uint32_t error;
+  uint32_t max_error[NUM_TIME_CONTROLS];
+  unsigned long control_failures[NUM_TIME_CONTROLS];
+  ResultType reference;
+  ResultType resumed;
+  uint8_t move;
+  uint8_t id;
+  uint8_t wrong;
+
+  games = (argc >= 2) ? strtoul(argv[1], NULL, 10) : 20;
+  srand((argc >= 3) ? atoi(argv[2]) : 1);
+
+  failures = 0;
+  memset(max_error, 0, sizeof(max_error));
+  memset(control_failures, 0, sizeof(control_failures));
+  for (game = 0; game < games * NUM_TIME_CONTROLS; game++)
+  {
+    Game.control = game % NUM_TIME_CONTROLS;
+    for (move = 0; move < NUM_MOVES; move++)
+    {
+      Game.think_ms[move] = MIN_THINK_MS + rand() % (MAX_THINK_MS - MIN_THINK_MS);
+    }
+    /* A third of the pauses are round the change of stage after the 40th move of each player */
+    if (rand() % 3 == 0)
+    {
+      Game.pause_move = 77 + rand() % 6;
+    }
+    else
+    {
+      Game.pause_move = rand() % (NUM_MOVES - 1);
+    }
+    /* A quarter of them just after the move, and the others anywhere in the turn */
+    if (rand() % 4 == 0)
+    {
+      Game.pause_ms = 2 * HOLD_MS;
+    }
+    else
+    {
+      Game.pause_ms = 2 * HOLD_MS + rand() % (Game.think_ms[Game.pause_move] - 2 * HOLD_MS);
+    }
+
+    run(reference_game, &reference, sizeof(reference));
+    run(cut_game, Eeprom, sizeof(Eeprom));
+    run(resumed_game, &resumed, sizeof(resumed));
+
+    wrong = !resumed.offered;
+    for (id = 0; (id < 2) && !wrong; id++)
+    {
+      error = difference(resumed.remaining[id], reference.remaining[id]);
+      if (error > max_error[Game.control])
+      {
+        max_error[Game.control] = error;
+      }
+      wrong = (error > MAX_ERROR_MS) || (difference(resumed.shown[id], reference.shown[id]) > MAX_ERROR_MS) ||
+              (resumed.moves[id] != reference.moves[id]);
+    }
+    if (wrong)
+    {
+      if (control_failures[Game.control] == 0)
+      {
+        fprintf(stderr, "resume: \"%.16s\", paused %ums after move %u: ", time_control_name(Game.control),
+                Game.pause_ms, Game.pause_move);
+        if (!resumed.offered)
+        {
+          fprintf(stderr, "the game was not offered\n");
+        }
+        else
+        {
+          fprintf(stderr, "resumed %lums and %lums after %u and %u moves, against %lums and %lums after %u and %u\n",
+                  (unsigned long)resumed.remaining[0], (unsigned long)resumed.remaining[1],
+                  resumed.moves[0], resumed.moves[1],
+                  (unsigned long)reference.remaining[0], (unsigned long)reference.remaining[1],
+                  reference.moves[0], reference.moves[1]);
+        }
+      }
+      control_failures[Game.control]++;
+      failures++;
+    }
+  } /* end for all games */
+
+  for (Game.control = 0; Game.control < NUM_TIME_CONTROLS; Game.control++)
+  {
+    printf("%.16s %lu games resumed, %lu wrong, max error %lums\n", time_control_name(Game.control),
+           games, control_failures[Game.control], (unsigned long)max_error[Game.control]);
+  }
+  return failures ? 1 : 0;
+}
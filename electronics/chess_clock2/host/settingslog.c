@@ -0,0 +1,261 @@
+/*
+ * host/settingslog.c - checks that the settings log (settings.c) survives a save cut short
+ *
+ * Saves random settings over and over, against the EEPROM of host.c. Each save is made in a
+ * process of its own, forked from this one, which loads the settings as init_settings() does
+ * at power on, changes them and saves them. Some of the saves are cut off after a random
+ * number of bytes have been written, as a power failure would, by ending the process there.
+ * This process then loads the settings from what is left in the EEPROM, and they must be
+ * either the new settings or the ones that were there before the save.
+ *
+ * The bytes are written by the EEPROM ready handler, called whenever interrupts are enabled
+ * until the queue is empty, and each write that changes a byte is counted, to show how the log
+ * spreads the wear. Once a save has been cut off, what is left in the queue is lost.
+ *
+ * First of all it puts random times in bytes 0 to 7, as firmware from before the log left
+ * them, and checks that they are loaded, saved into the log without those bytes being written
+ * over, and loaded again from the log.
+ *
+ * Usage: settingslog [saves [seed]]
+ * Fails if a load gives anything but the new or the previous settings, or the times left by
+ * the old firmware are not taken into the log.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "host.h"
+#include "timer.h"
+#include "eeprom.h"
+#include "settings.h"
+#include "timecontrols.h"
+
+#define CUT_ONE_IN 4
+
+/* The old firmware kept the minutes and seconds of each countdown in bytes 0 to 7 */
+#define OLD_SETTINGS_SIZE (2 * NUM_COUNTDOWNS)
+
+typedef struct
+{
+  uint8_t minutes[NUM_COUNTDOWNS];
+  uint8_t seconds[NUM_COUNTDOWNS];
+  uint8_t control;
+} ValuesType;
+
+/* What a save sends back: the EEPROM as it was left, and the bytes that it changed */
+typedef struct
+{
+  uint8_t eeprom[EEPROM_SIZE];
+  uint8_t written[EEPROM_SIZE];
+} SaveType;
+
+static void random_values(ValuesType * values_ptr)
+{
+  uint8_t id;
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    values_ptr->minutes[id] = rand() % 100;
+    values_ptr->seconds[id] = rand() % 60;
+  }
+  values_ptr->control = rand() % NUM_TIME_CONTROLS;
+}
+
+static void load_values(ValuesType * values_ptr)
+{
+  uint8_t id;
+  init_settings();
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    settings_time(id, &values_ptr->minutes[id], &values_ptr->seconds[id]);
+  }
+  values_ptr->control = settings_control();
+}
+
+static SaveType Save;
+static unsigned WriteLimit;  /* bytes still to be written before the power fails */
+
+/* Runs the EEPROM ready handler while it is enabled */
+static void write_queued(void)
+{
+  uint16_t addr;
+  while (EECR & (1<<EERIE))
+  {
+    EE_READY_vect();
+    if (EECR & (1<<EEPE))
+    {
+      if (WriteLimit > 0)
+      {
+        addr = EEAR % EEPROM_SIZE;
+        host_eeprom[addr] = EEDR;
+        Save.written[addr] = 1;
+        WriteLimit--;
+      }
+      EECR &= ~((1<<EEPE) | (1<<EEMPE));
+    }
+  }
+}
+
+/* In the forked process: saves the values, stopping after limit bytes, and sends back the EEPROM */
+static void save_values(const ValuesType * values_ptr, unsigned limit, int fd)
+{
+  ValuesType loaded;
+  uint8_t id;
+
+  memset(&Save, 0, sizeof(Save));
+  load_values(&loaded);
+  WriteLimit = limit;
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    set_settings_time(id, values_ptr->minutes[id], values_ptr->seconds[id]);
+  }
+  set_settings_control(values_ptr->control);
+  save_settings();
+  write_queued();
+  memcpy(Save.eeprom, host_eeprom, EEPROM_SIZE);
+  if (write(fd, &Save, sizeof(Save)) != sizeof(Save))
+  {
+    _exit(1);
+  }
+  _exit(0);
+}
+
+static void read_all(int fd, void * data, size_t size)
+{
+  uint8_t * ptr = data;
+  ssize_t done;
+  while (size > 0)
+  {
+    done = read(fd, ptr, size);
+    if (done <= 0)
+    {
+      fprintf(stderr, "settingslog: a save went wrong\n");
+      exit(2);
+    }
+    ptr += done;
+    size -= done;
+  }
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long saves;
+  unsigned long save;
+  unsigned long cut;
+  unsigned long failures;
+  unsigned long writes[EEPROM_SIZE];
+  unsigned long max_writes;
+  unsigned limit;
+  unsigned addr;
+  int fds[2];
+  pid_t pid;
+  SaveType result;
+  ValuesType before;
+  ValuesType wanted;
+  ValuesType loaded;
+  uint8_t old[OLD_SETTINGS_SIZE];
+
+  saves = (argc >= 2) ? strtoul(argv[1], NULL, 10) : 10000;
+  srand((argc >= 3) ? atoi(argv[2]) : 1);
+
+  host_interrupts_enabled = write_queued;
+  WriteLimit = (unsigned)-1;
+  memset(writes, 0, sizeof(writes));
+  cut = failures = 0;
+
+  /* The old firmware had no time control */
+  random_values(&before);
+  before.control = 0;
+  for (addr = 0; addr < NUM_COUNTDOWNS; addr++)
+  {
+    host_eeprom[addr * 2] = before.minutes[addr];
+    host_eeprom[addr * 2 + 1] = before.seconds[addr];
+  }
+  memcpy(old, host_eeprom, OLD_SETTINGS_SIZE);
+  load_values(&loaded);
+  if (memcmp(&loaded, &before, sizeof(loaded)) != 0)
+  {
+    fprintf(stderr, "settingslog: the times left by the old firmware were not loaded\n");
+    failures++;
+  }
+  if (memcmp(host_eeprom, old, OLD_SETTINGS_SIZE) != 0)
+  {
+    fprintf(stderr, "settingslog: the times left by the old firmware were written over by the first save\n");
+    failures++;
+  }
+  memset(host_eeprom, 0xFF, OLD_SETTINGS_SIZE);
+  load_values(&loaded);
+  if (memcmp(&loaded, &before, sizeof(loaded)) != 0)
+  {
+    fprintf(stderr, "settingslog: the times left by the old firmware were not saved into the log\n");
+    failures++;
+  }
+  printf("old settings: %s\n", failures ? "lost" : "taken into the log");
+  for (save = 0; save < saves; save++)
+  {
+    random_values(&wanted);
+    limit = EEPROM_SIZE;
+    if (rand() % CUT_ONE_IN == 0)
+    {
+      limit = rand() % 16;
+      cut++;
+    }
+
+    if (pipe(fds) != 0)
+    {
+      perror("settingslog: pipe");
+      return 2;
+    }
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+    {
+      perror("settingslog: fork");
+      return 2;
+    }
+    if (pid == 0)
+    {
+      close(fds[0]);
+      save_values(&wanted, limit, fds[1]);
+    }
+    close(fds[1]);
+    read_all(fds[0], &result, sizeof(result));
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+
+    memcpy(host_eeprom, result.eeprom, EEPROM_SIZE);
+    for (addr = 0; addr < EEPROM_SIZE; addr++)
+    {
+      writes[addr] += result.written[addr];
+    }
+    load_values(&loaded);
+    if (memcmp(&loaded, &wanted, sizeof(loaded)) == 0)
+    {
+      before = loaded;
+    }
+    else if (memcmp(&loaded, &before, sizeof(loaded)) != 0)
+    {
+      fprintf(stderr, "settingslog: save %lu, cut after %u bytes, loaded neither the new nor the old settings\n",
+              save, limit);
+      failures++;
+      before = loaded;
+    }
+  } /* end for all saves */
+
+  max_writes = 0;
+  for (addr = 0; addr < EEPROM_SIZE; addr++)
+  {
+    if (writes[addr] > max_writes)
+    {
+      max_writes = writes[addr];
+    }
+  }
+  printf("%lu saves, %lu of them cut short: %lu loads wrong\n", saves, cut, failures);
+  printf("most writes to one byte: %lu, over a log of %u bytes\n", max_writes, SETTINGS_LOG_SIZE);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,634 @@
+/*
+ * host/sim.c - the hardware around the firmware when it is built for the host
+ */
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "host.h"
+#include "sim.h"
+#include "timer.h"
+#include "serial.h"
+#include "eeprom.h"
+#include "main.h"
+
+/* The registers are plain memory, so a flag that the firmware clears by writing a one
+   to it would be set instead. The true interrupt flags of timer 2 are kept here, and
+   TIFR2 shows them with an unused bit set as well. Whenever the firmware has run, any
+   change that it has made to TIFR2 is taken as a write of ones to clear flags, as the
+   firmware only ever writes the bits of the flags. The firmware also always clears a
+   flag just before it enables the interrupt, so a flag is cleared when its interrupt is
+   enabled too. */
+#define TIFR2_UNUSED_BIT 0x80
+
+static uint8_t Flags2;
+static uint8_t ShownFlags2;
+static uint8_t LastTimsk2;
+
+/* The transmitter of the USART. A byte written to UDR0 waits in the data register until the
+   shift register is free, then takes a frame time, worked out from the baud rate and the frame
+   format, to go. A frame is not a whole number of timer counts, so its time is kept in
+   microseconds. TXC0 is kept here as the flags of timer 2 are, and is cleared when its
+   interrupt is enabled. The receiver takes a frame whole, at the time it is given, and
+   RXC0 is set until the firmware reads UDR0 */
+#define COUNTS_TO_US(counts) ((counts) * 1024)
+
+static uint8_t TxShifting;
+static uint8_t TxShiftByte;
+static uint64_t TxShiftEnd;
+static uint8_t TxWaiting;
+static uint8_t TxWaitingByte;
+static uint8_t TxComplete;
+static uint8_t RxComplete;
+static uint8_t LastUcsr0b;
+static void (*SerialOutput)(uint8_t byte, uint64_t end_us);
+
+/* Timer 0 counts 8us, 128 times in a count of timer 2, so it is worked out from the time in
+   microseconds, Timer0Us, which is the time of the last timer 2 count except while a step
+   goes through the compare matches of timer 0 inside it. Only compare match B, the software
+   transmitter of serial.c, is modelled: its handler runs at the microsecond of the match, or
+   once the stall is over if interrupts are held off. What the handler does to PD3 is read
+   back as a receiver would, sampling the middle of each bit, with a frame dropped if its
+   stop bit is not high */
+#define TIMER0_COUNT_US 8
+#define SOFT_BIT_US     (1000000 / SERIAL_SOFT_BAUD)
+#define SOFT_FRAME_BITS 10
+
+static uint64_t Timer0Us;
+static uint8_t Timer0Pending;
+static uint8_t LastTimsk0;
+static uint8_t SoftLevel;
+static uint8_t SoftBit;      /* the next bit of the frame to sample, or 0 while the line is idle */
+static uint8_t SoftData;
+static uint64_t SoftStartUs;
+
+static uint8_t Delivering;
+static uint8_t Stalled;      /* interrupts held off by sim_begin_stall() */
+static uint8_t Busy;         /* the main loop held up by sim_begin_busy() */
+static uint64_t Now;
+static unsigned long Interrupts;
+static unsigned long Polls;
+static unsigned long Wakeups;
+
+/* Time that the firmware sleeps in idle mode rather than power save, as sleep_until_interrupt()
+   chooses. An EEPROM write takes no time here, so each is taken to keep the firmware in idle
+   for the 3.4ms that it takes on the chip */
+#define EEPROM_WRITE_US 3400
+
+static uint64_t IdleCounts;
+static unsigned long EepromWrites;
+
+static uint8_t transmitter_on(void)
+{
+  return ((PRR & (1<<PRUSART0)) == 0) && ((UCSR0B & (1<<TXEN0)) != 0);
+}
+
+static uint8_t receiver_on(void)
+{
+  return ((PRR & (1<<PRUSART0)) == 0) && ((UCSR0B & (1<<RXEN0)) != 0);
+}
+
+/* Microseconds to send a frame: a start bit, the data bits, any parity bit and the stop bits */
+static uint32_t frame_us(void)
+{
+  static const uint8_t DataBits[8] = { 5, 6, 7, 8, 8, 8, 8, 9 };
+  uint32_t bits;
+  uint32_t divisor;
+
+  bits = 1 + DataBits[((UCSR0B & (1<<UCSZ02)) ? 4 : 0) | ((UCSR0C >> UCSZ00) & 3)]
+       + ((UCSR0C & (1<<UPM01)) ? 1 : 0)
+       + ((UCSR0C & (1<<USBS0)) ? 2 : 1);
+  divisor = ((UCSR0A & (1<<U2X0)) ? 8 : 16) * (UBRR0 + 1);
+  return (uint64_t)bits * divisor * 1000000 / F_CPU;
+}
+
+static void start_shifting(uint8_t byte, uint64_t start_us)
+{
+  TxShifting = 1;
+  TxShiftByte = byte;
+  TxShiftEnd = start_us + frame_us();
+}
+
+/* Takes in what the firmware has done to the registers since it was last called */
+static void sync_registers(void)
+{
+  if (TIFR2 != ShownFlags2)
+  {
+    Flags2 &= ~TIFR2;
+  }
+  Flags2 &= ~(TIMSK2 & ~LastTimsk2 & ((1<<OCF2A) | (1<<OCF2B)));
+  LastTimsk2 = TIMSK2;
+  TIFR2 = ShownFlags2 = Flags2 | TIFR2_UNUSED_BIT;
+  if (TIMSK0 & ~LastTimsk0 & (1<<OCIE0B))
+  {
+    Timer0Pending = 0;
+  }
+  LastTimsk0 = TIMSK0;
+
+  /* An EEPROM write takes no time */
+  if (EECR & (1<<EEPE))
+  {
+    host_eeprom[EEAR % (E2END + 1)] = EEDR;
+    EECR &= ~((1<<EEPE) | (1<<EEMPE));
+    EepromWrites++;
+  }
+
+  if (!transmitter_on())
+  {
+    TxShifting = 0;
+    TxWaiting = 0;
+  }
+  if (host_udr0_data < HOST_UDR0_EMPTY)
+  {
+    if (!transmitter_on())
+    {
+      /* Lost */
+    }
+    else if (!TxShifting)
+    {
+      start_shifting(host_udr0_data, COUNTS_TO_US(Now));
+    }
+    else if (!TxWaiting)
+    {
+      TxWaiting = 1;
+      TxWaitingByte = host_udr0_data;
+    }
+    host_udr0_data = HOST_UDR0_EMPTY;
+  }
+  if (!receiver_on() || !(UCSR0A & (1<<RXC0)))
+  {
+    /* Read, or never there */
+    RxComplete = 0;
+  }
+  if (!RxComplete && (host_udr0_data >= HOST_UDR0_RECEIVED))
+  {
+    host_udr0_data = HOST_UDR0_EMPTY;
+  }
+  if (UCSR0B & ~LastUcsr0b & (1<<TXCIE0))
+  {
+    TxComplete = 0;
+  }
+  LastUcsr0b = UCSR0B;
+  UCSR0A = (UCSR0A & ~((1<<RXC0) | (1<<UDRE0) | (1<<TXC0)))
+         | (RxComplete ? (1<<RXC0) : 0)
+         | (TxWaiting ? 0 : (1<<UDRE0))
+         | (TxComplete ? (1<<TXC0) : 0);
+}
+
+static void pass_soft_frame(void)
+{
+  if (SerialOutput)
+  {
+    SerialOutput(SoftData, SoftStartUs + SOFT_FRAME_BITS * SOFT_BIT_US);
+  }
+  SoftBit = 0;
+}
+
+/* Samples the bits of PD3 that are due by at_us, and passes on a frame once its stop bit has ended */
+static void sample_soft_tx(uint64_t at_us)
+{
+  while (SoftBit != 0)
+  {
+    if (SoftBit < SOFT_FRAME_BITS)
+    {
+      if (SoftStartUs + SoftBit * SOFT_BIT_US + SOFT_BIT_US / 2 > at_us)
+      {
+        break;
+      }
+      if (SoftBit < SOFT_FRAME_BITS - 1)
+      {
+        SoftData |= SoftLevel << (SoftBit - 1);
+      }
+      else if (!SoftLevel)
+      {
+        /* Framing error */
+        SoftBit = 0;
+        break;
+      }
+      SoftBit++;
+    }
+    else
+    {
+      if (SoftStartUs + SOFT_FRAME_BITS * SOFT_BIT_US > at_us)
+      {
+        break;
+      }
+      pass_soft_frame();
+    }
+  } /* end while in a frame */
+}
+
+/* Takes in the level of PD3 at at_us, after a handler has run */
+static void watch_soft_tx(uint64_t at_us)
+{
+  uint8_t level;
+#ifdef BUS_BOARD
+  /* PD3 is end-of-turn 1 */
+  return;
+#endif
+  level = (PORTD >> SERIAL_SOFT_TX_BIT) & 1;
+  if (level != SoftLevel)
+  {
+    sample_soft_tx(at_us);
+    SoftLevel = level;
+    if ((SoftBit == SOFT_FRAME_BITS) && !level)
+    {
+      /* The next start bit, a little before the stop bit has had its full time here */
+      pass_soft_frame();
+    }
+    if ((SoftBit == 0) && !level)
+    {
+      SoftBit = 1;
+      SoftData = 0;
+      SoftStartUs = at_us;
+    }
+  }
+}
+
+/* Runs the pending interrupt handlers, in the order of their vectors, while interrupts are enabled */
+static void deliver_interrupts(void)
+{
+  void (*vector)(void);
+
+  if (Stalled)
+  {
+    return;
+  }
+  Delivering = 1;
+  sync_registers();
+  while (SREG & SREG_I)
+  {
+    if ((PCICR & (1<<PCIE0)) && (PCIFR & (1<<PCIF0)))
+    {
+      PCIFR &= ~(1<<PCIF0);
+      vector = PCINT0_vect;
+    }
+    else if ((PCICR & (1<<PCIE2)) && (PCIFR & (1<<PCIF2)))
+    {
+      PCIFR &= ~(1<<PCIF2);
+      vector = PCINT2_vect;
+    }
+    else if ((TIMSK2 & (1<<OCIE2A)) && (Flags2 & (1<<OCF2A)))
+    {
+      Flags2 &= ~(1<<OCF2A);
+      vector = TIMER2_COMPA_vect;
+    }
+    else if ((TIMSK2 & (1<<OCIE2B)) && (Flags2 & (1<<OCF2B)))
+    {
+      Flags2 &= ~(1<<OCF2B);
+      vector = TIMER2_COMPB_vect;
+    }
+#ifdef TRACE
+    /* Only the trace uses the overflow interrupt */
+    else if ((TIMSK2 & (1<<TOIE2)) && (Flags2 & (1<<TOV2)))
+    {
+      Flags2 &= ~(1<<TOV2);
+      vector = TIMER2_OVF_vect;
+    }
+#endif
+    else if ((TIMSK0 & (1<<OCIE0B)) && Timer0Pending)
+    {
+      Timer0Pending = 0;
+      vector = TIMER0_COMPB_vect;
+    }
+    else if ((UCSR0B & (1<<RXCIE0)) && RxComplete)
+    {
+      vector = USART_RX_vect;
+    }
+    else if (transmitter_on() && (UCSR0B & (1<<UDRIE0)) && !TxWaiting)
+    {
+      vector = USART_UDRE_vect;
+    }
+    else if ((UCSR0B & (1<<TXCIE0)) && TxComplete)
+    {
+      TxComplete = 0;
+      vector = USART_TX_vect;
+    }
+    else if ((EECR & (1<<EERIE)) && !(EECR & (1<<EEPE)))
+    {
+      vector = EE_READY_vect;
+    }
+    else
+    {
+      break;
+    }
+    TIFR2 = ShownFlags2 = Flags2 | TIFR2_UNUSED_BIT;
+    SREG &= ~SREG_I;
+    vector();
+    sync_registers();
+    SREG |= SREG_I;
+    Interrupts++;
+    watch_soft_tx(Timer0Us);
+  } /* end while interrupts are enabled */
+  Delivering = 0;
+}
+
+static void interrupts_enabled(void)
+{
+  if (Delivering)
+  {
+    sync_registers();
+  }
+  else
+  {
+    deliver_interrupts();
+  }
+}
+
+/* Runs the handlers that are pending while the firmware sleeps. They run in one wake-up, back
+   to back, before sleep_until_interrupt() looks for a poll */
+static void wake_up(void)
+{
+  unsigned long before;
+  before = Interrupts;
+  deliver_interrupts();
+  if (!Stalled && !Busy && (Interrupts != before))
+  {
+    Wakeups++;
+  }
+}
+
+/* As the loop in main(), with sleep_until_interrupt() returning while a poll is requested */
+static void run_main_loop(void)
+{
+  while (!Stalled && !Busy && poll_requested())
+  {
+    clear_poll_request();
+    poll_firmware();
+    Polls++;
+  }
+}
+
+void sim_boot(void)
+{
+  host_interrupts_enabled = interrupts_enabled;
+  SoftLevel = 1;
+  PIND = (1<<PD7);                                   /* end-of-turn 3 not fitted */
+  PINB = (1<<PB0) | (1<<PB3) | (1<<PB4) | (1<<PB5);  /* end-of-turn 4 not fitted, the others active low */
+
+  init_firmware();
+  poll_firmware();
+  Polls++;
+  run_main_loop();
+}
+
+void sim_set_pin(char port, uint8_t bit, uint8_t level)
+{
+  volatile uint8_t * pin_ptr;
+  uint8_t mask;
+  uint8_t flag;
+  uint8_t before;
+
+  if (port == 'B')
+  {
+    pin_ptr = &PINB;
+    mask = PCMSK0;
+    flag = 1<<PCIF0;
+  }
+  else
+  {
+    pin_ptr = &PIND;
+    mask = PCMSK2;
+    flag = 1<<PCIF2;
+  }
+  before = *pin_ptr;
+  if (level)
+  {
+    *pin_ptr |= (1<<bit);
+  }
+  else
+  {
+    *pin_ptr &= ~(1<<bit);
+  }
+  if ((before ^ *pin_ptr) & mask)
+  {
+    PCIFR |= flag;
+  }
+  wake_up();
+  run_main_loop();
+}
+
+/* Counts to the next overflow, from 1 to 256 */
+static uint16_t counts_to_overflow(void)
+{
+  return 256 - TCNT2;
+}
+
+/* Counts to the next compare match of a compare register, from 1 to 256 */
+static uint16_t counts_to(uint8_t ocr)
+{
+  uint8_t counts;
+  counts = ocr - TCNT2;
+  return (counts == 0) ? 256 : counts;
+}
+
+/* Microseconds from Timer0Us to the next compare match B of timer 0, from 8 to 2048 */
+static uint32_t us_to_timer0_match(void)
+{
+  uint8_t counts;
+  counts = OCR0B - TCNT0;
+  return ((counts == 0) ? 256 : counts) * TIMER0_COUNT_US;
+}
+
+/* Runs timer 0 on to end_us, running the handler of each compare match B that it passes */
+static void advance_timer0(uint64_t end_us)
+{
+  while ((TIMSK0 & (1<<OCIE0B)) && !Timer0Pending && (Timer0Us + us_to_timer0_match() <= end_us))
+  {
+    Timer0Us += us_to_timer0_match();
+    TCNT0 = OCR0B;
+    if (Stalled)
+    {
+      Timer0Pending = 1;
+    }
+    else
+    {
+      SREG &= ~SREG_I;
+      TIMER0_COMPB_vect();
+      sync_registers();
+      SREG |= SREG_I;
+      Interrupts++;
+      if (!Busy)
+      {
+        Wakeups++;
+      }
+      watch_soft_tx(Timer0Us);
+    }
+  } /* end while matches to run */
+  Timer0Us = end_us;
+  TCNT0 = end_us / TIMER0_COUNT_US;
+  sample_soft_tx(end_us);
+}
+
+/* Moves the timer on, setting the flags of what it passes */
+static void advance(uint64_t step)
+{
+  advance_timer0(COUNTS_TO_US(Now + step));
+  if (counts_to(OCR2A) <= step)
+  {
+    Flags2 |= 1<<OCF2A;
+  }
+  if (counts_to(OCR2B) <= step)
+  {
+    Flags2 |= 1<<OCF2B;
+  }
+  if (counts_to_overflow() <= step)
+  {
+    Flags2 |= 1<<TOV2;
+  }
+  TCNT2 += step;
+  Now += step;
+
+  while (TxShifting && (TxShiftEnd <= COUNTS_TO_US(Now)))
+  {
+    if (SerialOutput)
+    {
+      SerialOutput(TxShiftByte, TxShiftEnd);
+    }
+    if (TxWaiting)
+    {
+      TxWaiting = 0;
+      start_shifting(TxWaitingByte, TxShiftEnd);
+    }
+    else
+    {
+      TxShifting = 0;
+      TxComplete = 1;
+    }
+  }
+}
+
+/* Counts until at_us has passed, from 1 */
+static uint64_t counts_to_us(uint64_t at_us)
+{
+  uint64_t now_us;
+  now_us = COUNTS_TO_US(Now);
+  return (at_us <= now_us) ? 1 : (at_us - now_us + 1023) / 1024;
+}
+
+void sim_run_until(uint64_t counts)
+{
+  uint64_t step;
+
+  while (Now < counts)
+  {
+    /* Skip to the next compare match or overflow that can wake the firmware */
+    step = counts - Now;
+    if ((TIMSK2 & (1<<OCIE2A)) && (counts_to(OCR2A) < step))
+    {
+      step = counts_to(OCR2A);
+    }
+    if ((TIMSK2 & (1<<OCIE2B)) && (counts_to(OCR2B) < step))
+    {
+      step = counts_to(OCR2B);
+    }
+    if ((TIMSK2 & (1<<TOIE2)) && (counts_to_overflow() < step))
+    {
+      step = counts_to_overflow();
+    }
+    if (TxShifting && (counts_to_us(TxShiftEnd) < step))
+    {
+      step = counts_to_us(TxShiftEnd);
+    }
+    /* A step to each bit of the software transmitter, so that each frame is passed on
+       in the count that it ends */
+    if ((TIMSK0 & (1<<OCIE0B)) && (counts_to_us(Timer0Us + us_to_timer0_match()) < step))
+    {
+      step = counts_to_us(Timer0Us + us_to_timer0_match());
+    }
+    if ((SoftBit != 0) && (counts_to_us(SoftStartUs + SOFT_FRAME_BITS * SOFT_BIT_US) < step))
+    {
+      step = counts_to_us(SoftStartUs + SOFT_FRAME_BITS * SOFT_BIT_US);
+    }
+    if (!Stalled && !Busy && (serial_busy() || eeprom_write_pending()))
+    {
+      IdleCounts += step;
+    }
+    advance(step);
+
+    wake_up();
+    run_main_loop();
+  } /* end while not there yet */
+}
+
+void sim_begin_stall(void)
+{
+  Stalled = 1;
+}
+
+void sim_end_stall(void)
+{
+  Stalled = 0;
+  deliver_interrupts();
+  run_main_loop();
+}
+
+void sim_stall(uint64_t counts)
+{
+  sim_begin_stall();
+  sim_run_until(Now + counts);
+  sim_end_stall();
+}
+
+void sim_begin_busy(void)
+{
+  Busy = 1;
+}
+
+void sim_end_busy(void)
+{
+  Busy = 0;
+  run_main_loop();
+}
+
+void sim_serial_output(void (*output)(uint8_t byte, uint64_t end_us))
+{
+  SerialOutput = output;
+}
+
+uint8_t sim_serial_input(uint16_t frame)
+{
+  if (!receiver_on())
+  {
+    return 0;
+  }
+  if ((UCSR0A & (1<<MPCM0)) && !(frame & 0x100))
+  {
+    return 0;
+  }
+  /* Any byte that has not been read is overwritten, without DOR0 */
+  host_udr0_data = HOST_UDR0_RECEIVED | (frame & 0xFF);
+  UCSR0B = (UCSR0B & ~(1<<RXB80)) | ((frame & 0x100) ? (1<<RXB80) : 0);
+  UCSR0A |= 1<<RXC0;
+  RxComplete = 1;
+  wake_up();
+  run_main_loop();
+  return 1;
+}
+
+uint64_t sim_time(void)
+{
+  return Now;
+}
+
+unsigned long sim_interrupts(void)
+{
+  return Interrupts;
+}
+
+unsigned long sim_wakeups(void)
+{
+  return Wakeups;
+}
+
+unsigned long sim_polls(void)
+{
+  return Polls;
+}
+
+uint64_t sim_idle_us(void)
+{
+  return COUNTS_TO_US(IdleCounts) + (uint64_t)EepromWrites * EEPROM_WRITE_US;
+}
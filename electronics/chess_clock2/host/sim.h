@@ -0,0 +1,60 @@
+/*
+ * host/sim.h - the hardware around the firmware when it is built for the host
+ *
+ * Plays the part of timer 2, compare match B of timer 0, the pin change interrupts, the EEPROM,
+ * the UART and a receiver on PD3, and runs the interrupt handlers and the main loop of main.c
+ * (init_firmware() and poll_firmware()) as the hardware would. Time is counted in
+ * timer 2 counts of 1.024ms, and skips straight to the next thing that can happen while the
+ * firmware is asleep, so hours of play take well under a second.
+ */
+
+#include <stdint.h>
+
+/* Puts the pins at the levels they have when nothing is pressed and the second control is not
+   fitted, then starts the firmware as main() does. host_eeprom[] may be filled first */
+void sim_boot(void);
+
+/* Sets the level of an input pin, port 'B' or 'D' */
+void sim_set_pin(char port, uint8_t bit, uint8_t level);
+
+/* Runs the firmware until the time is counts, in timer counts since sim_boot() */
+void sim_run_until(uint64_t counts);
+
+/* From sim_begin_stall() to sim_end_stall(), no interrupt handler and no main loop pass is run,
+   as if the firmware had interrupts disabled all that time. Pins may change and time may pass
+   meanwhile, and the handlers that are then pending run at sim_end_stall() */
+void sim_begin_stall(void);
+void sim_end_stall(void);
+
+/* A stall of counts timer counts */
+void sim_stall(uint64_t counts);
+
+/* From sim_begin_busy() to sim_end_busy(), the interrupt handlers run but the main loop does
+   not, as if one pass of it took all that time. The pass that is then due runs at
+   sim_end_busy() */
+void sim_begin_busy(void);
+void sim_end_busy(void);
+
+/* Has output called with each byte that the UART or the software transmitter on PD3 sends,
+   as its last stop bit ends, which is
+   end_us microseconds after sim_boot(). The time is between timer counts */
+void sim_serial_output(void (*output)(uint8_t byte, uint64_t end_us));
+
+/* The UART receives a frame whose last stop bit ends now, with the ninth bit in bit 8.
+   Returns 0 if the receiver is off or, in multi-processor mode, the frame is not an
+   address, so that the firmware never sees it */
+uint8_t sim_serial_input(uint16_t frame);
+
+/* Time in timer counts since sim_boot() */
+uint64_t sim_time(void);
+
+/* Interrupt handlers and main loop passes run so far, and the times that the firmware was
+   woken from sleep by a handler. Neither a stall nor a busy main loop sleeps, so their
+   handlers are not a wake-up */
+unsigned long sim_interrupts(void);
+unsigned long sim_wakeups(void);
+unsigned long sim_polls(void);
+
+/* Microseconds since sim_boot() that the firmware has slept in idle mode rather than power
+   save, with each EEPROM write taken as 3.4ms of it */
+uint64_t sim_idle_us(void);
@@ -0,0 +1,255 @@
+/*
+ * host/stages.c - checks that each time control runs as its stages say
+ *
+ * Plays a game of random moves on end-of-turn inputs 1 and 2 under each control, long enough
+ * to reach the second stage of "40/120m SD/30m", and after each move checks the time and the
+ * moves of the player who moved against a model of the control. The model works from the
+ * stages as timecontrol.c kept them before they were compiled into bytecode, as a table of
+ * structs, so that the bytecode and its interpreter must give what the table did. A new
+ * control in timecontrols.txt needs its stages here too.
+ *
+ * The thinking times are spread either side of the 5s bonuses, so that a Bronstein bonus is
+ * sometimes all given back and sometimes only in part, and a US delay is sometimes used up.
+ *
+ * The firmware only charges whole milliseconds, and a turn that a delay or a Bronstein bonus
+ * gives back whole costs it nothing, not even the part of a millisecond it had counted, so it
+ * stays within a millisecond of the exact model for the whole game.
+ *
+ * Usage: stages [seed]
+ * Fails if a remaining time is more than MAX_ERROR_MS out, a move is not counted, or the
+ * controls are not the ones in the table.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sim.h"
+#include "timer.h"
+#include "clock.h"
+#include "settings.h"
+#include "timecontrol.h"
+#include "timecontrols.h"
+
+/* Counts of 1.024ms, as microseconds */
+#define COUNTS_TO_US(counts) ((counts) * 1024)
+#define MS_TO_COUNTS(ms)     (((ms) * 1000) / 1024)
+
+#define MOVES_PER_PLAYER 41
+#define SET_MINUTES      10
+#define MIN_THINK_MS     300
+#define MAX_THINK_MS     9000
+#define HOLD_MS          100   /* how long a key is held down */
+#define MAX_ERROR_MS     1     /* only whole milliseconds are charged */
+
+/* The stages of each control, as they were before the bytecode. A stage lasts for a number
+   of moves, or for the rest of the game if that is 0 */
+typedef struct
+{
+  uint8_t moves;
+  uint16_t seconds;  /* added at the start of the stage. 0 in the first stage means the set time */
+  uint8_t method;    /* BONUS_... */
+  uint8_t bonus;     /* seconds */
+} StageType;
+
+#define MAX_STAGES 2
+
+static const struct
+{
+  char name[17];
+  StageType stages[MAX_STAGES];
+} Controls[] =
+{
+  { "Sudden death    ", { {  0,    0, BONUS_NONE,       0 } } },
+  { "90m +30s        ", { {  0, 5400, BONUS_FISCHER,   30 } } },
+  { "40/120m SD/30m  ", { { 40, 7200, BONUS_NONE,       0 }, { 0, 1800, BONUS_NONE, 0 } } },
+  { "Fischer +5s     ", { {  0,    0, BONUS_FISCHER,    5 } } },
+  { "Bronstein 5s    ", { {  0,    0, BONUS_BRONSTEIN,  5 } } },
+  { "US delay 5s     ", { {  0,    0, BONUS_DELAY,      5 } } },
+};
+
+#define NUM_CONTROLS (sizeof(Controls) / sizeof(Controls[0]))
+
+/* A player of the model */
+typedef struct
+{
+  int64_t remaining_us;
+  uint8_t stage;
+  uint8_t moves_left;
+  uint8_t moves;
+} ModelType;
+
+static const struct
+{
+  char port;
+  uint8_t bit;
+} EotPins[2] = { { 'D', 1 }, { 'D', 2 } };
+
+#define RESTART_PORT 'B'
+#define RESTART_BIT  3   /* active low */
+
+/* Changes the level of an input, with a bounce in each of the next two timer counts */
+static void bounce_pin(char port, uint8_t bit, uint8_t level)
+{
+  sim_set_pin(port, bit, level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, !level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, level);
+}
+
+static void push(char port, uint8_t bit, uint8_t active)
+{
+  bounce_pin(port, bit, active);
+  sim_run_until(sim_time() + MS_TO_COUNTS(HOLD_MS));
+  bounce_pin(port, bit, !active);
+}
+
+/* Presses the end-of-turn input of a player, and returns the time of its first edge */
+static uint64_t press_eot(uint8_t player)
+{
+  uint64_t press;
+  press = sim_time();
+  push(EotPins[player].port, EotPins[player].bit, 1);
+  return press;
+}
+
+static void start_stage(ModelType * model_ptr, uint8_t control, uint8_t stage)
+{
+  const StageType * stage_ptr;
+  stage_ptr = &Controls[control].stages[stage];
+  model_ptr->stage = stage;
+  model_ptr->moves_left = stage_ptr->moves;
+  model_ptr->remaining_us += stage_ptr->seconds * 1000000LL;
+}
+
+/* Charges a move that took used_us to the model, as the control says */
+static void model_move(ModelType * model_ptr, uint8_t control, int64_t used_us)
+{
+  const StageType * stage_ptr;
+  int64_t bonus_us;
+
+  stage_ptr = &Controls[control].stages[model_ptr->stage];
+  bonus_us = stage_ptr->bonus * 1000000LL;
+  switch (stage_ptr->method)
+  {
+  case BONUS_FISCHER:
+    model_ptr->remaining_us += bonus_us - used_us;
+    break;
+  case BONUS_BRONSTEIN:
+    /* Given back up to the bonus, which charges the same as a delay */
+  case BONUS_DELAY:
+    model_ptr->remaining_us -= (used_us > bonus_us) ? used_us - bonus_us : 0;
+    break;
+  default:
+    model_ptr->remaining_us -= used_us;
+    break;
+  }
+  model_ptr->moves++;
+  if ((model_ptr->moves_left != 0) && (--model_ptr->moves_left == 0))
+  {
+    start_stage(model_ptr, control, model_ptr->stage + 1);
+  }
+}
+
+/* Plays a game under the control, and returns the number of moves that went wrong */
+static unsigned long play_control(uint8_t control)
+{
+  ModelType model[2];
+  uint64_t last_press;
+  uint64_t press;
+  unsigned long failures;
+  int64_t error_ms;
+  int64_t max_error_ms;
+  unsigned move;
+  uint8_t player;
+  uint8_t id;
+
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    set_settings_time(id, SET_MINUTES, 0);
+  }
+  set_settings_control(control);
+  save_settings();
+  sim_run_until(sim_time() + MS_TO_COUNTS(1000));
+  push(RESTART_PORT, RESTART_BIT, 0);
+  sim_run_until(sim_time() + MS_TO_COUNTS(1000));
+
+  for (player = 0; player < 2; player++)
+  {
+    memset(&model[player], 0, sizeof(model[player]));
+    start_stage(&model[player], control, 0);
+    if (model[player].remaining_us == 0)
+    {
+      model[player].remaining_us = SET_MINUTES * 60 * 1000000LL;
+    }
+  }
+
+  /* The first press starts the clock, and each one after it is a move */
+  failures = 0;
+  max_error_ms = 0;
+  last_press = press_eot(0);
+  player = 1;
+  for (move = 0; move < 2 * MOVES_PER_PLAYER; move++)
+  {
+    sim_run_until(last_press + MS_TO_COUNTS(MIN_THINK_MS + rand() % (MAX_THINK_MS - MIN_THINK_MS)));
+    press = press_eot(player);
+    model_move(&model[player], control, COUNTS_TO_US(press - last_press));
+    last_press = press;
+
+    error_ms = (int64_t)countdown_remaining(player) - model[player].remaining_us / 1000;
+    if (error_ms < 0)
+    {
+      error_ms = -error_ms;
+    }
+    if (error_ms > max_error_ms)
+    {
+      max_error_ms = error_ms;
+    }
+    if ((error_ms > MAX_ERROR_MS) || (time_control_moves(player) != model[player].moves))
+    {
+      if (failures == 0)
+      {
+        fprintf(stderr, "stages: \"%.16s\", move %u of player %u: %lums left after %u moves, against %lums after %u\n",
+                Controls[control].name, model[player].moves, player + 1, (unsigned long)countdown_remaining(player),
+                time_control_moves(player), (unsigned long)(model[player].remaining_us / 1000), model[player].moves);
+      }
+      failures++;
+    }
+    player = !player;
+  } /* end for all moves */
+
+  printf("%.16s %u moves, %lu wrong, max error %lums\n", Controls[control].name, 2 * MOVES_PER_PLAYER,
+         failures, (unsigned long)max_error_ms);
+  return failures;
+}
+
+int main(int argc, char ** argv)
+{
+  unsigned long failures;
+  uint8_t control;
+
+  srand((argc >= 2) ? atoi(argv[1]) : 1);
+
+  failures = 0;
+  if (NUM_CONTROLS != NUM_TIME_CONTROLS)
+  {
+    fprintf(stderr, "stages: %u controls in timecontrols.h, against %u here\n", NUM_TIME_CONTROLS,
+            (unsigned)NUM_CONTROLS);
+    failures++;
+  }
+  sim_boot();
+  for (control = 0; (control < NUM_CONTROLS) && (control < NUM_TIME_CONTROLS); control++)
+  {
+    if (strncmp(time_control_name(control), Controls[control].name, 16) != 0)
+    {
+      fprintf(stderr, "stages: control %u is \"%.16s\", against \"%.16s\" here\n", control,
+              time_control_name(control), Controls[control].name);
+      failures++;
+      continue;
+    }
+    failures += play_control(control);
+  }
+  return failures ? 1 : 0;
+}
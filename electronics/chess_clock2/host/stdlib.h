@@ -0,0 +1,14 @@
+/*
+ * host/stdlib.h - adds the avr-libc extensions to the host's <stdlib.h>
+ */
+
+#ifndef HOST_STDLIB_H
+#define HOST_STDLIB_H
+
+#include_next <stdlib.h>
+
+char * itoa(int value, char * buffer, int radix);
+char * utoa(unsigned int value, char * buffer, int radix);
+char * ultoa(unsigned long value, char * buffer, int radix);
+
+#endif
@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+#
+# host/timecontrol.py - compiles time controls into the bytecode that timecontrol.c runs
+#
+# Usage: timecontrol.py "40/7200+30, SD/1800+30"   prints the bytes of one control
+#        timecontrol.py --header timecontrols.txt  prints timecontrols.h
+#
+# See timecontrols.txt for the form of a control, and timecontrol.c for the bytecode.
+
+import re
+import sys
+
+# As in timecontrol.h and timecontrol.c
+METHODS = {"": "BONUS_NONE", "+": "BONUS_FISCHER", "b": "BONUS_BRONSTEIN", "d": "BONUS_DELAY"}
+METHOD_VALUES = {"BONUS_NONE": 0, "BONUS_FISCHER": 1, "BONUS_BRONSTEIN": 2, "BONUS_DELAY": 3}
+TC_MOVES = 0x04
+TC_TIME = 0x08
+
+NAME_WIDTH = 16
+
+STAGE = re.compile(r"^(?:(SD|\d+)/)?(T|\d+)(?:([+bd])(\d+))?$")
+
+
+class SpecError(Exception):
+    pass
+
+
+def compile_control(spec):
+    """Returns the stages of a control as (symbolic op, [operand bytes], [operands in C], stage) tuples"""
+    stages = [stage.strip() for stage in spec.split(",")]
+    code = []
+    for index, stage in enumerate(stages):
+        match = STAGE.match(stage.replace(" ", ""))
+        if not match:
+            raise SpecError("cannot read stage '%s'" % stage)
+        moves, time, method, bonus = match.groups()
+        last = index == len(stages) - 1
+
+        ops = []
+        operands = []
+        source = []
+        if moves not in (None, "SD"):
+            moves = int(moves)
+            if not 1 <= moves <= 255:
+                raise SpecError("stage '%s' must have 1 to 255 moves" % stage)
+            ops.append("TC_MOVES")
+            operands.append(moves)
+            source.append("%d" % moves)
+        elif not last:
+            raise SpecError("stage '%s' lasts for the rest of the game, so must be the last" % stage)
+        if last and ops:
+            raise SpecError("the last stage '%s' must last for the rest of the game" % stage)
+
+        if time == "T":
+            if index != 0:
+                raise SpecError("only the first stage can take the set time")
+        else:
+            time = int(time)
+            if not 0 < time <= 65535:
+                raise SpecError("stage '%s' must add 1 to 65535 seconds" % stage)
+            ops.append("TC_TIME")
+            operands += [time & 0xFF, time >> 8]
+            source.append("TC_SECONDS(%d)" % time)
+
+        ops.append(METHODS[method or ""])
+        if method:
+            bonus = int(bonus)
+            if not 1 <= bonus <= 255:
+                raise SpecError("stage '%s' must have a bonus of 1 to 255 seconds" % stage)
+            operands.append(bonus)
+            source.append("%d" % bonus)
+        code.append(("|".join(ops), operands, source, stage))
+    return code
+
+
+def op_value(op):
+    value = 0
+    for name in op.split("|"):
+        value |= {"TC_MOVES": TC_MOVES, "TC_TIME": TC_TIME}.get(name, METHOD_VALUES.get(name, 0))
+    return value
+
+
+def read_controls(path):
+    controls = []
+    with open(path) as f:
+        for number, line in enumerate(f, 1):
+            line = line.strip()
+            if not line or line.startswith("#"):
+                continue
+            match = re.match(r'^"([^"]*)"\s+(.+)$', line)
+            if not match:
+                sys.exit('%s:%d: expected "name" stages' % (path, number))
+            name, spec = match.groups()
+            if len(name) > NAME_WIDTH:
+                sys.exit("%s:%d: the name is longer than %d characters" % (path, number, NAME_WIDTH))
+            try:
+                controls.append((name, spec.strip(), compile_control(spec)))
+            except SpecError as error:
+                sys.exit("%s:%d: %s" % (path, number, error))
+    if not 0 < len(controls) <= 255:
+        sys.exit("%s: there must be 1 to 255 time controls" % path)
+    return controls
+
+
+def print_header(path):
+    controls = read_controls(path)
+    out = []
+    out.append("/*")
+    out.append(" * timecontrols.h")
+    out.append(" *")
+    out.append(" * Made from %s by host/timecontrol.py ('make timecontrols'). Do not edit" % path)
+    out.append(" */")
+    out.append("")
+    out.append("#define NUM_TIME_CONTROLS %d" % len(controls))
+    out.append("")
+    out.append("#ifdef TIME_CONTROL_TABLES")
+    out.append("")
+    out.append("static const PROGMEM char TimeControlNames[NUM_TIME_CONTROLS][%d] =" % (NAME_WIDTH + 1))
+    out.append("{")
+    for name, spec, code in controls:
+        out.append('  "%s",' % name.ljust(NAME_WIDTH))
+    out.append("};")
+    out.append("")
+    out.append("static const prog_uint8_t TimeControlCode[] =")
+    out.append("{")
+    starts = []
+    offset = 0
+    for name, spec, code in controls:
+        starts.append(offset)
+        out.append("  /* %d: %s */" % (len(starts) - 1, spec))
+        for op, operands, source, stage in code:
+            out.append("  " + ", ".join([op] + source) + ",")
+            offset += 1 + len(operands)
+    out.append("};")
+    if offset > 256:
+        sys.exit("%s: the controls take %d bytes, and can take no more than 256" % (path, offset))
+    out.append("")
+    out.append("/* Where each control starts in TimeControlCode */")
+    out.append("static const prog_uint8_t TimeControlStart[NUM_TIME_CONTROLS] =")
+    out.append("{")
+    out.append("  " + ", ".join("%d" % start for start in starts))
+    out.append("};")
+    out.append("")
+    out.append("#endif /* TIME_CONTROL_TABLES */")
+    print("\n".join(out))
+
+
+def main():
+    if len(sys.argv) == 3 and sys.argv[1] == "--header":
+        print_header(sys.argv[2])
+    elif len(sys.argv) == 2:
+        try:
+            code = compile_control(sys.argv[1])
+        except SpecError as error:
+            sys.exit("timecontrol.py: %s" % error)
+        total = 0
+        for op, operands, source, stage in code:
+            values = [op_value(op)] + operands
+            total += len(values)
+            print("%-20s %-28s %s" % (stage, op, " ".join("%02x" % value for value in values)))
+        print("%d bytes" % total)
+    else:
+        sys.exit('usage: timecontrol.py "stages" | timecontrol.py --header timecontrols.txt')
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,307 @@
+/*
+ * host/timing.c - checks that the countdowns keep exact time over a long session
+ *
+ * Plays a game of random moves on end-of-turn inputs 1 and 2, with contact bounce and
+ * the occasional pause, for the given number of hours of virtual time. An ideal clock
+ * charges each player from the first edge of the press that started their turn to the
+ * first edge of the press that ended it, or to the moment that a pause stopped them.
+ * After each move the countdown of the player who moved is compared with it, and at the
+ * end both countdowns are. Only whole milliseconds are taken off a countdown, so it may
+ * be behind the ideal clock by up to a millisecond, but no more however long it runs.
+ *
+ * Every few moves, while a player thinks, interrupts are held off for more than a tick and
+ * up to more than two turns of the timer, as slow code with interrupts disabled would do.
+ * The timer must catch up on the ticks that it lost, and count them. Some stalls of a turn
+ * (262.144ms) or more cannot be told apart from shorter ones, and leave the ticks whole
+ * turns short (see TIMER2_COMPA_vect). Those turns are found by comparing timer_ticks()
+ * with the time that passed, taken off the ideal clock of the player who was thinking, and
+ * counted as missed. Every few moves as well, a press (with its bounce) is made while
+ * interrupts are held off for up to most of a turn, often past the compare match of the
+ * tick, and only handled when the stall ends, which is when the ideal clock takes it to
+ * have happened. Half of those stalls end with the first edge of the press, so that it is
+ * handled straight after the stall, before the ticks have caught up.
+ *
+ * The wake-ups from sleep are counted too. While a countdown runs, the timer can only be set
+ * two ticks (256ms) ahead, so that is about 14000 an hour, with the debouncing of each press
+ * and the second changes that fall between them on top.
+ *
+ * The share of the time that the firmware is awake is reported as far as the host can tell
+ * it: the cycles spent in the delays of the code, which are nearly all in lcd.c, and the time
+ * that it sleeps in idle mode, which draws a good deal more than power save, while it sends
+ * or writes the EEPROM. The rest of the code is not timed here, as it runs in no time on
+ * the host. The bytes written to the LCD are counted as well, as only the cells that change
+ * should be sent.
+ *
+ * Usage: timing [hours [seed]]
+ * Fails if either countdown is ever out by a millisecond or more, but for whole turns missed
+ * in a stall of a turn or more, if the firmware wakes up more than MAX_WAKEUPS_PER_HOUR or if it
+ * writes more than MAX_LCD_BYTES_PER_SECOND to the LCD.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "host.h"
+#include "sim.h"
+#include "timer.h"
+#include "diagnostics.h"
+#include "lcd.h"
+
+/* Counts of 1.024ms, as microseconds */
+#define COUNTS_TO_US(counts) ((counts) * 1024)
+#define COUNTS_PER_TICK      125
+#define COUNTS_PER_TURN      256
+#define MS_TO_COUNTS(ms)     (((ms) * 1000) / 1024)
+
+/* Each player has the whole session and an hour more, so no flag falls */
+#define START_REMAINING(hours) ((uint32_t)(((hours) + 1) * 3600 * 1000))
+
+#define MOVES_PER_PAUSE       40
+#define MOVES_PER_STALL       7
+#define MOVES_PER_PRESS_STALL 5
+
+/* From a little over one tick to well over two turns of the timer, in timer counts */
+#define MIN_STALL 130
+#define MAX_STALL 700
+
+/* Counts that interrupts are held off before and after the first edge of a press in a
+   stall, which together stay under a turn */
+#define MAX_PRESS_STALL 125
+
+#define MAX_ERROR_MS    1.0
+
+/* Waking every tick of 128ms, as the firmware once did, is 28125 an hour */
+#define MAX_WAKEUPS_PER_HOUR 20000
+
+/* Rewriting the eight cells of the running countdown each second, with the address set, would
+   be 9 a second */
+#define MAX_LCD_BYTES_PER_SECOND 4
+
+static const struct
+{
+  char port;
+  uint8_t bit;
+} EotPins[2] = { { 'D', 1 }, { 'D', 2 } };
+
+#define PAUSE_PORT 'B'
+#define PAUSE_BIT  4
+
+/* Changes the level of an input, with a bounce in each of the next two timer counts */
+static void bounce_pin(char port, uint8_t bit, uint8_t level)
+{
+  sim_set_pin(port, bit, level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, !level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, level);
+}
+
+/* Turns of the timer that the ticks fell behind the time between from and now, given the
+   ticks at from. Out of a turn, the ticks are never more than one short or over */
+static unsigned turns_missed(uint64_t from, uint16_t from_ticks)
+{
+  int64_t behind;
+  behind = (int64_t)(sim_time() - from) - (int64_t)(uint16_t)(timer_ticks() - from_ticks) * COUNTS_PER_TICK;
+  return (behind + COUNTS_PER_TURN / 2) / COUNTS_PER_TURN;
+}
+
+/* Runs until the countdown starts or stops, and returns when that happened */
+static uint64_t wait_for_running(uint8_t id, uint8_t running)
+{
+  while (countdown_is_running(id) != running)
+  {
+    if (countdown_has_expired(id))
+    {
+      fprintf(stderr, "timing: countdown %d has expired\n", id + 1);
+      exit(2);
+    }
+    sim_run_until(sim_time() + 1);
+  }
+  return sim_time();
+}
+
+int main(int argc, char ** argv)
+{
+  double hours;
+  uint64_t end;
+  uint64_t turn_start;
+  uint64_t press;
+  uint64_t used[2];
+  uint64_t stall_start;
+  uint16_t stall_ticks;
+  unsigned long moves;
+  unsigned long pauses;
+  unsigned long stalls;
+  unsigned long press_stalls;
+  unsigned long missed;
+  unsigned turns;
+  uint32_t start_remaining;
+  double error;
+  double max_error;
+  double total_error;
+  double final_error[2];
+  double wakeups_per_hour;
+  double seconds;
+  uint64_t lcd_transfers;
+  uint16_t lcd_count;
+  clock_t started;
+  uint8_t player;
+
+  hours = (argc >= 2) ? atof(argv[1]) : 24;
+  srand((argc >= 3) ? atoi(argv[2]) : 1);
+  started = clock();
+
+  sim_boot();
+  start_remaining = START_REMAINING(hours);
+  set_countdown_remaining(COUNTDOWN_1, start_remaining);
+  set_countdown_remaining(COUNTDOWN_2, start_remaining);
+  end = MS_TO_COUNTS((uint64_t)(hours * 3600 * 1000));
+
+  used[0] = used[1] = 0;
+  moves = pauses = stalls = press_stalls = missed = 0;
+  max_error = total_error = 0;
+  player = 0;
+  turn_start = 0;
+  sim_run_until(MS_TO_COUNTS(2000));
+  lcd_transfers = lcd_transfer_count();
+  lcd_count = lcd_transfer_count();
+  while (sim_time() < end)
+  {
+    /* The player to move ends their turn. Nobody is charged for the first press */
+    if ((moves % MOVES_PER_PRESS_STALL) == MOVES_PER_PRESS_STALL - 1)
+    {
+      /* The first edge is seen when interrupts are enabled again */
+      stall_start = sim_time();
+      stall_ticks = timer_ticks();
+      sim_begin_stall();
+      sim_run_until(sim_time() + rand() % MAX_PRESS_STALL);
+      if (rand() % 2)
+      {
+        bounce_pin(EotPins[player].port, EotPins[player].bit, 1);
+        sim_run_until(sim_time() + rand() % (MAX_PRESS_STALL - 2));
+        press = sim_time();
+        sim_end_stall();
+      }
+      else
+      {
+        /* Interrupts are enabled as the first edge comes, and the bounce follows */
+        sim_set_pin(EotPins[player].port, EotPins[player].bit, 1);
+        press = sim_time();
+        sim_end_stall();
+        sim_run_until(sim_time() + 1);
+        sim_set_pin(EotPins[player].port, EotPins[player].bit, 0);
+        sim_run_until(sim_time() + 1);
+        sim_set_pin(EotPins[player].port, EotPins[player].bit, 1);
+      }
+      if (turns_missed(stall_start, stall_ticks) != 0)
+      {
+        fprintf(stderr, "timing: the ticks missed a turn in a stall of under a turn\n");
+        return 1;
+      }
+      press_stalls++;
+    }
+    else
+    {
+      press = sim_time();
+      bounce_pin(EotPins[player].port, EotPins[player].bit, 1);
+    }
+    if (moves > 0)
+    {
+      used[player] += press - turn_start;
+    }
+    turn_start = press;
+    wait_for_running(!player, 1);
+    sim_run_until(press + MS_TO_COUNTS(60 + rand() % 190));
+    bounce_pin(EotPins[player].port, EotPins[player].bit, 0);
+    moves++;
+
+    if (moves > 1)
+    {
+      error = (double)(start_remaining - countdown_remaining(player)) - COUNTS_TO_US(used[player]) / 1000.0;
+      if (fabs(error) > max_error)
+      {
+        max_error = fabs(error);
+      }
+      total_error += fabs(error);
+    }
+    player = !player;
+
+    /* Think, and now and then pause for a while */
+    sim_run_until(sim_time() + MS_TO_COUNTS(500 + rand() % 60000));
+    if ((moves % MOVES_PER_STALL) == 0)
+    {
+      stall_start = sim_time();
+      stall_ticks = timer_ticks();
+      sim_stall(MIN_STALL + rand() % (MAX_STALL - MIN_STALL + 1));
+      sim_run_until(sim_time() + MS_TO_COUNTS(500));
+      turns = turns_missed(stall_start, stall_ticks);
+      used[player] -= turns * COUNTS_PER_TURN;
+      missed += turns;
+      stalls++;
+    }
+    if ((moves % MOVES_PER_PAUSE) == 0)
+    {
+      sim_set_pin(PAUSE_PORT, PAUSE_BIT, 0);
+      used[player] += wait_for_running(player, 0) - turn_start;
+      sim_run_until(sim_time() + MS_TO_COUNTS(200));
+      sim_set_pin(PAUSE_PORT, PAUSE_BIT, 1);
+      sim_run_until(sim_time() + MS_TO_COUNTS(rand() % 300000));
+
+      sim_set_pin(PAUSE_PORT, PAUSE_BIT, 0);
+      turn_start = wait_for_running(player, 1);
+      sim_run_until(sim_time() + MS_TO_COUNTS(200));
+      sim_set_pin(PAUSE_PORT, PAUSE_BIT, 1);
+      sim_run_until(sim_time() + MS_TO_COUNTS(500 + rand() % 60000));
+      pauses++;
+    }
+    lcd_transfers += (uint16_t)(lcd_transfer_count() - lcd_count);
+    lcd_count = lcd_transfer_count();
+  } /* end while playing */
+
+  /* Stop the clock to see where both players stand */
+  sim_set_pin(PAUSE_PORT, PAUSE_BIT, 0);
+  used[player] += wait_for_running(player, 0) - turn_start;
+  for (player = 0; player < 2; player++)
+  {
+    final_error[player] = (double)(start_remaining - countdown_remaining(player)) - COUNTS_TO_US(used[player]) / 1000.0;
+    if (fabs(final_error[player]) > max_error)
+    {
+      max_error = fabs(final_error[player]);
+    }
+  }
+
+  printf("%.1f hours: %lu moves, %lu pauses, %lu interrupts, %lu main loop passes\n",
+         sim_time() * 1.024 / 3600000, moves, pauses, sim_interrupts(), sim_polls());
+  printf("%lu stalls, %lu of them over a press, %u ticks lost and caught up, %lu whole turns missed\n",
+         stalls + press_stalls, press_stalls, lost_tick_count(), missed);
+  printf("error per move: max %.3fms, mean %.3fms\n", max_error, total_error / (moves - 1));
+  printf("at the end: player 1 %.3fms, player 2 %.3fms, drift %.4fms per hour\n", final_error[0], final_error[1],
+         (final_error[0] + final_error[1]) / (sim_time() * 1.024 / 3600000));
+  wakeups_per_hour = sim_wakeups() / (sim_time() * 1.024 / 3600000);
+  printf("%.0f wake-ups an hour, against at most %d\n", wakeups_per_hour, MAX_WAKEUPS_PER_HOUR);
+  seconds = sim_time() * 1.024 / 1000;
+  printf("awake %.4f%% of the time in delays (%.0fs), asleep in idle %.4f%% (%.0fs), the rest not timed\n",
+         100.0 * host_delay_cycles / F_CPU / seconds, (double)host_delay_cycles / F_CPU,
+         100.0 * sim_idle_us() / 1000000 / seconds, sim_idle_us() / 1000000.0);
+  printf("%.2f bytes a second to the LCD, against at most %d\n", lcd_transfers / seconds, MAX_LCD_BYTES_PER_SECOND);
+  printf("took %.2fs\n", (double)(clock() - started) / CLOCKS_PER_SEC);
+  if ((stalls > 0) && (lost_tick_count() == 0))
+  {
+    fprintf(stderr, "timing: no lost ticks were counted\n");
+    return 1;
+  }
+  if (wakeups_per_hour > MAX_WAKEUPS_PER_HOUR)
+  {
+    fprintf(stderr, "timing: the firmware woke up too often\n");
+    return 1;
+  }
+  if (lcd_transfers / seconds > MAX_LCD_BYTES_PER_SECOND)
+  {
+    fprintf(stderr, "timing: too much was written to the LCD\n");
+    return 1;
+  }
+  return (max_error >= MAX_ERROR_MS);
+}
@@ -0,0 +1,128 @@
+#!/usr/bin/env python3
+#
+# host/trace.py - turns a dump from the event trace (trace.c) into a Chrome trace
+#
+# Usage: trace.py dump.txt > trace.json
+#
+# The dump is the text that a TRACE build sends out of PD3 at 1200 baud, captured with any
+# terminal program, or the output of host/tracegame. Open the JSON in chrome://tracing or
+# https://ui.perfetto.dev. Interrupt handlers and what they run are shown on one track,
+# and the main loop on another.
+#
+# The timestamps only have 16 bits of timer counts, so a gap of more than 67 seconds
+# between two records shows up 67 seconds short. Each record also has the count of timer 0,
+# which wraps every 256 counts but is finer. Of the times that it allows, only one is within
+# a count of timer 2 of the coarse time, and that one is taken. Timer 0 stops while the CPU
+# sleeps in power save mode, so across a sleep the time is only as good as the coarse one.
+
+import json
+import sys
+
+# The events of trace.h, in order, and whether they happen in an interrupt handler
+EVENTS = [
+    ("tick", True),
+    ("task", True),
+    ("sample inputs", True),
+    ("pin change", True),
+    ("EEPROM ready", True),
+    ("input_asserted", False),
+    ("play", False),
+    ("lcd_flush", False),
+    ("write_eeprom", False),
+]
+TASKS = ["audio", "turnled", "backlight", "countdown", "inputs", "telemetry"]
+INPUTS = ["EOT1", "EOT2", "EOT3", "EOT4", "UP", "DOWN", "COPY", "PAUSE", "RESTART"]
+
+TRACE_END = 0x40
+TRACE_MARK = 0x80
+TRACE_EVENT_MASK = 0x3F
+
+TIMESTAMP_BITS = 16
+FINE_WRAP = 256
+
+INTERRUPTS_TID = 1
+MAIN_TID = 2
+
+
+def event_name(event, arg):
+    name = EVENTS[event][0] if event < len(EVENTS) else "event %d" % event
+    if name == "task":
+        return TASKS[arg] if arg < len(TASKS) else "task %d" % arg
+    if name == "pin change":
+        return "pin change %s" % ("B" if arg == 0 else "D")
+    if name == "input_asserted" and arg < len(INPUTS):
+        return "input_asserted %s" % INPUTS[arg]
+    return name
+
+
+def read_dump(path):
+    us_per_count = None
+    us_per_fine = None
+    records = []
+    with open(path, errors="replace") as f:
+        for line in f:
+            fields = line.split()
+            if len(fields) == 3 and fields[0] == "TRACE":
+                us_per_count = int(fields[1])
+                us_per_fine = int(fields[2])
+                records = []
+            elif fields == ["END"]:
+                break
+            elif us_per_count is not None and len(fields) == 4:
+                records.append(tuple(int(field, 16 if n == 0 else 10) for n, field in enumerate(fields)))
+    if us_per_count is None:
+        sys.exit("trace.py: no TRACE line in " + path)
+    return us_per_count, us_per_fine, records
+
+
+def elapsed_us(counts, fines, us_per_count, us_per_fine):
+    """The time between two records, from the counts of timer 2 and of timer 0 between them"""
+    wrap_us = FINE_WRAP * us_per_fine
+    fine_us = fines * us_per_fine
+    latest_us = (counts + 1) * us_per_count
+    if latest_us < fine_us:
+        return fine_us
+    return (latest_us - fine_us) // wrap_us * wrap_us + fine_us
+
+
+def main():
+    if len(sys.argv) != 2:
+        sys.exit("usage: trace.py dump.txt > trace.json")
+    us_per_count, us_per_fine, records = read_dump(sys.argv[1])
+
+    events = [
+        {"ph": "M", "name": "thread_name", "pid": 1, "tid": INTERRUPTS_TID, "args": {"name": "interrupts"}},
+        {"ph": "M", "name": "thread_name", "pid": 1, "tid": MAIN_TID, "args": {"name": "main loop"}},
+    ]
+    time = 0
+    last = None
+    open_events = {INTERRUPTS_TID: 0, MAIN_TID: 0}
+    for kind_event, arg, stamp, fine in records:
+        # Unwrap the timestamps, which only go forwards
+        if last is not None:
+            time += elapsed_us((stamp - last[0]) % (1 << TIMESTAMP_BITS), (fine - last[1]) % FINE_WRAP,
+                               us_per_count, us_per_fine)
+        last = (stamp, fine)
+
+        event = kind_event & TRACE_EVENT_MASK
+        tid = INTERRUPTS_TID if event >= len(EVENTS) or EVENTS[event][1] else MAIN_TID
+        record = {"name": event_name(event, arg), "pid": 1, "tid": tid, "ts": time}
+        if kind_event & TRACE_MARK:
+            record.update(ph="i", s="t")
+        elif kind_event & TRACE_END:
+            # The start of the oldest events may have gone from the ring
+            if open_events[tid] == 0:
+                continue
+            open_events[tid] -= 1
+            record["ph"] = "E"
+        else:
+            open_events[tid] += 1
+            record["ph"] = "B"
+        events.append(record)
+
+    json.dump({"traceEvents": events, "displayTimeUnit": "ms"}, sys.stdout, indent=1)
+    print()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,81 @@
+/*
+ * host/tracegame.c - plays a few moves with the trace built in, and prints the trace
+ *
+ * The output is in the format that a TRACE build sends out of PD3, for host/trace.py.
+ * Each move is a bounced press and release of the end-of-turn input of the player to
+ * move, after a random time to think. The trace is printed soon after the last move,
+ * so that the ring still holds it.
+ *
+ * Usage: tracegame [moves [seed]]
+ */
+
+#ifndef TRACE
+#error "tracegame needs the firmware built with TRACE (make trace)"
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sim.h"
+#include "timer.h"
+#include "trace.h"
+
+#define MS_TO_COUNTS(ms) (((ms) * 1000) / 1024)
+
+/* Five minutes each */
+#define START_REMAINING ((uint32_t)5 * 60 * 1000)
+
+static const struct
+{
+  char port;
+  uint8_t bit;
+} EotPins[2] = { { 'D', 1 }, { 'D', 2 } };
+
+/* Changes the level of an input, with a bounce in each of the next two timer counts */
+static void bounce_pin(char port, uint8_t bit, uint8_t level)
+{
+  sim_set_pin(port, bit, level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, !level);
+  sim_run_until(sim_time() + 1);
+  sim_set_pin(port, bit, level);
+}
+
+int main(int argc, char ** argv)
+{
+  TraceRecordType record;
+  unsigned long moves;
+  unsigned long move;
+  uint8_t player;
+  uint8_t n;
+
+  moves = (argc >= 2) ? strtoul(argv[1], NULL, 10) : 2;
+  srand((argc >= 3) ? atoi(argv[2]) : 1);
+
+  sim_boot();
+  set_countdown_remaining(COUNTDOWN_1, START_REMAINING);
+  set_countdown_remaining(COUNTDOWN_2, START_REMAINING);
+  sim_run_until(MS_TO_COUNTS(2000));
+  player = 0;
+  for (move = 0; move < moves; move++)
+  {
+    bounce_pin(EotPins[player].port, EotPins[player].bit, 1);
+    sim_run_until(sim_time() + MS_TO_COUNTS(60 + rand() % 190));
+    bounce_pin(EotPins[player].port, EotPins[player].bit, 0);
+    if (move + 1 < moves)
+    {
+      sim_run_until(sim_time() + MS_TO_COUNTS(500 + rand() % 3000));
+    }
+    player = !player;
+  }
+  sim_run_until(sim_time() + MS_TO_COUNTS(300));
+
+  printf("TRACE 1024 8\n");
+  for (n = 0; read_trace(n, &record); n++)
+  {
+    printf("%x %u %u %u\n", record.event, record.arg, (record.overflows << 8) | record.count, record.fine);
+  }
+  printf("END\n");
+  return 0;
+}
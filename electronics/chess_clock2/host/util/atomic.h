@@ -0,0 +1,28 @@
+/*
+ * host/util/atomic.h - stands in for <util/atomic.h> when building for the host
+ */
+
+#ifndef HOST_UTIL_ATOMIC_H
+#define HOST_UTIL_ATOMIC_H
+
+#include <avr/interrupt.h>
+
+static inline uint8_t __host_cli(void)
+{
+  cli();
+  return 1;
+}
+
+static inline void __host_restore(const uint8_t * sreg_ptr)
+{
+  SREG = *sreg_ptr;
+  if (host_interrupts_enabled)
+  {
+    host_interrupts_enabled();
+  }
+}
+
+#define ATOMIC_RESTORESTATE uint8_t __sreg_save __attribute__((__cleanup__(__host_restore))) = SREG
+#define ATOMIC_BLOCK(type) for (type, __todo = __host_cli(); __todo; __todo = 0)
+
+#endif
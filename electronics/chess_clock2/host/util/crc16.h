@@ -0,0 +1,36 @@
+/*
+ * host/util/crc16.h - stands in for <util/crc16.h> when building for the host,
+ * with the C equivalents given in the avr-libc documentation
+ */
+
+#ifndef HOST_UTIL_CRC16_H
+#define HOST_UTIL_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+  data ^= crc & 0xFF;
+  data ^= data << 4;
+  return ((((uint16_t)data << 8) | (crc >> 8)) ^ (uint8_t)(data >> 4) ^ ((uint16_t)data << 3));
+}
+
+static inline uint8_t _crc_ibutton_update(uint8_t crc, uint8_t data)
+{
+  uint8_t i;
+  crc = crc ^ data;
+  for (i = 0; i < 8; i++)
+  {
+    if (crc & 0x01)
+    {
+      crc = (crc >> 1) ^ 0x8C;
+    }
+    else
+    {
+      crc >>= 1;
+    }
+  }
+  return crc;
+}
+
+#endif
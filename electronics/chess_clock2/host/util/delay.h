@@ -0,0 +1,12 @@
+/*
+ * host/util/delay.h - stands in for <util/delay.h> when building for the host,
+ * where the delays take no time
+ */
+
+#ifndef HOST_UTIL_DELAY_H
+#define HOST_UTIL_DELAY_H
+
+void _delay_ms(double ms);
+void _delay_us(double us);
+
+#endif
@@ -0,0 +1,14 @@
+/*
+ * host/util/delay_basic.h - stands in for <util/delay_basic.h> when building for the host,
+ * where the delays take no time
+ */
+
+#ifndef HOST_UTIL_DELAY_BASIC_H
+#define HOST_UTIL_DELAY_BASIC_H
+
+#include <stdint.h>
+
+void _delay_loop_1(uint8_t count);
+void _delay_loop_2(uint16_t count);
+
+#endif
@@ -5,11 +5,14 @@
 #include <stdint.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
-#include <util/delay.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "timer.h"
 #include "input.h"
+#include "trace.h"
 
 /* Inputs table:
-   EOT1     PD1  PCINT17
+   EOT1     PD1  PCINT17  (PD3 PCINT19 on a bus board, serial.h)
    EOT2     PD2  PCINT18
    UP       PD4  PCINT20
    EOT3     PD7  PCINT23
@@ -20,7 +23,14 @@
    COPY     PB5  PCINT5
 */
 
+#ifdef BUS_BOARD
+/* PD0 and PD1 are RXD and TXD of the bus */
+#define D_MASK_EOT1    (1<<PD3)
+#define PCINT_EOT1     PCINT19
+#else
 #define D_MASK_EOT1    (1<<PD1)
+#define PCINT_EOT1     PCINT17
+#endif
 #define D_MASK_EOT2    (1<<PD2)
 #define D_MASK_UP      (1<<PD4)
 #define D_MASK_EOT3    (1<<PD7)
@@ -39,9 +49,63 @@
 
 #define SECOND_CONTROL_TIMEOUT_CYCLES 80
 
+/* Debounced state of the inputs */
 static uint8_t LastB = B_MASK_EOT4;
 static uint8_t LastD = D_MASK_EOT3;
 
+/* The inputs are sampled on timer2 compare match B every DEBOUNCE_SAMPLE_COUNTS
+   timer counts (5.12ms), but only while some input differs from its debounced state.
+   An input changes state after 4 samples in a row disagree with it. */
+#define DEBOUNCE_SAMPLE_COUNTS 5
+
+/* Two-bit vertical counters, one bit of each per input pin */
+static uint8_t CountB0 = 0xFF;
+static uint8_t CountB1 = 0xFF;
+static uint8_t CountD0 = 0xFF;
+static uint8_t CountD1 = 0xFF;
+
+/* Pin masks of the inputs, in the order of their ids */
+static const PROGMEM uint8_t InputMasks[NUM_INPUTS] =
+{
+  D_MASK_EOT1,
+  D_MASK_EOT2,
+  D_MASK_EOT3,
+  B_MASK_EOT4,
+  D_MASK_UP,
+  B_MASK_DOWN,
+  B_MASK_COPY,
+  B_MASK_PAUSE,
+  B_MASK_RESTART
+};
+#define INPUT_ON_PORT_B(id) (((id) == INPUT_EOT4) || ((id) >= INPUT_DOWN))
+
+/* Time of the first edge of the last press of each end-of-turn input,
+   and the inputs whose edge has been seen but which have not yet changed state */
+#define B_MASK_EOT (B_MASK_EOT4)
+#define D_MASK_EOT (D_MASK_EOT1 | D_MASK_EOT2 | D_MASK_EOT3)
+static TickTimeType EotTime[INPUT_EOT4 + 1];
+static uint8_t EdgeB;
+static uint8_t EdgeD;
+
+/* End-of-turn inputs, bit id for input id, whose first edge has been seen
+   and whose press has not yet been passed to input_asserted() */
+static volatile uint8_t EotPending;
+
+/* Queue of input events from the interrupt handlers to poll_inputs(),
+   so that the application is only ever called from the main loop.
+   Only interrupt handlers add to the queue and they cannot interrupt each other,
+   so there is one producer and one consumer and the queue needs no locking */
+#define EVENT_ID_MASK   0x3F
+#define EVENT_KIND_MASK 0xC0
+#define EVENT_PRESSED   0x00
+#define EVENT_RELEASED  0x80
+#define EVENT_LONG_PUSH 0x40
+#define EVENT_REPEAT    0xC0
+#define EVENT_QUEUE_SIZE 8
+static volatile uint8_t EventQueue[EVENT_QUEUE_SIZE];
+static volatile uint8_t EventIn;
+static volatile uint8_t EventOut;
+
 #define LONG_PUSH_CYCLES       10
 #define REPEAT_HOLDOFF_CYCLES  6
 #define REPEAT_INTERVAL_CYCLES 3
@@ -53,6 +117,17 @@ static uint8_t PauseCounter;
 
 static uint8_t SecondControlNotFittedCount = SECOND_CONTROL_TIMEOUT_CYCLES;
 
+/* Starts sampling the inputs, unless already sampling. Must be called with interrupts disabled */
+static void start_sampling(void)
+{
+  if ((TIMSK2 & (1<<OCIE2B)) == 0)
+  {
+    OCR2B = TCNT2 + DEBOUNCE_SAMPLE_COUNTS;
+    TIFR2 = 1<<OCF2B;
+    TIMSK2 |= 1<<OCIE2B;
+  }
+}
+
 void init_inputs(void)
 {
   /* Enable pin-change interrupts 0 and 2,
@@ -60,7 +135,7 @@ void init_inputs(void)
   PCICR = (1<<PCIE0) | (1<<PCIE2);
 
   /* Set the pin-change interrupt masks according to the pins used as inputs */
-  PCMSK2 = (1<<PCINT23) | (1<<PCINT20) | (1<<PCINT18) | (1<<PCINT17);
+  PCMSK2 = (1<<PCINT23) | (1<<PCINT20) | (1<<PCINT18) | (1<<PCINT_EOT1);
   PCMSK1 = 0;
   PCMSK0 = (1<<PCINT5) | (1<<PCINT4) | (1<<PCINT3) | (1<<PCINT2) | (1<<PCINT0);
 
@@ -70,6 +145,53 @@ void init_inputs(void)
   DDRD &= ~D_MASK;
   PORTD |= D_MASK;
 
+  /* Settle the debounced state on whatever the inputs are at start up */
+  start_sampling();
+}
+
+/* Adds an event to the queue and wakes the main loop to handle it.
+   If the queue is full, the event is dropped, but for a release, which must get through to
+   clear the long-push counter of its input. A release takes the place of the newest event
+   that is not a release, and that event is dropped instead. Those after it are all releases,
+   so a release only ever jumps ahead of other releases. The oldest event, which poll_inputs()
+   may be reading, is left alone, and only if the others are all releases is the new one
+   dropped. Must be called from an interrupt handler */
+static void post_event(uint8_t event)
+{
+  uint8_t next_in;
+  uint8_t index;
+  uint8_t displaced;
+
+  next_in = (EventIn + 1) % EVENT_QUEUE_SIZE;
+  if (next_in != EventOut)
+  {
+    EventQueue[EventIn] = event;
+    EventIn = next_in;
+  }
+  else
+  {
+    if ((event & EVENT_KIND_MASK) == EVENT_RELEASED)
+    {
+      index = EventIn;
+      while (index != (EventOut + 1) % EVENT_QUEUE_SIZE)
+      {
+        index = (index + EVENT_QUEUE_SIZE - 1) % EVENT_QUEUE_SIZE;
+        displaced = EventQueue[index];
+        if ((displaced & EVENT_KIND_MASK) != EVENT_RELEASED)
+        {
+          EventQueue[index] = event;
+          event = displaced;
+          break;
+        }
+      } /* end while looking back through the queue */
+    }
+    if (((event & EVENT_KIND_MASK) == EVENT_PRESSED) && ((event & EVENT_ID_MASK) <= INPUT_EOT4))
+    {
+      /* The press is lost, so nothing should wait for it */
+      EotPending &= ~(1<<(event & EVENT_ID_MASK));
+    }
+  }
+  request_poll();
 }
 
 static void held_input(uint8_t * counter_ptr, uint8_t input)
@@ -79,12 +201,12 @@ static void held_input(uint8_t * counter_ptr, uint8_t input)
     (*counter_ptr)++;
     if (*counter_ptr == LONG_PUSH_CYCLES)
     {
-      input_long_push(input);
+      post_event(input | EVENT_LONG_PUSH);
     }
     if ((*counter_ptr > REPEAT_HOLDOFF_CYCLES) &&
         (((*counter_ptr - REPEAT_HOLDOFF_CYCLES) % REPEAT_INTERVAL_CYCLES) == 0))
     {
-      input_repeat(input);
+      post_event(input | EVENT_REPEAT);
     }
   }
 }
@@ -124,121 +246,191 @@ void process_inputs(void)
     held_input(&PauseCounter, INPUT_PAUSE);
   }
 
+  /* Stop being called once there is nothing more to count */
+  if (((LastD & D_MASK_UP) == 0) &&
+      ((LastB & (B_MASK_DOWN | B_MASK_COPY | B_MASK_PAUSE)) == 0) &&
+      ((SecondControlNotFittedCount == 0) || (SecondControlNotFittedCount >= SECOND_CONTROL_TIMEOUT_CYCLES)))
+  {
+    disable_task(INPUTS_TASK);
+  }
 }
 
 void poll_inputs(void)
 {
-  uint8_t pb;
-  uint8_t pd;
-
-  /* Read the input ports */
-  pb = (PINB ^ B_INVERTED) & B_MASK;
-  pd = (PIND ^ D_INVERTED) & D_MASK;
+  uint8_t event;
+  uint8_t id;
 
-  /* debounce any inputs */
+  while (EventOut != EventIn)
   {
-    uint8_t i;
-    i = 20;
-    while ((i>0) && ((pb != 0) || (pd != 0)))
-    {
-      _delay_ms(1);
-      pb &= (PINB ^ B_INVERTED) & B_MASK;
-      pd &= (PIND ^ D_INVERTED) & D_MASK;
-      i--;
-    }
-  }
-
-  /* Process inputs */
-  if ((pb != 0) || (pd != 0))
-  {
-    uint8_t newb;
-    uint8_t newd;
-
-    /* Identify which inputs have just been asserted */
-    newb = pb & ~LastB;
-    newd = pd & ~LastD;
+    event = EventQueue[EventOut];
+    EventOut = (EventOut + 1) % EVENT_QUEUE_SIZE;
+    id = event & EVENT_ID_MASK;
 
-    /* Mask off the second control inputs if it is not fitted */
-    if (SecondControlNotFittedCount >= SECOND_CONTROL_TIMEOUT_CYCLES)
+    if (((event & EVENT_KIND_MASK) == EVENT_PRESSED) && (id <= INPUT_EOT4))
     {
-      newb &= ~B_MASK_EOT4;
-      newd &= ~D_MASK_EOT3;
+      ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+      {
+        EotPending &= ~(1<<id);
+      }
     }
 
-    /* Tell the application which inputs were just asserted */
-    if (newd & D_MASK_EOT1)
-    {
-      input_asserted(INPUT_EOT1);
-    }
-    if (newd & D_MASK_EOT2)
-    {
-      input_asserted(INPUT_EOT2);
-    }
-    if (newd & D_MASK_UP)
-    {
-      input_asserted(INPUT_UP);
-    }
-    if (newd & D_MASK_EOT3)
-    {
-      input_asserted(INPUT_EOT3);
-    }
-    if (newb & B_MASK_EOT4)
-    {
-      input_asserted(INPUT_EOT4);
-    }
-    if (newb & B_MASK_DOWN)
-    {
-      input_asserted(INPUT_DOWN);
-    }
-    if (newb & B_MASK_RESTART)
+    /* Ignore the second control's inputs if it is not fitted */
+    if (((id == INPUT_EOT3) || (id == INPUT_EOT4)) &&
+        (SecondControlNotFittedCount >= SECOND_CONTROL_TIMEOUT_CYCLES))
     {
-      input_asserted(INPUT_RESTART);
+      continue;
     }
-    if (newb & B_MASK_PAUSE)
-    {
-      input_asserted(INPUT_PAUSE);
-    }
-    if (newb & B_MASK_COPY)
+
+    switch (event & EVENT_KIND_MASK)
     {
-      input_asserted(INPUT_COPY);
+    case EVENT_PRESSED:
+      /* Tell the application which input was just asserted */
+      trace_begin(TRACE_INPUT_ASSERTED, id);
+      input_asserted(id);
+      trace_end(TRACE_INPUT_ASSERTED, id);
+      break;
+
+    case EVENT_LONG_PUSH:
+      input_long_push(id);
+      break;
+
+    case EVENT_REPEAT:
+      input_repeat(id);
+      break;
+
+    case EVENT_RELEASED:
+      /* Clear the long-push counters */
+      if (id == INPUT_UP)
+      {
+        UpCounter = 0;
+      }
+      else if (id == INPUT_DOWN)
+      {
+        DownCounter = 0;
+      }
+      else if (id == INPUT_COPY)
+      {
+        CopyCounter = 0;
+      }
+      else if (id == INPUT_PAUSE)
+      {
+        PauseCounter = 0;
+      }
+      break;
     }
-    
-  } /* end if any keys are pressed */
+  } /* end while events are queued */
+}
+
+/* Advances the vertical counters of the bits that differ from the debounced state,
+   and resets the others. Returns the bits that have just changed state. */
+static uint8_t debounce(uint8_t sample, uint8_t * state_ptr, uint8_t * count0_ptr, uint8_t * count1_ptr)
+{
+  uint8_t changed;
+  changed = sample ^ *state_ptr;
+  *count0_ptr = ~(*count0_ptr & changed);
+  *count1_ptr = *count0_ptr ^ (*count1_ptr & changed);
+  changed &= *count0_ptr & *count1_ptr;
+  *state_ptr ^= changed;
+  return changed;
+}
 
-  if ((LastB != 0) || (LastD != 0))
+/* Records the time of the first edge of an end-of-turn input being pressed,
+   so that the move can be timed from then rather than from when the input settles.
+   Returns the inputs whose edge has now been seen */
+static uint8_t capture_edges(uint8_t pressed, uint8_t edges, uint8_t id, uint8_t mask)
+{
+  if ((pressed & ~edges & mask) != 0)
   {
-    uint8_t oldb;
-    uint8_t oldd;
+    /* The ticks are not counted while no task is scheduled, so make sure they are from now */
+    enable_task(INPUTS_TASK);
+    capture_time(&EotTime[id]);
+    EotPending |= 1<<id;
+    edges |= mask;
+  }
+  return edges;
+}
+
+/* Interrupt handler for timer2 compare match B, to sample the inputs */
+ISR(TIMER2_COMPB_vect)
+{
+  uint8_t pb;
+  uint8_t pd;
+  uint8_t changedb;
+  uint8_t changedd;
+  uint8_t id;
+  IsrStartType isr_start;
 
-    /* Identify which inputs have just been de-asserted */
-    oldb = LastB & ~pb;
-    oldd = LastD & ~pd;
+  isr_begin(&isr_start);
+  trace_begin(TRACE_SAMPLE, 0);
 
-    /* Clear the long-push counters */
-    if (oldd & D_MASK_UP)
-    {
-      UpCounter = 0;
-    }
-    if (oldb & B_MASK_DOWN)
-    {
-      DownCounter = 0;
-    }
-    if (oldb & B_MASK_PAUSE)
+  /* Read the input ports */
+  pb = (PINB ^ B_INVERTED) & B_MASK;
+  pd = (PIND ^ D_INVERTED) & D_MASK;
+
+  changedb = debounce(pb, &LastB, &CountB0, &CountB1);
+  changedd = debounce(pd, &LastD, &CountD0, &CountD1);
+
+  /* Time any press whose first edge was missed, such as one held at start up, from now */
+  capture_edges(changedb & LastB, EdgeB, INPUT_EOT4, B_MASK_EOT4);
+  capture_edges(changedd & LastD, EdgeD, INPUT_EOT1, D_MASK_EOT1);
+  capture_edges(changedd & LastD, EdgeD, INPUT_EOT2, D_MASK_EOT2);
+  capture_edges(changedd & LastD, EdgeD, INPUT_EOT3, D_MASK_EOT3);
+  EdgeB &= ~changedb;
+  EdgeD &= ~changedd;
+
+  if ((changedb != 0) || (changedd != 0))
+  {
+    /* Queue an event for each input that has changed */
+    for (id = 0; id < NUM_INPUTS; id++)
     {
-      PauseCounter = 0;
-    }
+      uint8_t mask;
+      uint8_t state;
+      mask = pgm_read_byte(&InputMasks[id]);
+      if (INPUT_ON_PORT_B(id))
+      {
+        state = LastB;
+        mask &= changedb;
+      }
+      else
+      {
+        state = LastD;
+        mask &= changedd;
+      }
+      if (mask != 0)
+      {
+        post_event(((state & mask) != 0) ? (id | EVENT_PRESSED) : (id | EVENT_RELEASED));
+      }
+    } /* end for all inputs */
+
+    /* Let process_inputs() see the change on the next tick */
+    enable_task(INPUTS_TASK);
+  }
 
-    /* Mask off the second control inputs if it is not fitted */
-    if (SecondControlNotFittedCount >= SECOND_CONTROL_TIMEOUT_CYCLES)
+  if ((pb == LastB) && (pd == LastD))
+  {
+    /* Everything is stable, so stop sampling until the next pin change.
+       An edge that never became a press was a glitch, so nothing should wait for it */
+    TIMSK2 &= ~(1<<OCIE2B);
+    if ((EdgeB != 0) || (EdgeD != 0))
     {
-      oldb &= ~B_MASK_EOT4;
-      oldd &= ~D_MASK_EOT3;
+      for (id = INPUT_EOT1; id <= INPUT_EOT4; id++)
+      {
+        if ((INPUT_ON_PORT_B(id) ? EdgeB : EdgeD) & pgm_read_byte(&InputMasks[id]))
+        {
+          EotPending &= ~(1<<id);
+        }
+      }
+      request_poll();
     }
-
+    EdgeB = 0;
+    EdgeD = 0;
   }
-
-  LastB = pb;
-  LastD = pd;
+  else
+  {
+    OCR2B += DEBOUNCE_SAMPLE_COUNTS;
+  }
+  trace_end(TRACE_SAMPLE, 0);
+  isr_end(ISR_SAMPLE, &isr_start);
 }
 
 uint8_t is_second_control_fitted(void)
@@ -264,5 +456,50 @@ uint8_t raw_input(uint8_t n)
   }
 }
 
-EMPTY_INTERRUPT(PCINT0_vect);
-EMPTY_INTERRUPT(PCINT2_vect);
+/* Any pin change starts the debouncer sampling */
+ISR(PCINT0_vect)
+{
+  uint8_t pressed;
+  IsrStartType isr_start;
+  isr_begin(&isr_start);
+  trace_begin(TRACE_PIN_CHANGE, 0);
+  pressed = (PINB ^ B_INVERTED) & B_MASK_EOT & ~LastB;
+  EdgeB = capture_edges(pressed, EdgeB, INPUT_EOT4, B_MASK_EOT4);
+  start_sampling();
+  trace_end(TRACE_PIN_CHANGE, 0);
+  isr_end(ISR_PIN_CHANGE_B, &isr_start);
+}
+
+ISR(PCINT2_vect)
+{
+  uint8_t pressed;
+  IsrStartType isr_start;
+  isr_begin(&isr_start);
+  trace_begin(TRACE_PIN_CHANGE, 2);
+  pressed = (PIND ^ D_INVERTED) & D_MASK_EOT & ~LastD;
+  EdgeD = capture_edges(pressed, EdgeD, INPUT_EOT1, D_MASK_EOT1);
+  EdgeD = capture_edges(pressed, EdgeD, INPUT_EOT2, D_MASK_EOT2);
+  EdgeD = capture_edges(pressed, EdgeD, INPUT_EOT3, D_MASK_EOT3);
+  start_sampling();
+  trace_end(TRACE_PIN_CHANGE, 2);
+  isr_end(ISR_PIN_CHANGE_D, &isr_start);
+}
+
+void input_time(uint8_t id, TickTimeType * time_ptr)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    *time_ptr = EotTime[id];
+  }
+}
+
+uint8_t input_pending_time(uint8_t id, TickTimeType * time_ptr)
+{
+  uint8_t pending;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    pending = (EotPending >> id) & 1;
+    *time_ptr = EotTime[id];
+  }
+  return pending;
+}
@@ -14,7 +14,8 @@ enum {
   INPUT_DOWN,
   INPUT_COPY,
   INPUT_PAUSE,
-  INPUT_RESTART
+  INPUT_RESTART,
+  NUM_INPUTS
 };
 
 void input_asserted(uint8_t id); /* user must provide this */
@@ -25,9 +26,21 @@ uint8_t is_second_control_fitted(void);
 
 uint8_t raw_input(uint8_t n);
 
-/* Calls input_asserted(id) whenever a key is pressed */
+/* Gets the time of the first edge of the last press of the end-of-turn input id,
+   which is before input_asserted(id) is called by the time it takes to debounce.
+   Needs timer.h */
+void input_time(uint8_t id, TickTimeType * time_ptr);
+
+/* Gets the time of the first edge of a press of end-of-turn input id that has not yet been
+   passed to input_asserted(id), because it is still being debounced or is queued.
+   Returns 0 if there is no such press. Needs timer.h */
+uint8_t input_pending_time(uint8_t id, TickTimeType * time_ptr);
+
+/* Calls input_asserted(id), input_long_push(id) and input_repeat(id)
+   for each event that the interrupt handlers have queued.
+   The application is only ever called from here, never from an interrupt handler */
 void poll_inputs(void);
 
-/* Calls input_long_push(id) whenever a key is held in long enough */
-/* Calls input_repeat(id) cyclically for held-in keys after a hold-off period */
+/* Queues a long push whenever a key is held in long enough */
+/* Queues a repeat cyclically for held-in keys after a hold-off period */
 void process_inputs(void);
@@ -20,12 +20,32 @@
 
  USAGE
        See the C include lcd.h file for a description of each function
+
+       Commands and data are queued and only written to the LCD controller
+       by lcd_flush(), or when the queue is full.
+
+       lcd_flush() writes the queue from the main loop before it sleeps, and
+       does not return until it is empty. It is not drained from a timer
+       task: at 1MHz a queued byte takes ~85 cycles to write, of which the
+       37us execution time is only partly waited out, so a countdown redraw
+       (an address set and 8 characters) keeps the CPU awake for under 1ms
+       either way. From the tick interrupt the same time would be added to
+       the latency of every other interrupt handler. Only clear display and
+       return home wait on the busy flag, for up to 1.52ms, and the clock
+       only sends those from lcd_init().
+
+       Characters written with lcd_putc() go to a RAM copy of the visible
+       display, and lcd_flush() only sends the cells that have changed.
        
 *****************************************************************************/
 #include <inttypes.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
+#include <avr/cpufunc.h>
+#include <util/atomic.h>
+#include <util/delay_basic.h>
 #include "lcd.h"
+#include "trace.h"
 
 
 
@@ -42,12 +62,17 @@
 
 
 #if LCD_IO_MODE
-#define lcd_e_delay()   __asm__ __volatile__( "rjmp 1f\n 1:" );
+#define lcd_e_delay()   { _NOP(); _NOP(); }
 #define lcd_e_high()    LCD_E_PORT  |=  _BV(LCD_E_PIN);
 #define lcd_e_low()     LCD_E_PORT  &= ~_BV(LCD_E_PIN);
 #define lcd_e_toggle()  toggle_e()
+#ifdef BUS_BOARD
+/* RW is tied low, and its pin is E */
+#define lcd_rw_low()
+#else
 #define lcd_rw_high()   LCD_RW_PORT |=  _BV(LCD_RW_PIN)
 #define lcd_rw_low()    LCD_RW_PORT &= ~_BV(LCD_RW_PIN)
+#endif
 #define lcd_rs_high()   LCD_RS_PORT |=  _BV(LCD_RS_PIN)
 #define lcd_rs_low()    LCD_RS_PORT &= ~_BV(LCD_RS_PIN)
 #endif
@@ -82,6 +107,58 @@
 #if LCD_IO_MODE
 static void toggle_e(void);
 #endif
+static void lcd_enqueue(uint8_t data, uint8_t rs);
+
+
+/*
+** queue of commands and data waiting to be written to the LCD controller
+*/
+#define LCD_QUEUE_SIZE   32        /* must be a power of 2 */
+#define LCD_QUEUE_MASK   (LCD_QUEUE_SIZE-1)
+
+/* execution time of all instructions except clear display and return home */
+#define LCD_EXEC_TIME_US 37
+
+/* cycles spent on the queue and in lcd_write() between two enable pulses, at least */
+#define LCD_WRITE_GAP_CYCLES 25
+#if (LCD_EXEC_TIME_US * (XTAL/1000000)) > LCD_WRITE_GAP_CYCLES
+#define lcd_exec_delay() delay(LCD_EXEC_TIME_US - LCD_WRITE_GAP_CYCLES/(XTAL/1000000))
+#else
+#define lcd_exec_delay()
+#endif
+
+static uint8_t lcd_queue_data[LCD_QUEUE_SIZE];
+static uint8_t lcd_queue_rs[LCD_QUEUE_SIZE];
+static volatile uint8_t lcd_queue_in;
+static volatile uint8_t lcd_queue_out;
+
+/* DDRAM address the cursor will be at once the queue has been written */
+static uint8_t lcd_address;
+
+/*
+** RAM copy of the visible display, with a bit set for each cell that has changed
+*/
+#if LCD_DISP_LENGTH > 16
+#error "one 16-bit mask per line only covers 16 characters"
+#endif
+static const PROGMEM uint8_t lcd_line_start[LCD_LINES] = {
+    LCD_START_LINE1,
+#if LCD_LINES > 1
+    LCD_START_LINE2,
+#endif
+#if LCD_LINES > 2
+    LCD_START_LINE3,
+    LCD_START_LINE4,
+#endif
+};
+static char lcd_shadow[LCD_LINES][LCD_DISP_LENGTH];
+static uint16_t lcd_dirty[LCD_LINES];
+
+static uint8_t lcd_cursor_on;     /* the cursor is shown, so its position matters */
+static uint8_t lcd_cursor_moved;  /* lcd_address has been set since the last flush */
+
+/* number of bytes written to the LCD controller */
+static uint16_t lcd_transfers;
 
 /*
 ** local functions
@@ -95,14 +172,11 @@ static void toggle_e(void);
 static inline void _delayFourCycles(unsigned int __count)
 {
     if ( __count == 0 )    
-        __asm__ __volatile__( "rjmp 1f\n 1:" );    // 2 cycles
+    {
+        _NOP(); _NOP();                            // 2 cycles
+    }
     else
-        __asm__ __volatile__ (
-    	    "1: sbiw %0,1" "\n\t"                  
-    	    "brne 1b"                              // 4 cycles/loop
-    	    : "=w" (__count)
-    	    : "0" (__count)
-    	   );
+        _delay_loop_2(__count);                    // 4 cycles/loop
 }
 
 
@@ -206,6 +280,7 @@ static void lcd_write(uint8_t data,uint8_t rs)
 #endif
 
 
+#ifndef BUS_BOARD
 /*************************************************************************
 Low-level function to read byte from LCD controller
 Input:    rs     1: read data    
@@ -297,6 +372,7 @@ static uint8_t lcd_waitbusy(void)
     return (lcd_read(0));  // return address counter
     
 }/* lcd_waitbusy */
+#endif
 
 
 /*************************************************************************
@@ -347,6 +423,76 @@ static inline void lcd_newline(uint8_t pos)
 ** PUBLIC FUNCTIONS 
 */
 
+/*************************************************************************
+Write the oldest queued command or data byte to the LCD controller.
+No busy flag is read: the execution time of each instruction is known,
+except for clear display and return home, which are waited for,
+on the busy flag or, where RW is tied low, for as long as they take.
+Only taking the byte off the queue is done with interrupts disabled:
+no interrupt handler uses the LCD pins, and an interrupt in the middle
+of a write only makes the enable pulse or the delay longer.
+Returns:  0 if the queue was empty
+*************************************************************************/
+static uint8_t lcd_write_queued(void)
+{
+    uint8_t out;
+    uint8_t data;
+    uint8_t rs;
+    uint8_t written;
+
+    written = 0;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        out = lcd_queue_out;
+        if ( out != lcd_queue_in ) {
+            data = lcd_queue_data[out];
+            rs = lcd_queue_rs[out];
+            lcd_queue_out = (out + 1) & LCD_QUEUE_MASK;
+            lcd_transfers++;
+            written = 1;
+        }
+    }
+    if ( written ) {
+        lcd_write(data, rs);
+        if ( !rs && (data < (1<<LCD_ENTRY_MODE)) ) {
+            /* clear display or return home */
+#ifdef BUS_BOARD
+            delay(1640);    /* RW is tied low, so wait out the 1.52ms */
+#else
+            lcd_waitbusy();
+#endif
+        } else {
+            lcd_exec_delay();
+        }
+    }
+    return written;
+}
+
+
+/*************************************************************************
+Add a command or data byte to the queue, making room if it is full
+*************************************************************************/
+static void lcd_enqueue(uint8_t data, uint8_t rs)
+{
+    uint8_t in;
+
+    for (;;)
+    {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            in = lcd_queue_in;
+            if ( ((in + 1) & LCD_QUEUE_MASK) != lcd_queue_out ) {
+                lcd_queue_data[in] = data;
+                lcd_queue_rs[in] = rs;
+                lcd_queue_in = (in + 1) & LCD_QUEUE_MASK;
+                return;
+            }
+        }
+        lcd_write_queued();
+    }
+}
+
+
 /*************************************************************************
 Send LCD controller instruction command
 Input:   instruction to send to LCD controller, see HD44780 data sheet
@@ -354,8 +500,30 @@ Returns: none
 *************************************************************************/
 void lcd_command(uint8_t cmd)
 {
-    lcd_waitbusy();
-    lcd_write(cmd,0);
+    if ( cmd & (1<<LCD_DDRAM) ) {
+        /* only the RAM copy's cursor moves, lcd_flush() sets the address */
+        lcd_address = cmd & ~(1<<LCD_DDRAM);
+        lcd_cursor_moved = 1;
+        return;
+    }
+    if ( cmd < (1<<LCD_ENTRY_MODE) ) {
+        /* clear display or return home */
+        lcd_address = 0;
+        if ( cmd & (1<<LCD_CLR) ) {
+            uint8_t line;
+            uint8_t x;
+            for (line = 0; line < LCD_LINES; line++) {
+                for (x = 0; x < LCD_DISP_LENGTH; x++) {
+                    lcd_shadow[line][x] = ' ';
+                }
+                lcd_dirty[line] = 0;
+            }
+        }
+    } else if ( (cmd & ~((1<<LCD_ON)-1)) == (1<<LCD_ON) ) {
+        lcd_cursor_on = cmd & ((1<<LCD_ON_CURSOR) | (1<<LCD_ON_BLINK));
+        lcd_cursor_moved = 1;
+    }
+    lcd_enqueue(cmd,0);
 }
 
 
@@ -366,8 +534,70 @@ Returns: none
 *************************************************************************/
 void lcd_data(uint8_t data)
 {
-    lcd_waitbusy();
-    lcd_write(data,1);
+    lcd_enqueue(data,1);
+}
+
+
+/*************************************************************************
+Queue the changed cells of the RAM copy, one address set per run of
+adjacent changed cells, and then write the queue to the LCD controller
+*************************************************************************/
+void lcd_flush(void)
+{
+    uint8_t line;
+    uint8_t x;
+    uint8_t in_run;
+    uint8_t sent;
+    uint16_t dirty;
+
+    sent = 0;
+    for (line = 0; line < LCD_LINES; line++) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        {
+            dirty = lcd_dirty[line];
+            lcd_dirty[line] = 0;
+        }
+        in_run = 0;
+        for (x = 0; dirty != 0; x++, dirty >>= 1) {
+            if ( dirty & 1 ) {
+                if ( !sent ) {
+                    trace_begin(TRACE_LCD_FLUSH, 0);
+                    sent = 1;
+                }
+                if ( !in_run ) {
+                    lcd_enqueue((1<<LCD_DDRAM) + pgm_read_byte(&lcd_line_start[line]) + x, 0);
+                    in_run = 1;
+                }
+                lcd_enqueue(lcd_shadow[line][x], 1);
+                lcd_cursor_moved = 1;
+            } else {
+                in_run = 0;
+            }
+        }
+    }
+    if ( lcd_cursor_on && lcd_cursor_moved ) {
+        lcd_enqueue((1<<LCD_DDRAM) + lcd_address, 0);
+    }
+    lcd_cursor_moved = 0;
+
+    while ( lcd_write_queued() ) {}
+    if ( sent ) {
+        trace_end(TRACE_LCD_FLUSH, 0);
+    }
+}
+
+
+/*************************************************************************
+Number of bytes written to the LCD controller, for measuring bus traffic
+*************************************************************************/
+uint16_t lcd_transfer_count(void)
+{
+    uint16_t count;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        count = lcd_transfers;
+    }
+    return count;
 }
 
 
@@ -407,7 +637,7 @@ void lcd_gotoxy(uint8_t x, uint8_t y)
 *************************************************************************/
 int lcd_getxy(void)
 {
-    return lcd_waitbusy();
+    return lcd_address;
 }
 
 
@@ -437,9 +667,11 @@ Returns:  none
 void lcd_putc(char c)
 {
     uint8_t pos;
+    uint8_t line;
+    uint8_t x;
 
 
-    pos = lcd_waitbusy();   // read busy-flag and address counter
+    pos = lcd_address;
     if (c=='\n')
     {
         lcd_newline(pos);
@@ -449,28 +681,37 @@ void lcd_putc(char c)
 #if LCD_WRAP_LINES==1
 #if LCD_LINES==1
         if ( pos == LCD_START_LINE1+LCD_DISP_LENGTH ) {
-            lcd_write((1<<LCD_DDRAM)+LCD_START_LINE1,0);
+            lcd_command((1<<LCD_DDRAM)+LCD_START_LINE1);
         }
 #elif LCD_LINES==2
         if ( pos == LCD_START_LINE1+LCD_DISP_LENGTH ) {
-            lcd_write((1<<LCD_DDRAM)+LCD_START_LINE2,0);    
+            lcd_command((1<<LCD_DDRAM)+LCD_START_LINE2);
         }else if ( pos == LCD_START_LINE2+LCD_DISP_LENGTH ){
-            lcd_write((1<<LCD_DDRAM)+LCD_START_LINE1,0);
+            lcd_command((1<<LCD_DDRAM)+LCD_START_LINE1);
         }
 #elif LCD_LINES==4
         if ( pos == LCD_START_LINE1+LCD_DISP_LENGTH ) {
-            lcd_write((1<<LCD_DDRAM)+LCD_START_LINE2,0);    
+            lcd_command((1<<LCD_DDRAM)+LCD_START_LINE2);
         }else if ( pos == LCD_START_LINE2+LCD_DISP_LENGTH ) {
-            lcd_write((1<<LCD_DDRAM)+LCD_START_LINE3,0);
+            lcd_command((1<<LCD_DDRAM)+LCD_START_LINE3);
         }else if ( pos == LCD_START_LINE3+LCD_DISP_LENGTH ) {
-            lcd_write((1<<LCD_DDRAM)+LCD_START_LINE4,0);
+            lcd_command((1<<LCD_DDRAM)+LCD_START_LINE4);
         }else if ( pos == LCD_START_LINE4+LCD_DISP_LENGTH ) {
-            lcd_write((1<<LCD_DDRAM)+LCD_START_LINE1,0);
+            lcd_command((1<<LCD_DDRAM)+LCD_START_LINE1);
         }
 #endif
-        lcd_waitbusy();
 #endif
-        lcd_write(c, 1);
+        for (line = 0; line < LCD_LINES; line++) {
+            x = pos - pgm_read_byte(&lcd_line_start[line]);
+            if ( x < LCD_DISP_LENGTH ) {
+                if ( lcd_shadow[line][x] != c ) {
+                    lcd_shadow[line][x] = c;
+                    lcd_dirty[line] |= (uint16_t)1<<x;
+                }
+                break;
+            }
+        }
+        lcd_address++;
     }
 
 }/* lcd_putc */
@@ -605,5 +846,6 @@ void lcd_init(uint8_t dispAttr)
     lcd_clrscr();                           /* display clear                */ 
     lcd_command(LCD_MODE_DEFAULT);          /* set entry mode               */
     lcd_command(dispAttr);                  /* display/cursor control       */
+    lcd_flush();
 
 }/* lcd_init */
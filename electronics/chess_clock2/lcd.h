@@ -97,8 +97,14 @@
 #define LCD_RS_PIN       4            /**< pin  for RS line         */
 #define LCD_RW_PORT      LCD_PORT     /**< port for RW line         */
 #define LCD_RW_PIN       5            /**< pin  for RW line         */
+#ifdef BUS_BOARD
+/* PD0 is RXD on the bus board (serial.h), so RW is tied low and E has its pin */
+#define LCD_E_PORT       PORTC        /**< port for Enable line     */
+#define LCD_E_PIN        5            /**< pin  for Enable line     */
+#else
 #define LCD_E_PORT       PORTD        /**< port for Enable line     */
 #define LCD_E_PIN        0            /**< pin  for Enable line     */
+#endif
 
 #elif defined(__AVR_AT90S4414__) || defined(__AVR_AT90S8515__) || defined(__AVR_ATmega64__) || \
       defined(__AVR_ATmega8515__)|| defined(__AVR_ATmega103__) || defined(__AVR_ATmega128__) || \
@@ -250,13 +256,44 @@ extern void lcd_command(uint8_t cmd);
 /**
  @brief    Send data byte to LCD controller 
  
- Similar to lcd_putc(), but without interpreting LF
+ Similar to lcd_putc(), but without interpreting LF.
+ The byte bypasses the RAM copy of the display, so use it for CG RAM only.
  @param    data byte to send to LCD controller, see HD44780 data sheet
  @return   none
 */
 extern void lcd_data(uint8_t data);
 
 
+/**
+ @brief    Write all queued commands and data to the LCD controller
+
+ lcd_command(), lcd_data(), lcd_putc() and the functions based on them only
+ add to a queue, so they never wait for the LCD controller. The queue is
+ written using the known execution times instead of reading the busy flag.
+
+ lcd_putc() only changes a RAM copy of the display, and moving the cursor
+ only changes the RAM copy's cursor. lcd_flush() sends the cells that differ
+ from what the display shows, with one address set per run of adjacent cells.
+
+ The queue is written before lcd_flush() returns, so the caller waits for the
+ bytes to be written, but not for a busy flag except after clear display
+ and return home.
+ @param    void
+ @return   none
+*/
+extern void lcd_flush(void);
+
+
+/**
+ @brief    Number of bytes written to the LCD controller so far
+ 
+ Counts commands and data bytes, and wraps around at 65536.
+ @param    void
+ @return   byte count
+*/
+extern uint16_t lcd_transfer_count(void);
+
+
 /**
  @brief macros for automatically storing string constant in program memory
 */
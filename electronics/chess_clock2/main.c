@@ -12,36 +12,69 @@
 #include "turnled.h"
 #include "input.h"
 #include "clock.h"
+#include "eeprom.h"
+#include "settings.h"
+#include "diagnostics.h"
+#include "serial.h"
+#include "telemetry.h"
+#include "profile.h"
+#include "trace.h"
+#include "main.h"
 
 static void init_other_hw(void);
+#ifndef HOST
 static void sleep_until_interrupt(void);
 
 int main(void)
+{
+  init_firmware();
+  for (;;) {                           /* loop forever */
+    poll_firmware();
+    sleep_until_interrupt();
+  } /* end loop forever */
+}
+#endif
+
+void init_firmware(void)
 {
   init_other_hw(); /* Must call this first */
+#ifdef PROFILE
+  init_profile();
+#endif
   init_timer();
+#ifdef TRACE
+  init_trace();
+#endif
   init_audio();
   init_turnled();
   init_inputs();
+  init_diagnostics();
+  init_serial();
 
-  enable_task(TURNLED_TASK);
-  enable_task(AUDIO_TASK);
+  /* The other tasks are scheduled when there is something for them to do */
   enable_task(INPUTS_TASK);
-  enable_task(COUNTDOWN_TASK);
    
   /* initialize display, cursor off */
   lcd_init(LCD_DISP_ON);
 
-  init_clock();
-
-  /* Enable interrupts */
+  /* Enable interrupts. init_settings() and init_clock() may write to the EEPROM, and
+     write_eeprom() must not be called with interrupts disabled */
   sei();
 
-  for (;;) {                           /* loop forever */
-    poll_inputs();
-    poll_clock();
-    sleep_until_interrupt();
-  } /* end loop forever */
+  init_settings();
+  init_clock();
+}
+
+void poll_firmware(void)
+{
+  poll_inputs();
+  poll_clock();
+#ifdef TELEMETRY
+  poll_telemetry();
+#endif
+  poll_eeprom();
+  poll_diagnostics();
+  lcd_flush();
 }
 
 static void init_other_hw(void)
@@ -49,10 +82,10 @@ static void init_other_hw(void)
   /* Turn off hardware that isn't used */
   PRR = (1<<PRTWI)    /* Turn off TWI */
       | (0<<PRTIM2)   /* leave Timer2 on */
-      | (1<<PRTIM0)   /* Turn off Timer0 */
+      | (0<<PRTIM0)   /* leave Timer0 on, to time the interrupt handlers */
       | (0<<PRTIM1)   /* leave Timer1 on */
       | (1<<PRSPI)    /* Turn off SPI */
-      | (1<<PRUSART0) /* Turn off USART */
+      | (1<<PRUSART0) /* Turn off USART, unless there is a bus to listen to */
       | (1<<PRADC);   /* Turn off ADC */
 
   /* Set all pins to input and enable pullups */
@@ -60,15 +93,36 @@ static void init_other_hw(void)
   PORTB = PORTC = PORTD = 0xFF;
 }
 
+#ifndef HOST
 static void sleep_until_interrupt(void)
 {
-  if (is_any_task_active() == 0)
+  for (;;)
   {
-    SMCR = (0<<SM2) | (1<<SM1) | (1<<SM0) | (1<<SE); /* Enable sleep in "power save" mode */
-    /* Note: timer 2 is still running in power save mode */
- 
+    cli();
+    if (poll_requested())
+    {
+      break;
+    }
+    if (eeprom_write_pending() || serial_busy())
+    {
+      SMCR = (0<<SM2) | (0<<SM1) | (0<<SM0) | (1<<SE); /* Enable sleep in "idle" mode */
+      /* Note: the EEPROM ready interrupt cannot wake the CPU from power save mode,
+         and the USART has no clock in it */
+    }
+    else
+    {
+      SMCR = (0<<SM2) | (1<<SM1) | (1<<SM0) | (1<<SE); /* Enable sleep in "power save" mode */
+      /* Note: timer 2 is still running in power save mode */
+    }
+
+    /* The instruction after sei() always executes before any interrupt,
+       so an interrupt cannot slip in between the check above and the sleep */
+    sei();
     asm("sleep");
     
-    SMCR &= (1<<SE);  /* Clear the sleep-enable bit to prevent inadvertent sleep */
+    SMCR &= ~(1<<SE);  /* Clear the sleep-enable bit to prevent inadvertent sleep */
   }
+  clear_poll_request();
+  sei();
 }
+#endif
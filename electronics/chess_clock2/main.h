@@ -0,0 +1,11 @@
+/*
+ * main.h
+ *
+ * The firmware apart from main() itself, so that host/sim.c can run it as main() does
+ */
+
+/* Sets up the hardware and all of the modules, and enables interrupts */
+void init_firmware(void);
+
+/* One pass of the main loop, which main() makes each time the CPU wakes with a poll requested */
+void poll_firmware(void);
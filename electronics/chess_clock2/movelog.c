@@ -0,0 +1,202 @@
+/*
+ * movelog.c
+ */
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "timer.h"
+#include "movelog.h"
+#include "timecontrol.h"
+#include "eeprom.h"
+#include "dump.h"
+
+static MoveType MoveRing[MOVE_LOG_SIZE];
+static uint8_t MoveIn;      /* where the next move goes */
+static uint8_t MoveCount;   /* moves in the ring, up to MOVE_LOG_SIZE */
+static uint8_t Unsaved;     /* moves logged since the log was last saved */
+
+/* The tick at which the turn started, in each of the two games */
+static uint16_t TurnTick[NUM_COUNTDOWNS / 2];
+
+/* The EEPROM copy is the number of moves, then the moves oldest first, low bytes first */
+#define SAVED_MOVES ((MOVE_LOG_EEPROM_SIZE - 1) / sizeof(MoveType))
+
+void clear_move_log(void)
+{
+  MoveIn = 0;
+  MoveCount = 0;
+  Unsaved = 0;
+}
+
+static void add_move(uint8_t id, uint16_t elapsed, uint32_t remaining)
+{
+  MoveType * move_ptr;
+  if (elapsed > MOVE_ELAPSED_MAX)
+  {
+    elapsed = MOVE_ELAPSED_MAX;
+  }
+  remaining = (remaining + 255) >> 8;
+  if (remaining > 0xFFFF)
+  {
+    remaining = 0xFFFF;
+  }
+
+  move_ptr = &MoveRing[MoveIn];
+  move_ptr->id_elapsed = ((uint16_t)id << MOVE_ID_SHIFT) | elapsed;
+  move_ptr->remaining = remaining;
+  MoveIn++;
+  if (MoveIn == MOVE_LOG_SIZE)
+  {
+    MoveIn = 0;
+  }
+  if (MoveCount < MOVE_LOG_SIZE)
+  {
+    MoveCount++;
+  }
+  if (Unsaved < 255)
+  {
+    Unsaved++;
+  }
+}
+
+void log_move(uint8_t id, uint8_t moved, const TickTimeType * time_ptr)
+{
+  uint16_t tick;
+  tick = time_tick(time_ptr);
+  if (moved)
+  {
+    add_move(id, tick - TurnTick[id / 2], time_control_remaining(id));
+  }
+  TurnTick[id / 2] = tick;
+}
+
+void log_flag(uint8_t id)
+{
+  add_move(id, timer_ticks() - TurnTick[id / 2], 0);
+}
+
+uint8_t read_move_log(uint8_t n, MoveType * move_ptr)
+{
+  int16_t index;
+  if (n >= MoveCount)
+  {
+    return 0;
+  }
+  index = (int16_t)MoveIn - MoveCount + n;
+  if (index < 0)
+  {
+    index += MOVE_LOG_SIZE;
+  }
+  *move_ptr = MoveRing[index];
+  return 1;
+}
+
+#if MOVE_LOG_EEPROM_SIZE > 0
+
+static void write_move(uint16_t addr, const MoveType * move_ptr)
+{
+  write_eeprom(addr, move_ptr->id_elapsed);
+  write_eeprom(addr + 1, move_ptr->id_elapsed >> 8);
+  write_eeprom(addr + 2, move_ptr->remaining);
+  write_eeprom(addr + 3, move_ptr->remaining >> 8);
+}
+
+static void read_move(uint16_t addr, MoveType * move_ptr)
+{
+  move_ptr->id_elapsed = read_eeprom(addr) | ((uint16_t)read_eeprom(addr + 1) << 8);
+  move_ptr->remaining = read_eeprom(addr + 2) | ((uint16_t)read_eeprom(addr + 3) << 8);
+}
+
+/* Keeps the latest moves that fit. The count is cleared while they are written, so a save
+   that is cut short leaves no moves rather than a mixture of two games. It only happens once
+   a game, and write_eeprom() skips bytes that have not changed, so wear is slight */
+void save_move_log(void)
+{
+  uint8_t count;
+  uint8_t skip;
+  uint8_t n;
+  MoveType move;
+
+  if (Unsaved == 0)
+  {
+    return;
+  }
+  count = MoveCount;
+  skip = 0;
+  if (count > SAVED_MOVES)
+  {
+    skip = count - SAVED_MOVES;
+    count = SAVED_MOVES;
+  }
+  write_eeprom(MOVE_LOG_START, 0);
+  for (n = 0; (n < count) && read_move_log(skip + n, &move); n++)
+  {
+    write_move(MOVE_LOG_START + 1 + n * sizeof(MoveType), &move);
+  }
+  write_eeprom(MOVE_LOG_START, count);
+  Unsaved = 0;
+}
+
+#else
+
+void save_move_log(void)
+{
+}
+
+#endif /* MOVE_LOG_EEPROM_SIZE */
+
+static void dump_move(const MoveType * move_ptr)
+{
+  dump_number(move_id(move_ptr), 10);
+  dump_char(' ');
+  dump_number(move_elapsed(move_ptr), 10);
+  dump_char(' ');
+  dump_number(move_ptr->remaining, 10);
+  dump_string_P("\r\n");
+}
+
+/* Dump format, one line each:
+     MOVES <number of moves> OF <moves the ring holds>
+     <countdown id> <elapsed ticks> <remaining in 256ms>   for each move, oldest first
+     SAVED <number of moves> OF <moves the EEPROM holds>   with MOVE_LOG_EEPROM_SIZE, then the
+     <countdown id> <elapsed ticks> <remaining in 256ms>   moves of the last game saved
+     END */
+void dump_move_log(void)
+{
+  uint8_t n;
+  MoveType move;
+
+  begin_dump();
+  dump_string_P("MOVES ");
+  dump_number(MoveCount, 10);
+  dump_string_P(" OF ");
+  dump_number(MOVE_LOG_SIZE, 10);
+  dump_string_P("\r\n");
+  for (n = 0; read_move_log(n, &move); n++)
+  {
+    dump_move(&move);
+  }
+#if MOVE_LOG_EEPROM_SIZE > 0
+  {
+    uint8_t count;
+    count = read_eeprom(MOVE_LOG_START);
+    if (count > SAVED_MOVES)
+    {
+      count = 0;
+    }
+    dump_string_P("SAVED ");
+    dump_number(count, 10);
+    dump_string_P(" OF ");
+    dump_number(SAVED_MOVES, 10);
+    dump_string_P("\r\n");
+    for (n = 0; n < count; n++)
+    {
+      read_move(MOVE_LOG_START + 1 + n * sizeof(MoveType), &move);
+      dump_move(&move);
+    }
+  }
+#endif
+  dump_string_P("END\r\n");
+  end_dump();
+}
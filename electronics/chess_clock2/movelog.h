@@ -0,0 +1,65 @@
+/*
+ * movelog.h
+ *
+ * A record of the moves of the game, for the arbiter. Each end of turn goes into a ring in RAM,
+ * which a long push of DOWN, once the game is won or while it is paused, sends out of PD3
+ * through serial.c (dump.h), as text that host/moves.py turns into a table. Built with
+ * MOVE_LOG_EEPROM_SIZE (make MOVE_LOG_EEPROM_SIZE=n), the log of each game is also saved to
+ * that many bytes of EEPROM when it ends, and sent after the ring. Needs timer.h
+ *
+ * The ring has what RAM is left once the stack has STACK_MARGIN (192) bytes of the 1K, which
+ * 'make stats' checks with avr-size. Counted from the sources, the rest of the static data
+ * comes to about 600 bytes, and the deepest stack about 150: checkpoint_game() under
+ * input_long_push(), with a CheckpointType (30 bytes) and a snapshot (18) on the stack and
+ * the EEPROM queue below it, and the timer interrupt on top
+ *
+ * That is room for only the last 48 moves of a game, 24 a side, and the last 8 (4 a side) in a
+ * TRACE or PROFILE build. Earlier moves drop out of the ring, so the log covers the end of a
+ * game, not the whole of it, and the dump gives the size of the ring after the number of moves
+ * so that a full log can be told from a short game. The EEPROM copy is as short, with
+ * (MOVE_LOG_EEPROM_SIZE - 1) / 4 moves
+ */
+
+#ifndef MOVE_LOG_SIZE
+#if defined(TRACE) || defined(PROFILE)
+#define MOVE_LOG_SIZE 8    /* the trace or the profile has the RAM */
+#else
+#define MOVE_LOG_SIZE 48   /* 24 moves each, in 192 bytes */
+#endif
+#endif
+
+/* Packed into 4 bytes */
+typedef struct
+{
+  uint16_t id_elapsed;  /* countdown id in the top 2 bits, and the ticks from the start of the
+                           turn to the press that ended it in the rest, at most 0x3FFF */
+  uint16_t remaining;   /* after the move, before any bonus, in units of 256ms rounded up, so
+                           that it is only 0 when the flag has fallen. The part of a US delay
+                           that was not used is not counted (time_control_remaining()) */
+} MoveType;
+
+#define MOVE_ID_SHIFT    14
+#define MOVE_ELAPSED_MAX 0x3FFF
+#define move_id(move_ptr)      ((move_ptr)->id_elapsed >> MOVE_ID_SHIFT)
+#define move_elapsed(move_ptr) ((move_ptr)->id_elapsed & MOVE_ELAPSED_MAX)
+
+/* Empties the log for a new game */
+void clear_move_log(void);
+
+/* Records the end of a turn on countdown id, by a press at the given time, and starts timing
+   the turn of the other player. If moved is 0 the press started the game, and only does that.
+   Takes the same time whatever is in the log */
+void log_move(uint8_t id, uint8_t moved, const TickTimeType * time_ptr);
+
+/* Records that the flag of countdown id has fallen */
+void log_flag(uint8_t id);
+
+/* Gets the nth move still in the log, oldest first. Returns 0 if there is no such move */
+uint8_t read_move_log(uint8_t n, MoveType * move_ptr);
+
+/* Saves the log to EEPROM, if it is built with MOVE_LOG_EEPROM_SIZE and there are moves
+   that have not been saved */
+void save_move_log(void);
+
+/* Sends the log */
+void dump_move_log(void);
@@ -0,0 +1,134 @@
+/*
+ * profile.c
+ */
+
+#ifdef PROFILE
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include "profile.h"
+#include "dump.h"
+
+/* Timer 0 interrupts every SAMPLE_PERIOD_COUNTS counts of 8us. That is a prime number,
+   so the samples do not keep landing at the same point of the timer 2 ticks.
+   Timer 0 stops in power save mode, so only time that the CPU is awake is sampled.
+   Interrupt handlers cannot be interrupted, so their time shows up in the code that
+   runs just after them.
+   Timer 0 runs freely for isr_end() (timer.h), so rather than set the top of the count
+   the handler moves compare match A on by the period each time. */
+#define SAMPLE_PERIOD_COUNTS 251
+
+/* One count for each 128 bytes of the 8K of flash, in 128 bytes of RAM, which is what is left
+   with the move log of a profile build (movelog.h) */
+#define BUCKET_SHIFT 7
+#define NUM_BUCKETS  ((8192 >> BUCKET_SHIFT))
+static volatile uint16_t ProfileCounts[NUM_BUCKETS];
+
+void init_profile(void)
+{
+  /* init_timer() has set timer 0 going */
+  OCR0A = TCNT0 + SAMPLE_PERIOD_COUNTS;
+  TIFR0 = (1<<OCF0A);
+  TIMSK0 |= (1<<OCIE0A);              /* Interrupt on output compare match A */
+}
+
+/* Dump format, one line each:
+     PROFILE <bytes per bucket>
+     <first address of bucket, hex> <samples>   for each bucket with samples
+     END */
+void dump_profile(void)
+{
+  uint8_t bucket;
+  uint16_t count;
+
+  begin_dump();
+  dump_string_P("PROFILE ");
+  dump_number(1 << BUCKET_SHIFT, 10);
+  dump_string_P("\r\n");
+  for (bucket = 0; bucket < NUM_BUCKETS; bucket++)
+  {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+      count = ProfileCounts[bucket];
+    }
+    if (count != 0)
+    {
+      dump_number((uint16_t)bucket << BUCKET_SHIFT, 16);
+      dump_char(' ');
+      dump_number(count, 10);
+      dump_string_P("\r\n");
+    }
+  }
+  dump_string_P("END\r\n");
+  end_dump();
+}
+
+/* Interrupt handler for timer 0 compare match A, to count a sample in the bucket
+   of the return address. Written in assembler to touch as few registers as it can.
+   By hand it is 61 cycles, or 58 when the count is full, and 7 more to get into it */
+ISR(TIMER0_COMPA_vect, ISR_NAKED)
+{
+  __asm__ __volatile__ (
+    "push r24"                       "\n\t"
+    "in   r24, __SREG__"             "\n\t"
+    "push r24"                       "\n\t"
+    "push r25"                       "\n\t"
+    "push r30"                       "\n\t"
+    "push r31"                       "\n\t"
+
+    /* The next sample, as adding the period is taking away 256 less it */
+    "in   r24, %[ocr]"               "\n\t"
+    "subi r24, %[minus_period]"      "\n\t"
+    "out  %[ocr], r24"               "\n\t"
+
+    /* The return address is a word address, high byte first, above the 5 bytes pushed */
+    "in   r30, __SP_L__"             "\n\t"
+    "in   r31, __SP_H__"             "\n\t"
+    "ldd  r25, Z+6"                  "\n\t"
+    "ldd  r24, Z+7"                  "\n\t"
+
+    /* A 128 byte bucket is 64 words, so the word address / 32 is the offset of its count */
+    "lsr  r25"                       "\n\t"
+    "ror  r24"                       "\n\t"
+    "lsr  r25"                       "\n\t"
+    "ror  r24"                       "\n\t"
+    "lsr  r25"                       "\n\t"
+    "ror  r24"                       "\n\t"
+    "lsr  r25"                       "\n\t"
+    "ror  r24"                       "\n\t"
+    "lsr  r25"                       "\n\t"
+    "ror  r24"                       "\n\t"
+    "andi r24, 0xFE"                 "\n\t"
+    "ldi  r30, lo8(%[counts])"       "\n\t"
+    "ldi  r31, hi8(%[counts])"       "\n\t"
+    "add  r30, r24"                  "\n\t"
+    "adc  r31, r25"                  "\n\t"
+
+    /* Count it, unless the count is full */
+    "ld   r24, Z"                    "\n\t"
+    "ldd  r25, Z+1"                  "\n\t"
+    "adiw r24, 1"                    "\n\t"
+    "breq 1f"                        "\n\t"
+    "st   Z, r24"                    "\n\t"
+    "std  Z+1, r25"                  "\n\t"
+    "1:"                             "\n\t"
+
+    "pop  r31"                       "\n\t"
+    "pop  r30"                       "\n\t"
+    "pop  r25"                       "\n\t"
+    "pop  r24"                       "\n\t"
+    "out  __SREG__, r24"             "\n\t"
+    "pop  r24"                       "\n\t"
+    "reti"                           "\n\t"
+    :
+    : [counts] "i" (ProfileCounts),
+      [ocr] "I" (_SFR_IO_ADDR(OCR0A)),
+      [minus_period] "M" ((uint8_t)-SAMPLE_PERIOD_COUNTS)
+  );
+}
+
+#endif /* PROFILE */
@@ -0,0 +1,13 @@
+/*
+ * profile.h
+ *
+ * Sampling profiler, only built in with PROFILE defined (make PROFILE=1)
+ */
+
+/* Starts sampling where the program is, with timer 0 */
+void init_profile(void);
+
+/* Sends the samples so far (dump.h), as text that host/profile.py turns into a profile.
+   It holds up the main loop, so the clock only asks for it once the game is won or while
+   it is paused */
+void dump_profile(void);
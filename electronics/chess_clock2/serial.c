@@ -6,69 +6,105 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/atomic.h>
+#include "timer.h"
 #include "serial.h"
+#include "eeprom.h"
 
-#define BUFSIZE 64
+/* In multi-processor mode the receiver only hears addresses, which do not go in the queue,
+   so the receive queue is kept small for the RAM */
+#define RX_BUFSIZE 8
+#define TX_BUFSIZE 64
 
-static char rx_buffer[BUFSIZE];
-static char tx_buffer[BUFSIZE];
+static char rx_buffer[RX_BUFSIZE];
+static char tx_buffer[TX_BUFSIZE];
 
 static uint8_t rx_errors;
-static uint8_t rx_in;
+static volatile uint8_t rx_in;
 static uint8_t rx_out;
 static uint8_t tx_in;
-static uint8_t tx_out;
+static volatile uint8_t tx_out;
 
-/* Not for 2x mode */
-#define NORMAL_ASYNC_BRR_FOR_BAUD(baud) ((F_CPU / (16L * (baud))) - 1)
+/* Set while a transmitter is on, from the first byte queued until the last one has gone */
+volatile uint8_t __serial_tx_on;
 
-void init_serial(void)
+/* Read from the EEPROM by init_serial() on a bus */
+uint8_t __serial_bus_address = SERIAL_NO_ADDRESS;
+
+/* Set when the bus master has polled this clock, until take_serial_poll() */
+static volatile uint8_t Polled;
+
+#define SERIAL_BAUD 9600
+#define DOUBLE_SPEED_BRR_FOR_BAUD(baud) (((F_CPU + 4L * (baud)) / (8L * (baud))) - 1)
+
+/* The software transmitter sends a bit in each timer 0 compare match B, SOFT_BIT_COUNTS
+   counts of 8us apart: 832us, within 0.2% of 1200 baud. The handler is the only thing that
+   writes PD3, and the rest of port D is only written with sbi and cbi or by other handlers,
+   so no read-modify-write can undo it. An edge is late by as long as the handler waits for
+   another to finish, and the receiver samples the middle of each bit, so a wait of up to
+   about 400 cycles does no harm. Each bit takes an interrupt, a few percent of the CPU */
+#define SOFT_BIT_COUNTS ((F_CPU / 8 + SERIAL_SOFT_BAUD / 2) / SERIAL_SOFT_BAUD)
+#define SOFT_STOP_BIT   9
+
+static uint8_t soft_tx_bit;    /* 0 for the start bit of the next byte, then the 8 data bits, then the stop bit */
+static uint8_t soft_tx_shift;  /* the data bits still to send */
+
+#ifdef BUS_BOARD
+/* Powers the USART up for a bus at 9600 baud in double speed mode, as the error at 1MHz is
+   7% in normal mode. Frames are 9N1, where the ninth bit marks an address, and
+   multi-processor mode has the receiver ignore every frame that is not one */
+static void power_up(void)
 {
-  UCSR0B = (0<<RXCIE0)  /* disable receive interrupt */
-         | (0<<TXCIE0)  /* disable transmit complete interrupt */
-         | (0<<UDRIE0)  /* disable transmit data register empty interrupt */
-         | (1<<TXEN0)   /* enable transmitter */
-         | (1<<RXEN0)   /* enable receiver */
-         | (0<<UCSZ02)  /* with UCSZ00 and UCSZ01 below, set the character size to 7 bits */
-         | (0<<RXB80)   /* Don't care about the 9th RX bit */
-         | (0<<TXB80);  /* Don't care about the 9th TX bit */
+  PRR &= ~(1<<PRUSART0);
+  UBRR0 = DOUBLE_SPEED_BRR_FOR_BAUD(SERIAL_BAUD);
+  UCSR0A = (1<<U2X0) | (1<<MPCM0);
   UCSR0C = (0<<UMSEL01) | (0<<UMSEL00) /* asynchronous mode */
-         | (1<<UPM01) | (1<<UPM00)     /* odd parity */
+         | (0<<UPM01) | (0<<UPM00)     /* no parity */
          | (0<<USBS0)                  /* 1 stop bit */
-         | (1<<UCSZ01) | (0<<UCSZ00)   /* see above */
+         | (1<<UCSZ01) | (1<<UCSZ00)   /* with UCSZ02 in UCSR0B, 9 bits */
          | (0<<UCPOL0);                /* Must be set to zero in asynchronous mode */
-  UBRR0 = NORMAL_ASYNC_BRR_FOR_BAUD(2400);
-  DDRD &= 1<<PD0;
-  DDRD |= 1<<PD1;
-  UDR0 = 0xAA;
-  while ( !( UCSR0A & (1<<UDRE0)) ) ;
-  UDR0 = 0x55;
 }
+#endif
 
-void poll_serial(void)
+/* Starts the transmitter. On a bus that is the USART, which is already listening. Off a bus
+   it is the software transmitter, whose first interrupt comes a couple of counts later.
+   Must be called with interrupts disabled */
+static void start_transmitter(void)
 {
-  if ((tx_in != tx_out) && ((UCSR0A & (1<<UDRE0)) != 0))
+  if (serial_on_bus())
   {
-    UDR0 = tx_buffer[tx_out];
-    tx_out = (tx_out + 1) % BUFSIZE;
+    UCSR0B |= (1<<UDRIE0) | (1<<TXEN0);
   }
-  if (((UCSR0A & (1<<RXC0)) != 0) && ((UCSR0A & (1<<FE0 | 1<<UPE0)) == 0))
+  else
   {
-    uint8_t next_rx_in;
-    next_rx_in = (rx_in + 1) % BUFSIZE;
-    if (next_rx_in != rx_out)
-    {
-      rx_buffer[rx_in] = UDR0;
-      rx_in = next_rx_in;
-    }
+    soft_tx_bit = 0;
+    TIFR0 = 1<<OCF0B;
+    OCR0B = TCNT0 + 2;
+    TIMSK0 |= 1<<OCIE0B;
   }
+  __serial_tx_on = 1;
+}
+
+void init_serial(void)
+{
+#ifdef BUS_BOARD
+  __serial_bus_address = read_eeprom(BUS_ADDRESS_ADDR);
+  power_up();
+  UCSR0B = (1<<RXCIE0) | (1<<RXEN0) | (1<<UCSZ02);
+#else
+  /* The line idles high */
+  PORTD |= 1<<SERIAL_SOFT_TX_BIT;
+  DDRD |= 1<<SERIAL_SOFT_TX_BIT;
+#endif
 }
 
 ISR(USART_RX_vect)
 {
   uint8_t status;
+  IsrStartType isr_start;
+  isr_begin(&isr_start);
   while (((status = UCSR0A) & (1<<RXC0)) != 0)
   {
+    uint8_t address = UCSR0B & (1<<RXB80);  /* must be read before UDR0 */
     char data = UDR0;
     if ((status & (1<<DOR0)) != 0)
     {
@@ -82,10 +118,18 @@ ISR(USART_RX_vect)
     {
       rx_errors |= PARITY_ERROR;
     }
+    else if (address)
+    {
+      if ((uint8_t)data == __serial_bus_address)
+      {
+        Polled = 1;
+        request_poll();
+      }
+    }
     else
     {
       uint8_t next_rx_in;
-      next_rx_in = (rx_in + 1) % BUFSIZE;
+      next_rx_in = (rx_in + 1) % RX_BUFSIZE;
       if (next_rx_in != rx_out)
       {
         rx_buffer[rx_in] = data;
@@ -97,6 +141,18 @@ ISR(USART_RX_vect)
       }
     }
   } /* while receiving characters */
+  isr_end(ISR_SERIAL_RX, &isr_start);
+}
+
+uint8_t take_serial_poll(void)
+{
+  uint8_t polled;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    polled = Polled;
+    Polled = 0;
+  }
+  return polled;
 }
 
 uint8_t read_rx_errors(void)
@@ -120,7 +176,7 @@ uint8_t serial_getc(void)
   else
   {
     c = rx_buffer[rx_out];
-    rx_out++;
+    rx_out = (rx_out + 1) % RX_BUFSIZE;
   }
   return c;
 }
@@ -137,28 +193,112 @@ void serial_puts(const char * s)
 void serial_putc(char c)
 {
   uint8_t next_tx_in;
-  next_tx_in = (tx_in+1)%BUFSIZE;
+  next_tx_in = (tx_in+1)%TX_BUFSIZE;
   if (next_tx_in != tx_out)
   {
     tx_buffer[tx_in] = c;
-    tx_in = next_tx_in;
     ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
     {
-      //UCSR0B |= 1<<UDRIE0;
+      tx_in = next_tx_in;
+      if (!__serial_tx_on)
+      {
+        start_transmitter();
+      }
+      else if (serial_on_bus())
+      {
+        UCSR0B |= 1<<UDRIE0;
+      }
     }
   }
 }
 
+uint8_t serial_tx_space(void)
+{
+  return (uint8_t)(tx_out - tx_in - 1) % TX_BUFSIZE;
+}
+
+void flush_serial(void)
+{
+  while (__serial_tx_on)
+  {
+  }
+}
+
+/* Sends the next byte. Once the queue is empty, waits for the last byte to go */
 ISR(USART_UDRE_vect)
 {
+  IsrStartType isr_start;
+  isr_begin(&isr_start);
   if (tx_in != tx_out)
   {
     UDR0 = tx_buffer[tx_out];
-    tx_out++;
+    tx_out = (tx_out + 1) % TX_BUFSIZE;
+  }
+  if (tx_in == tx_out)
+  {
+    UCSR0A |= 1<<TXC0;
+    UCSR0B = (UCSR0B & ~(1<<UDRIE0)) | (1<<TXCIE0);
+  }
+  isr_end(ISR_SERIAL_UDRE, &isr_start);
+}
+
+/* The last byte has gone, so let go of TXD for the other clocks on the bus. If more has been
+   queued since, the transmitter carries on instead */
+ISR(USART_TX_vect)
+{
+  IsrStartType isr_start;
+  isr_begin(&isr_start);
+  if (tx_in != tx_out)
+  {
+    UCSR0B &= ~(1<<TXCIE0);
   }
   else
   {
-    UCSR0B &= 1<<UDRIE0;
+    UCSR0B &= ~((1<<TXCIE0) | (1<<TXEN0));
+    __serial_tx_on = 0;
   }
+  isr_end(ISR_SERIAL_TX, &isr_start);
 }
 
+/* Sends the next bit of the software transmitter. Once the stop bit of the last byte in the
+   queue has had its time, turns itself off */
+ISR(TIMER0_COMPB_vect)
+{
+  IsrStartType isr_start;
+  isr_begin(&isr_start);
+  OCR0B += SOFT_BIT_COUNTS;
+  if (soft_tx_bit == 0)
+  {
+    if (tx_in == tx_out)
+    {
+      TIMSK0 &= ~(1<<OCIE0B);
+      __serial_tx_on = 0;
+    }
+    else
+    {
+      PORTD &= ~(1<<SERIAL_SOFT_TX_BIT);
+      soft_tx_shift = tx_buffer[tx_out];
+      tx_out = (tx_out + 1) % TX_BUFSIZE;
+      soft_tx_bit = 1;
+    }
+  }
+  else if (soft_tx_bit < SOFT_STOP_BIT)
+  {
+    if (soft_tx_shift & 1)
+    {
+      PORTD |= 1<<SERIAL_SOFT_TX_BIT;
+    }
+    else
+    {
+      PORTD &= ~(1<<SERIAL_SOFT_TX_BIT);
+    }
+    soft_tx_shift >>= 1;
+    soft_tx_bit++;
+  }
+  else
+  {
+    PORTD |= 1<<SERIAL_SOFT_TX_BIT;
+    soft_tx_bit = 0;
+  }
+  isr_end(ISR_SERIAL_BIT, &isr_start);
+}
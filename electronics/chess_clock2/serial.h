@@ -1,21 +1,66 @@
 /*
  * serial.h
+ *
+ * Interrupt-driven serial output. TXD is end-of-turn 1, whose lever holds the pin at ground
+ * whenever it is released, so the bytes go out of PD3 instead, at SERIAL_SOFT_BAUD 8N1, from a
+ * transmitter in software timed by timer 0. PD3 is not an input, so the inputs are not
+ * touched. Sleep must not go deeper than idle while serial_busy(), as timer 0 and the USART
+ * stop in power save
+ *
+ * Built with BUS_BOARD, the clock is one of up to 255 on a multi-drop bus instead, at the
+ * address in the EEPROM (BUS_ADDRESS_ADDR in eeprom.h). This board has E of the LCD on RXD and
+ * end-of-turn 1 on TXD, so the bus needs a board of its own, on which PD0 and PD1 are only RXD
+ * and TXD: RW of the LCD is tied low and its pin, PC5, is E (lcd.h), and end-of-turn 1 is on
+ * PD3 (input.c), which leaves no pin for the software transmitter. RXD of every clock is on
+ * the line from the master, and TXD of every clock onto the line back, through a diode each or
+ * a transceiver. The master sends the address of a clock as a frame with the ninth bit set,
+ * and only that clock answers, with its telemetry frame (telemetry.h) in frames with the ninth
+ * bit clear. A clock with no address listens, but is never polled. Only the clock that is
+ * answering enables its transmitter, so only it drives TXD. The USART stays powered to listen,
+ * in multi-processor mode, so that only addresses wake a clock, and not the answers of the
+ * others where the two lines are one
  */
 
+#define SERIAL_SOFT_BAUD   1200
+#define SERIAL_SOFT_TX_BIT PD3  /* of port D */
+
 #define FRAMING_ERROR  1
 #define PARITY_ERROR   2
 #define UART_FIFO_FULL 4
 #define SW_FIFO_FULL   8
 
+#define SERIAL_NO_ADDRESS 0xFF
+
+extern volatile uint8_t __serial_tx_on;
+extern uint8_t __serial_bus_address;
+
+#ifdef BUS_BOARD
+#define serial_on_bus() 1
+#else
+#define serial_on_bus() 0
+#endif
+
+#define serial_busy() ((__serial_tx_on != 0) || serial_on_bus())
+
+/* Sets up the software transmitter, or on a bus reads the address from the EEPROM and starts
+   listening */
 void init_serial(void);
 
-void poll_serial(void);
+/* Returns non-zero once after the bus master has polled this clock */
+uint8_t take_serial_poll(void);
 
 void serial_puts(const char * s);
 
+/* Queues a byte to send, starting the transmitter if it is off. The byte is dropped if the
+   queue is full */
 void serial_putc(char c);
 
+/* Bytes that can be queued without any being dropped */
+uint8_t serial_tx_space(void);
+
+/* Waits until everything queued has gone and the transmitter is off. Interrupts must be enabled */
+void flush_serial(void);
+
 uint8_t serial_getc(void);
 
 uint8_t read_rx_errors(void);
-
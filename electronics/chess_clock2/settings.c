@@ -0,0 +1,214 @@
+/*
+ * settings.c
+ */
+
+#include <stdint.h>
+#include <util/crc16.h>
+
+#include "settings.h"
+#include "eeprom.h"
+#include "timer.h"
+#include "timecontrols.h"
+#include "timecontrol.h"
+
+/* The settings are kept in EEPROM as a log of records, each saved into the slot after the last one.
+   That spreads the wear over all of the slots. A record is only written over when it is
+   the oldest, so a save that is cut short by a power failure leaves the previous record intact,
+   and its CRC shows that it is not to be used.
+
+   Record layout:
+     0    version of the record format
+     1    sequence number, one more than that of the previous record
+     2..  settings
+     then the CRC-CCITT of all of the above, low byte first
+
+   Firmware before the log kept the minutes and seconds of each countdown in bytes 0 to 7,
+   and nothing else in the EEPROM. Until there is a record, the settings are taken from there */
+#define RECORD_SIZE 16
+#define NUM_SLOTS   (SETTINGS_LOG_SIZE / RECORD_SIZE)
+
+#define SETTINGS_VERSION 1
+
+#define RECORD_VERSION   0
+#define RECORD_SEQUENCE  1
+#define RECORD_SETTINGS  2
+#define RECORD_CRC       (RECORD_SETTINGS + sizeof(SettingsType))
+
+typedef struct
+{
+  uint8_t minutes[NUM_COUNTDOWNS];
+  uint8_t seconds[NUM_COUNTDOWNS];
+  uint8_t control;  /* time control */
+} SettingsType;
+
+static SettingsType Settings;
+static uint8_t changed;
+static uint8_t last_slot;
+static uint8_t last_sequence;
+
+static uint16_t slot_addr(uint8_t slot)
+{
+  return SETTINGS_LOG_START + (uint16_t)slot * RECORD_SIZE;
+}
+
+/* Reads the record in a slot into settings_ptr.
+   Returns non-zero if it is a valid record */
+static uint8_t read_record(uint8_t slot, SettingsType * settings_ptr)
+{
+  uint16_t addr;
+  uint16_t crc;
+  uint8_t i;
+  uint8_t value;
+
+  addr = slot_addr(slot);
+  if (read_eeprom(addr + RECORD_VERSION) != SETTINGS_VERSION)
+  {
+    return 0;
+  }
+
+  crc = 0xFFFF;
+  for (i = 0; i < RECORD_CRC; i++)
+  {
+    value = read_eeprom(addr + i);
+    crc = _crc_ccitt_update(crc, value);
+    if (i >= RECORD_SETTINGS)
+    {
+      ((uint8_t *)settings_ptr)[i - RECORD_SETTINGS] = value;
+    }
+  }
+  return (read_eeprom(addr + RECORD_CRC) == (uint8_t)crc) &&
+         (read_eeprom(addr + RECORD_CRC + 1) == (uint8_t)(crc >> 8));
+}
+
+/* Loads the valid record with the latest sequence number. Returns non-zero if there is one.
+   There are fewer slots than sequence numbers, so the latest is the one
+   that is ahead of all of the others */
+static uint8_t load_latest(void)
+{
+  uint8_t slot;
+  uint8_t sequence;
+  uint8_t found;
+  SettingsType record;
+
+  found = 0;
+  for (slot = 0; slot < NUM_SLOTS; slot++)
+  {
+    if (read_record(slot, &record))
+    {
+      sequence = read_eeprom(slot_addr(slot) + RECORD_SEQUENCE);
+      if ((!found) || ((int8_t)(sequence - last_sequence) > 0))
+      {
+        found = 1;
+        Settings = record;
+        last_slot = slot;
+        last_sequence = sequence;
+      }
+    }
+  } /* end for all slots */
+  return found;
+}
+
+void init_settings(void)
+{
+  uint8_t id;
+
+  changed = 0;
+  if (!load_latest())
+  {
+    /* The first save goes into slot 1, so that bytes 0 to 7 are not written over until
+       there is a record to take their place */
+    last_slot = 0;
+    last_sequence = 0;
+
+    for (id = 0; id < NUM_COUNTDOWNS; id++)
+    {
+      Settings.minutes[id] = read_eeprom(id * 2);
+      Settings.seconds[id] = read_eeprom(id * 2 + 1);
+      if (Settings.minutes[id] > 99)
+      {
+        Settings.minutes[id] = 10; /* a sensible arbitrary default */
+      }
+      if (Settings.seconds[id] > 59)
+      {
+        Settings.seconds[id] = 0; /* a sensible arbitrary default */
+      }
+    }
+    Settings.control = 0;
+    changed = 1;
+    save_settings();
+  }
+  else if (Settings.control >= NUM_TIME_CONTROLS)
+  {
+    Settings.control = 0;
+  }
+}
+
+void settings_time(uint8_t id, uint8_t * minutes_ptr, uint8_t * seconds_ptr)
+{
+  *minutes_ptr = Settings.minutes[id];
+  *seconds_ptr = Settings.seconds[id];
+}
+
+void set_settings_time(uint8_t id, uint8_t minutes, uint8_t seconds)
+{
+  if ((Settings.minutes[id] != minutes) || (Settings.seconds[id] != seconds))
+  {
+    Settings.minutes[id] = minutes;
+    Settings.seconds[id] = seconds;
+    changed = 1;
+  }
+}
+
+uint8_t settings_control(void)
+{
+  return Settings.control;
+}
+
+void set_settings_control(uint8_t control)
+{
+  if (Settings.control != control)
+  {
+    Settings.control = control;
+    changed = 1;
+  }
+}
+
+void save_settings(void)
+{
+  uint16_t addr;
+  uint16_t crc;
+  uint8_t i;
+  uint8_t value;
+
+  if (!changed)
+  {
+    return;
+  }
+
+  last_slot = (last_slot + 1) % NUM_SLOTS;
+  last_sequence++;
+
+  /* The bytes are written in order, so the CRC is written last */
+  addr = slot_addr(last_slot);
+  crc = 0xFFFF;
+  for (i = 0; i < RECORD_CRC; i++)
+  {
+    if (i == RECORD_VERSION)
+    {
+      value = SETTINGS_VERSION;
+    }
+    else if (i == RECORD_SEQUENCE)
+    {
+      value = last_sequence;
+    }
+    else
+    {
+      value = ((const uint8_t *)&Settings)[i - RECORD_SETTINGS];
+    }
+    crc = _crc_ccitt_update(crc, value);
+    write_eeprom(addr + i, value);
+  }
+  write_eeprom(addr + RECORD_CRC, (uint8_t)crc);
+  write_eeprom(addr + RECORD_CRC + 1, (uint8_t)(crc >> 8));
+  changed = 0;
+}
@@ -0,0 +1,21 @@
+/*
+ * settings.h
+ */
+
+/* Loads the settings from EEPROM into RAM. Needs to be called before the other functions */
+void init_settings(void);
+
+/* Gets the starting time of a countdown, from the copy of the settings in RAM */
+void settings_time(uint8_t id, uint8_t * minutes_ptr, uint8_t * seconds_ptr);
+
+/* Changes the starting time of a countdown in RAM. save_settings() stores it */
+void set_settings_time(uint8_t id, uint8_t minutes, uint8_t seconds);
+
+/* Gets the time control (see timecontrol.h) */
+uint8_t settings_control(void);
+
+/* Changes the time control in RAM. save_settings() stores it */
+void set_settings_control(uint8_t control);
+
+/* Appends the settings to the log in EEPROM, if they have changed since they were loaded or saved */
+void save_settings(void);
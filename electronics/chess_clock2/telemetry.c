@@ -0,0 +1,158 @@
+/*
+ * telemetry.c
+ */
+
+#ifdef TELEMETRY
+
+#include <stdint.h>
+#include <util/crc16.h>
+
+#include "timer.h"
+#include "serial.h"
+#include "clock.h"
+#include "telemetry.h"
+
+/* A key frame every so many frames, about every 16 seconds while the seconds are being sent.
+   A power of two, so that the key frames keep their place in SEQ as it wraps */
+#define KEY_INTERVAL 16
+
+/* Frames are at least a second apart. The tick that is under way counts as one of these,
+   so the wait is 8 to 9 ticks of 128ms */
+#define FRAME_INTERVAL_TICKS 9
+
+/* SOF, LEN, the bytes that LEN counts and the CRC */
+#define MAX_FRAME (2 + TELEMETRY_MAX_LEN + 2)
+
+static uint8_t Sequence;
+static volatile uint8_t HoldingOff;  /* a frame has gone in the last second */
+
+static uint8_t SentState = 0xFF;  /* so that the first poll sends a frame */
+static uint8_t SentTurn;
+static uint32_t KeySeconds[NUM_COUNTDOWNS];   /* as sent in the last key frame */
+static uint32_t SentSeconds[NUM_COUNTDOWNS];  /* as at the last frame */
+
+/* SentSeconds in milliseconds, the bottom of the range of remaining times that shows them */
+static uint32_t SentLow[NUM_COUNTDOWNS];
+
+void poll_telemetry(void)
+{
+  CountdownSnapshotType snapshot;
+  uint8_t frame[MAX_FRAME];
+  uint8_t length;
+  uint8_t state;
+  uint8_t turn;
+  uint8_t changed;
+  uint8_t mask;
+  uint8_t id;
+  uint8_t i;
+  uint16_t crc;
+
+  if (serial_on_bus())
+  {
+    if (!take_serial_poll())
+    {
+      return;
+    }
+  }
+  else if (HoldingOff)
+  {
+    return;
+  }
+
+  snapshot_countdowns(&snapshot);
+  state = clock_mode();
+  turn = (snapshot.expired << 4) | snapshot.running;
+
+  /* Comparing with the range sent takes no division, as most polls have nothing to send */
+  changed = 0;
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    if ((snapshot.remaining[id] < SentLow[id]) || (snapshot.remaining[id] >= SentLow[id] + 1000))
+    {
+      changed |= 1<<id;
+    }
+  }
+  if (!serial_on_bus() && (turn == SentTurn) && (state == SentState) && (changed == 0))
+  {
+    return;
+  }
+  if (serial_tx_space() < MAX_FRAME)
+  {
+    return;
+  }
+
+  if ((Sequence % KEY_INTERVAL) == 0)
+  {
+    state |= TELEMETRY_KEY;
+  }
+
+  length = 0;
+  frame[length++] = TELEMETRY_SOF;
+  frame[length++] = 0;  /* LEN, filled in below */
+  frame[length++] = Sequence++;
+  frame[length++] = state;
+  frame[length++] = turn;
+  frame[length++] = 0;  /* MASK, filled in below */
+  mask = 0;
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    uint32_t seconds;
+    int32_t delta;
+    if (changed & (1<<id))
+    {
+      SentSeconds[id] = snapshot.remaining[id] / 1000;
+      SentLow[id] = SentSeconds[id] * 1000;
+    }
+    seconds = SentSeconds[id];
+    if (state & TELEMETRY_KEY)
+    {
+      KeySeconds[id] = seconds;
+    }
+    delta = seconds - KeySeconds[id];
+    if ((state & TELEMETRY_KEY) || (delta < -128) || (delta > 127))
+    {
+      mask |= 0x11<<id;
+      frame[length++] = seconds;
+      frame[length++] = seconds >> 8;
+      frame[length++] = seconds >> 16;
+    }
+    else if (delta != 0)
+    {
+      mask |= 1<<id;
+      frame[length++] = delta;
+    }
+  }
+  frame[1] = length - 2;
+  frame[5] = mask;
+
+  crc = 0xFFFF;
+  for (i = 1; i < length; i++)
+  {
+    crc = _crc_ccitt_update(crc, frame[i]);
+  }
+  frame[length++] = crc;
+  frame[length++] = crc >> 8;
+
+  for (i = 0; i < length; i++)
+  {
+    serial_putc(frame[i]);
+  }
+
+  SentState = state & TELEMETRY_MODE_MASK;
+  SentTurn = turn;
+
+  if (!serial_on_bus())
+  {
+    HoldingOff = 1;
+    schedule_task(TELEMETRY_TASK, FRAME_INTERVAL_TICKS);
+  }
+}
+
+void process_telemetry(void)
+{
+  HoldingOff = 0;
+  disable_task(TELEMETRY_TASK);
+  request_poll();
+}
+
+#endif /* TELEMETRY */
@@ -0,0 +1,46 @@
+/*
+ * telemetry.h
+ *
+ * Broadcasts the state of the clock out of PD3, at 1200 8N1 (serial.h), as small binary frames
+ * for a PC that drives a display board. host/broadcast.py decodes them. Only built in with
+ * 'make TELEMETRY=1', or for the bus: each bit of a frame takes an interrupt, and the clock
+ * sleeps in idle rather than power save while a frame goes, so a clock that nobody listens
+ * to should not send them. A frame is
+ *
+ *   SOF    0xC5
+ *   LEN    bytes from SEQ to the last value
+ *   SEQ    frame number, counting on from 255 to 0
+ *   STATE  bits 1..0 the mode: 0 play, 1 won, 2 setup. Bit 7 set in a key frame
+ *   TURN   bits 3..0 the countdowns that are running, bits 7..4 those whose flag has fallen
+ *   MASK   bits 3..0 the countdowns that follow, bits 7..4 those of them that are absolute
+ *   values for each countdown in MASK, in order of id: the remaining time in whole seconds,
+ *          3 bytes low first if it is absolute, or else 1 signed byte, the change since the
+ *          last key frame
+ *   CRC    2 bytes low first, the CRC-16 of LEN to the last value, as _crc_ccitt_update()
+ *          from 0xFFFF
+ *
+ * A key frame, each one whose SEQ is a multiple of KEY_INTERVAL (16), has all of the
+ * countdowns as absolute values. The frames after it have each countdown whose whole seconds
+ * are not what the key frame had, so one of them and its key frame give the whole state: a
+ * receiver that misses a frame only loses what was in it, and one that misses a key frame
+ * waits for the next. In play a frame is usually about 10 bytes.
+ *
+ * A frame is sent whenever a countdown starts, stops or expires, the mode changes, or the
+ * seconds change, but no sooner than a second after the last frame. At 1200 baud a frame of
+ * 10 bytes takes 83ms, and a key frame 167ms.
+ *
+ * On a multi-drop bus (BUS_BOARD in serial.h), a frame is only sent in answer to a poll, at
+ * 9600 9N1, and one is always sent, even if nothing has changed
+ */
+
+#define TELEMETRY_SOF        0xC5
+#define TELEMETRY_KEY        0x80
+#define TELEMETRY_MODE_MASK  0x03
+#define TELEMETRY_MAX_LEN    16
+
+/* Sends a frame if there is something new to send, it is a second since the last one,
+   and there is room for it in the queue. On a bus, sends one if the clock has been polled */
+void poll_telemetry(void);
+
+/* Called by the timer interrupt once a second has passed since the last frame */
+void process_telemetry(void);
@@ -0,0 +1,290 @@
+/*
+ * timecontrol.c
+ */
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "timer.h"
+#include "timecontrol.h"
+#include "movelog.h"
+
+/* Each control is a program of stages, run one stage at a time as the moves are made.
+   A stage is an op byte followed by its operands:
+     op bits 1..0   BONUS_... for each move of the stage
+     op bit 2       TC_MOVES: a byte of the number of moves in the stage follows. Without it
+                    the stage lasts for the rest of the game, and is the last of the program
+     op bit 3       TC_TIME: the seconds added at the start of the stage follow, low byte first.
+                    Without it the first stage starts with the set time, and later ones add none
+     then the bonus in seconds, unless the op is BONUS_NONE
+   host/timecontrol.py compiles timecontrols.txt into timecontrols.h */
+#define TC_METHOD_MASK 0x03
+#define TC_MOVES       0x04
+#define TC_TIME        0x08
+#define TC_SECONDS(seconds) ((seconds) & 0xFF), ((seconds) >> 8)
+
+#define TIME_CONTROL_TABLES
+#include "timecontrols.h"
+
+typedef struct
+{
+  const prog_uint8_t * code_ptr;  /* the next stage */
+  uint8_t method;          /* bonus method of the current stage */
+  uint8_t bonus;           /* seconds */
+  uint8_t moves_left;      /* before the next stage, or 0 in the last */
+  uint8_t moves;
+  uint8_t delaying;        /* the delay has been added to the countdown and not yet used up */
+  uint8_t turn_residue;    /* countdown_residue() at the start of the turn */
+  uint32_t turn_start;     /* remaining time at the start of the turn */
+} PlayerType;
+
+static PlayerType Player[NUM_COUNTDOWNS];
+
+const char * time_control_name(uint8_t control)
+{
+  return TimeControlNames[control];
+}
+
+/* Runs the next stage of a player's program, and returns the seconds that it adds.
+   It has no loops and reads at most 5 bytes of program memory, so its time is bounded
+   whatever the control, and only spent when a stage starts. 'make bench' measures
+   pass_turn, which runs it */
+static uint16_t decode_stage(PlayerType * player_ptr)
+{
+  const prog_uint8_t * code_ptr;
+  uint8_t op;
+  uint16_t seconds;
+
+  code_ptr = player_ptr->code_ptr;
+  op = pgm_read_byte(code_ptr++);
+  player_ptr->method = op & TC_METHOD_MASK;
+  player_ptr->moves_left = 0;
+  if (op & TC_MOVES)
+  {
+    player_ptr->moves_left = pgm_read_byte(code_ptr++);
+  }
+  seconds = 0;
+  if (op & TC_TIME)
+  {
+    seconds = pgm_read_byte(code_ptr++);
+    seconds |= pgm_read_byte(code_ptr++) << 8;
+  }
+  player_ptr->bonus = 0;
+  if (player_ptr->method != BONUS_NONE)
+  {
+    player_ptr->bonus = pgm_read_byte(code_ptr++);
+  }
+  player_ptr->code_ptr = code_ptr;
+  return seconds;
+}
+
+/* Points a player at the start of a control's program */
+static void load_control(PlayerType * player_ptr, uint8_t control)
+{
+  player_ptr->code_ptr = &TimeControlCode[pgm_read_byte(&TimeControlStart[control])];
+  player_ptr->moves = 0;
+  player_ptr->delaying = 0;
+}
+
+void start_time_control(uint8_t id, uint8_t control, uint32_t set_remaining)
+{
+  PlayerType * player_ptr;
+  uint16_t seconds;
+  player_ptr = &Player[id];
+  load_control(player_ptr, control);
+  seconds = decode_stage(player_ptr);
+  if (seconds != 0)
+  {
+    set_remaining = seconds * 1000UL;
+  }
+  set_countdown_remaining(id, set_remaining);
+  player_ptr->turn_start = set_remaining;
+  player_ptr->turn_residue = 0;
+}
+
+void resume_time_control(uint8_t id, uint8_t control, uint8_t moves)
+{
+  PlayerType * player_ptr;
+  uint8_t left;
+  player_ptr = &Player[id];
+  load_control(player_ptr, control);
+  decode_stage(player_ptr);
+  player_ptr->moves = moves;
+  player_ptr->turn_start = countdown_remaining(id);
+  player_ptr->turn_residue = countdown_residue(id);
+
+  /* Find the stage that the moves have got to */
+  left = moves;
+  while ((player_ptr->moves_left != 0) && (left >= player_ptr->moves_left))
+  {
+    left -= player_ptr->moves_left;
+    decode_stage(player_ptr);
+  }
+  if (player_ptr->moves_left != 0)
+  {
+    player_ptr->moves_left -= left;
+  }
+}
+
+void resume_turn(uint8_t id, uint32_t turn_start)
+{
+  PlayerType * player_ptr;
+  player_ptr = &Player[id];
+  player_ptr->turn_start = turn_start;
+  player_ptr->delaying = (player_ptr->method == BONUS_DELAY);
+}
+
+/* Gives the player who has just moved their bonus, and moves them on to the next stage if
+   that was its last move. The countdown is stopped. A turn that the bonus gives back whole
+   also gets back the part of a millisecond that it counted, so that it costs exactly nothing
+   and the rounding of one turn does not carry into the next */
+static void end_move(uint8_t id)
+{
+  PlayerType * player_ptr;
+  uint32_t remaining;
+  int32_t bonus;
+  uint8_t given_back;
+
+  player_ptr = &Player[id];
+  remaining = countdown_remaining(id);
+  bonus = 0;
+  given_back = 0;
+  switch (player_ptr->method)
+  {
+  case BONUS_FISCHER:
+    bonus = player_ptr->bonus * 1000L;
+    break;
+  case BONUS_BRONSTEIN:
+    if (remaining < player_ptr->turn_start)
+    {
+      bonus = player_ptr->turn_start - remaining;
+      if (bonus > player_ptr->bonus * 1000L)
+      {
+        bonus = player_ptr->bonus * 1000L;
+      }
+      else
+      {
+        given_back = 1;
+      }
+    }
+    break;
+  case BONUS_DELAY:
+    /* Take back what is left of the delay */
+    if (player_ptr->delaying && (remaining > player_ptr->turn_start))
+    {
+      bonus = -(int32_t)(remaining - player_ptr->turn_start);
+      given_back = 1;
+    }
+    player_ptr->delaying = 0;
+    break;
+  default:
+    break;
+  }
+
+  if (player_ptr->moves < 255)
+  {
+    player_ptr->moves++;
+  }
+  if ((player_ptr->moves_left != 0) && (--player_ptr->moves_left == 0))
+  {
+    bonus += decode_stage(player_ptr) * 1000L;
+  }
+
+  if (bonus != 0)
+  {
+    add_countdown_remaining(id, bonus);
+  }
+  if (given_back)
+  {
+    set_countdown_residue(id, player_ptr->turn_residue);
+  }
+}
+
+/* Starts the turn of a player, whose countdown has just been started from remaining and
+   residue */
+static void begin_move(uint8_t id, uint32_t remaining, uint8_t residue)
+{
+  PlayerType * player_ptr;
+  player_ptr = &Player[id];
+  if (player_ptr->delaying)
+  {
+    /* Still in the turn that was paused */
+    return;
+  }
+  player_ptr->turn_start = remaining;
+  player_ptr->turn_residue = residue;
+  if (player_ptr->method == BONUS_DELAY)
+  {
+    /* Rather than hold the countdown back, which would take work in every tick, give it
+       the delay now and take back what is left of it when the move is made */
+    player_ptr->delaying = 1;
+    add_countdown_remaining(id, player_ptr->bonus * 1000L);
+  }
+}
+
+void pass_turn(uint8_t stop_id, uint8_t start_id, const TickTimeType * time_ptr)
+{
+  uint8_t moved;
+  uint8_t starting;
+  uint32_t start_remaining;
+  uint8_t start_residue;
+
+  /* The first press of the game, or a second press of the same input, is not a move */
+  moved = countdown_is_running(stop_id);
+  starting = !countdown_is_running(start_id);
+  start_remaining = countdown_remaining(start_id);
+  start_residue = countdown_residue(start_id);
+
+  switch_countdown(stop_id, start_id, time_ptr);
+  /* Logged before the bonus, but without what is left of a delay, which end_move() takes back */
+  if (moved || starting)
+  {
+    log_move(stop_id, moved, time_ptr);
+  }
+  if (moved)
+  {
+    end_move(stop_id);
+  }
+  if (starting)
+  {
+    begin_move(start_id, start_remaining, start_residue);
+  }
+}
+
+void stop_turn(uint8_t id)
+{
+  PlayerType * player_ptr;
+  uint32_t remaining;
+  player_ptr = &Player[id];
+  stop_countdown(id);
+  if (player_ptr->delaying)
+  {
+    remaining = countdown_remaining(id);
+    if (remaining > player_ptr->turn_start)
+    {
+      add_countdown_remaining(id, -(int32_t)(remaining - player_ptr->turn_start));
+    }
+    player_ptr->delaying = 0;
+  }
+}
+
+uint8_t time_control_moves(uint8_t id)
+{
+  return Player[id].moves;
+}
+
+uint32_t time_control_remaining(uint8_t id)
+{
+  uint32_t remaining;
+  remaining = countdown_remaining(id);
+  if (Player[id].delaying && (remaining > Player[id].turn_start))
+  {
+    remaining = Player[id].turn_start;
+  }
+  return remaining;
+}
+
+uint32_t time_control_turn_start(uint8_t id)
+{
+  return Player[id].turn_start;
+}
@@ -0,0 +1,53 @@
+/*
+ * timecontrol.h
+ *
+ * Time controls: how much time each player has, and how it is added to as they move.
+ * Needs timer.h. The controls themselves, and NUM_TIME_CONTROLS, are in timecontrols.h
+ */
+
+/* How a player is given time for each move */
+enum
+{
+  BONUS_NONE,
+  BONUS_FISCHER,    /* the bonus is added after each move */
+  BONUS_BRONSTEIN,  /* the time that the move took is added back after it, up to the bonus */
+  BONUS_DELAY,      /* the countdown only starts once the bonus has passed (US delay) */
+  NUM_BONUS_METHODS
+};
+
+/* Gets the name of a time control, in program memory, padded to the width of the display */
+const char * time_control_name(uint8_t control);
+
+/* Sets countdown id up for a new game under the given control. Stages with no time of their
+   own start with set_remaining, the time set up for the countdown, in milliseconds */
+void start_time_control(uint8_t id, uint8_t control, uint32_t set_remaining);
+
+/* Carries on with a game that was cut short after the given number of moves on countdown id,
+   which has already been set to its remaining time */
+void resume_time_control(uint8_t id, uint8_t control, uint8_t moves);
+
+/* Then carries on with the turn of countdown id, if it was the player to move, as it stood:
+   turn_start is what time_control_turn_start() gave, and any delay that has not been used
+   is still in the remaining time, to be taken back when the move is made */
+void resume_turn(uint8_t id, uint32_t turn_start);
+
+/* Ends the turn on one countdown and starts it on another, as at the given time (see
+   switch_countdown). The player who moved is given their bonus, and the time of the next stage
+   if they have made the moves of this one. Takes a bounded time whatever the control, a little
+   more on the move that starts a stage (see decode_stage()), and adds nothing to the tick
+   interrupt */
+void pass_turn(uint8_t stop_id, uint8_t start_id, const TickTimeType * time_ptr);
+
+/* Stops a countdown at the end of the game, taking back any delay that it has not used */
+void stop_turn(uint8_t id);
+
+/* Number of moves made on countdown id, up to 255 */
+uint8_t time_control_moves(uint8_t id);
+
+/* Remaining time to show, and to log, in milliseconds. During a delay it stays where it
+   was at the start of the turn */
+uint32_t time_control_remaining(uint8_t id);
+
+/* Remaining time at the start of the current turn of countdown id, without any delay, in
+   milliseconds. A Bronstein bonus and the end of a delay are worked out from it */
+uint32_t time_control_turn_start(uint8_t id);
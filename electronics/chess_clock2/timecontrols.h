@@ -0,0 +1,44 @@
+/*
+ * timecontrols.h
+ *
+ * Made from timecontrols.txt by host/timecontrol.py ('make timecontrols'). Do not edit
+ */
+
+#define NUM_TIME_CONTROLS 6
+
+#ifdef TIME_CONTROL_TABLES
+
+static const PROGMEM char TimeControlNames[NUM_TIME_CONTROLS][17] =
+{
+  "Sudden death    ",
+  "90m +30s        ",
+  "40/120m SD/30m  ",
+  "Fischer +5s     ",
+  "Bronstein 5s    ",
+  "US delay 5s     ",
+};
+
+static const prog_uint8_t TimeControlCode[] =
+{
+  /* 0: SD/T */
+  BONUS_NONE,
+  /* 1: SD/5400+30 */
+  TC_TIME|BONUS_FISCHER, TC_SECONDS(5400), 30,
+  /* 2: 40/7200, SD/1800 */
+  TC_MOVES|TC_TIME|BONUS_NONE, 40, TC_SECONDS(7200),
+  TC_TIME|BONUS_NONE, TC_SECONDS(1800),
+  /* 3: SD/T+5 */
+  BONUS_FISCHER, 5,
+  /* 4: SD/Tb5 */
+  BONUS_BRONSTEIN, 5,
+  /* 5: SD/Td5 */
+  BONUS_DELAY, 5,
+};
+
+/* Where each control starts in TimeControlCode */
+static const prog_uint8_t TimeControlStart[NUM_TIME_CONTROLS] =
+{
+  0, 1, 5, 12, 14, 16
+};
+
+#endif /* TIME_CONTROL_TABLES */
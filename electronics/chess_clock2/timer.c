@@ -12,35 +12,82 @@
 #include "audio.h"
 #include "turnled.h"
 #include "input.h"
+#include "telemetry.h"
+#include "trace.h"
 
 #define MULTIPLIER   16
 #define DIVISOR     125
 
+/* With a 1MHz clock and 1024 prescaling the timer counts at 976.5625 Hz,
+   so 125 counts make one tick of 128ms (7.8125 Hz, which is 125/16 Hz) */
+#define COUNTS_PER_TICK 125
+
+/* The timer is only 8 bits wide, so the compare match can be at most this many ticks ahead */
+#define MAX_HOP 2
+
 uint8_t __timer_timestamp;
+volatile uint8_t __timer_poll_requested;
 CountdownType Countdown[NUM_COUNTDOWNS];
 
 static uint8_t tasks;
+static uint16_t task_due[NUM_TASKS];
+
+static uint16_t ticks;     /* ticks processed by the interrupt handler */
+static uint8_t tick_base;  /* timer count at which the last processed tick ended */
+static uint8_t hop;        /* number of ticks from tick_base to OCR2A */
+static uint16_t isr_max[NUM_TIMED_ISRS];  /* longest run of each timed handler, in cycles */
+static uint8_t lost_ticks;      /* ticks that passed before the interrupt handler could run */
+#ifndef TRACE
+static uint8_t isr_exit_count;  /* timer count when TOV2 was last cleared */
+#endif
+
+#define MS_PER_TICK 128
+
+/* Changed whenever the ticks or the countdowns are. They are only ever changed with
+   interrupts disabled, so a reader with interrupts enabled sees either all of a change or
+   none of it: it reads the generation before and after, and tries again if they differ */
+static volatile uint8_t generation;
+#define changed() do { generation++; } while (0)
+
+/* The ticks and the countdowns are not volatile, so without this the compiler would be free
+   to read them before the first read of the generation or after the second */
+#define generation_barrier() asm volatile("" ::: "memory")
 
-static void process_countdown(void);
+/* The time up to which the countdowns have been charged */
+static uint16_t countdown_tick;
+static uint8_t countdown_count;    /* timer counts into countdown_tick */
+
+/* Kept out of line, as it would be inlined into its one caller, so that bench/bench.c can
+   count its cycles apart from the rest of the tick */
+static void process_countdown(void) __attribute__((noinline));
+static void update_countdowns(void);
+static void charge_countdowns(uint16_t tick, uint8_t count);
 
 void init_timer(void)
 {
   TCCR2A = (0<<COM2A1) | (0<<COM2A0) /* OC2A disconnected */
          | (0<<COM2B1) | (0<<COM2B0) /* OC2B disconnected */
-         | (1<<WGM21)  | (1<<WGM20); /* Together with WGM22: Fast PWM, OCR2A sets TOP */
+         | (0<<WGM21)  | (0<<WGM20); /* Together with WGM22: Normal mode, the timer runs freely */
   TCCR2B = (0<<FOC2A)                /* Don't force output compare 2A */
          | (0<<FOC2B)                /* Don't force output compare 2B */
-         | (1<<WGM22)                /* See above */
+         | (0<<WGM22)                /* See above */
          | (1<<CS22) | (1<<CS21) | (1<<CS20);  /* Prescaler divides by 1024 */
 
-  OCR2A = 124; /* With a 1MHz clock, and 1024 prescaling, in FAST PWM mode - this gives 7.8125 Hz
-                  That is 125/16.
-                  So to get seconds, we must multiply the number of interrupts by 16 and divide by 125.
-                  (249 gives 3.90625 Hz, which is 125/32 Hz) */
-
+  /* The ticks are marked by moving OCR2A on by COUNTS_PER_TICK for each tick,
+     or by a multiple of it to skip ticks in which no task is due.
+     Until a task is scheduled the timer interrupts are left off. */
   TIMSK2 = (0<<OCIE2B)              /* No interrupt from output compare match 2B */
-         | (0<<OCIE2A)              /* No interrupt from output compare match 2A */
-         | (1<<TOIE2);              /* Enable interrupt from overflow */
+         | (0<<OCIE2A)              /* No interrupt from output compare match 2A (yet) */
+         | (0<<TOIE2);              /* No interrupt from overflow */
+
+  /* Timer 0 counts cycles for isr_end(). It stops with the CPU clock in power save mode,
+     while there is nothing to time. Compare match A is left for the profiler, and B times
+     the bits of the software transmitter (serial.c) */
+  TCCR0A = (0<<COM0A1) | (0<<COM0A0) /* OC0A disconnected */
+         | (0<<COM0B1) | (0<<COM0B0) /* OC0B disconnected */
+         | (0<<WGM01)  | (0<<WGM00); /* Together with WGM02: Normal mode, the timer runs freely */
+  TCCR0B = (0<<WGM02)                /* See above */
+         | (0<<CS02) | (1<<CS01) | (0<<CS00);  /* Prescaler divides by 8 */
 }
 
 uint8_t seconds_since(const uint8_t since_timestamp, uint8_t * new_timestamp_ptr)
@@ -54,11 +101,129 @@ uint8_t seconds_since(const uint8_t since_timestamp, uint8_t * new_timestamp_ptr
   return now - since_timestamp;
 }
 
-void enable_task(uint8_t id)
+/* Gets the current tick and how many timer counts into it we are.
+   Must be called with interrupts disabled.
+   While the compare match is pending, the handler has not yet counted the hop up to it, and
+   counting from tick_base would wrap once the timer is 256 counts past it, a few counts
+   after the match, and put the time a turn early. So the counts are taken from the match
+   instead. The flag is read before the timer, so that a match in between still leaves the
+   count from tick_base under 256 */
+static uint16_t current_time(uint8_t * count_ptr)
+{
+  uint16_t now;
+  uint8_t count;
+  uint8_t matched;
+  now = ticks;
+  count = 0;
+  if (TIMSK2 & (1<<OCIE2A))
+  {
+    matched = TIFR2 & (1<<OCF2A);
+    count = TCNT2 - tick_base;
+    if (matched)
+    {
+      now += hop;
+      count -= hop * COUNTS_PER_TICK;
+    }
+    while (count >= COUNTS_PER_TICK)
+    {
+      count -= COUNTS_PER_TICK;
+      now++;
+    }
+  }
+  *count_ptr = count;
+  return now;
+}
+
+/* Must be called with interrupts disabled, or inside a generation check */
+static uint16_t current_tick(void)
+{
+  uint8_t count;
+  return current_time(&count);
+}
+
+void capture_time(TickTimeType * time_ptr)
+{
+  time_ptr->_tick = current_time(&time_ptr->_count);
+}
+
+uint16_t timer_ticks(void)
+{
+  uint8_t before;
+  uint16_t now;
+  do
+  {
+    before = generation;
+    generation_barrier();
+    now = current_tick();
+    generation_barrier();
+  } while (generation != before);
+  return now;
+}
+
+/* Sets OCR2A to the end of the tick in which the first task is due.
+   Must be called with interrupts disabled */
+static void program_compare(void)
+{
+  uint8_t id;
+  int16_t next_hop;
+
+  if (tasks == 0)
+  {
+    /* Nothing to do, so there is no need to wake up at all */
+    TIMSK2 &= ~(1<<OCIE2A);
+    return;
+  }
+
+  next_hop = MAX_HOP;
+  for (id = 0; id < NUM_TASKS; id++)
+  {
+    if ((tasks & (1<<id)) && ((int16_t)(task_due[id] - ticks) < next_hop))
+    {
+      next_hop = task_due[id] - ticks;
+    }
+  }
+  if (next_hop <= 0)
+  {
+    next_hop = 1;
+  }
+
+  hop = next_hop;
+  OCR2A = tick_base + hop * COUNTS_PER_TICK;
+}
+
+void schedule_task(uint8_t id, uint8_t delay)
 {
   ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    tasks |= 1<<id;
+    if ((TIMSK2 & (1<<OCIE2A)) == 0)
+    {
+      /* The timer interrupt was off, so start counting ticks from now */
+      tick_base = TCNT2;
+      changed();
+      task_due[id] = ticks + delay;
+      tasks |= 1<<id;
+      program_compare();
+#ifndef TRACE
+      TIFR2 = (1<<OCF2A) | (1<<TOV2);
+      isr_exit_count = TCNT2;
+#else
+      TIFR2 = 1<<OCF2A;
+#endif
+      TIMSK2 |= 1<<OCIE2A;
+    }
+    else
+    {
+      task_due[id] = current_tick() + delay;
+      tasks |= 1<<id;
+
+      /* Bring the compare match forward if the task is due before it,
+         unless the compare match has already happened */
+      if (((TIFR2 & (1<<OCF2A)) == 0) && ((uint16_t)(task_due[id] - ticks) < hop))
+      {
+        hop = task_due[id] - ticks;
+        OCR2A = tick_base + hop * COUNTS_PER_TICK;
+      }
+    }
   }
 }
 
@@ -75,77 +240,413 @@ uint8_t is_any_task_active(void)
   return (tasks != 0);
 }
 
-/* Interrupt handler for timer2 overflow */
-ISR(TIMER2_OVF_vect)
+/* Timer 0 gives the cycles to within 8, but wraps every 2048. Timer 2 gives them to within
+   1024 either way, so only one number of wraps fits both */
+void isr_end(uint8_t isr, const IsrStartType * start_ptr)
+{
+  uint16_t fine;
+  uint32_t cycles;
+  fine = (uint8_t)(TCNT0 - start_ptr->_count0) * 8U;
+  cycles = (uint32_t)(uint8_t)(TCNT2 - start_ptr->_count2) * 1024 + 1024;
+  cycles = (cycles < fine) ? fine : (((cycles - fine) & ~2047UL) + fine);
+  if (cycles > 0xFFFF)
+  {
+    cycles = 0xFFFF;
+  }
+  if (cycles > isr_max[isr])
+  {
+    isr_max[isr] = cycles;
+  }
+}
+
+uint16_t isr_max_cycles(uint8_t isr)
+{
+  uint16_t cycles;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    cycles = isr_max[isr];
+  }
+  return cycles;
+}
+
+uint8_t take_lost_ticks(void)
+{
+  uint8_t lost;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    lost = lost_ticks;
+    lost_ticks = 0;
+  }
+  return lost;
+}
+
+/* Returns non-zero if the task is enabled and due in this tick.
+   By default a task that is due runs again in the next tick */
+static uint8_t task_is_due(uint8_t id)
+{
+  if ((tasks & (1<<id)) && ((int16_t)(task_due[id] - ticks) <= 0))
+  {
+    task_due[id] = ticks + 1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Interrupt handler for timer2 compare match A, at the end of a tick in which a task is due */
+ISR(TIMER2_COMPA_vect)
 {
   static uint8_t count;
+  IsrStartType isr_start;
+  uint8_t i;
+  uint8_t start;
+  uint16_t late;
+  uint8_t extra;
 
-  /* Multiply the timer frequency by adding to a counter in each interrupt */
-  count += MULTIPLIER;
+  isr_begin(&isr_start);
+  start = isr_start._count2;
+  trace_begin(TRACE_TICK, 0);
 
-  /* Then divide the counter to get seconds by detecting when the counter goes above
-     the threshold (i.e. the divisor) and subtracting the divisor from the counter
-     and incrementing the number of seconds */
-  if (count >= DIVISOR)
+  /* If interrupts were disabled for a tick or more after the compare match, whole ticks
+     have passed since it as well. They are counted too, so that the countdowns and the
+     tasks catch up, and the next compare match is not set in the past */
+  late = (uint8_t)(start - OCR2A);
+#ifndef TRACE
+  /* If the timer has overflowed but is not below where it was when TOV2 was last cleared,
+     it has gone all the way round since then. If it has also got back past the compare
+     match, it has gone round since that too. That only catches some of the ways in which
+     interrupts can be disabled for a whole turn of the timer (262ms), and the others leave
+     the ticks a turn short. Nothing should come near that. (The trace's overflow interrupt
+     clears TOV2, so this is left out of TRACE builds.) */
+  if ((TIFR2 & (1<<TOV2)) && (start >= isr_exit_count) &&
+      ((uint8_t)(start - isr_exit_count) >= (uint8_t)(OCR2A - isr_exit_count)))
   {
-    count -= DIVISOR;
-    __timer_timestamp++;
+    late += 256;
+  }
+#endif
+  extra = late / COUNTS_PER_TICK;
+  if (extra != 0)
+  {
+    lost_ticks = ((uint8_t)(lost_ticks + extra) < lost_ticks) ? 0xFF : lost_ticks + extra;
+    request_poll();
   }
 
-  if (tasks & (1<<AUDIO_TASK))
+  /* Account for all of the ticks since the last interrupt */
+  tick_base = OCR2A + extra * COUNTS_PER_TICK;
+  for (i = 0; i < hop + extra; i++)
   {
+    ticks++;
+
+    /* Multiply the timer frequency by adding to a counter in each tick */
+    count += MULTIPLIER;
+
+    /* Then divide the counter to get seconds by detecting when the counter goes above
+       the threshold (i.e. the divisor) and subtracting the divisor from the counter
+       and incrementing the number of seconds */
+    if (count >= DIVISOR)
+    {
+      count -= DIVISOR;
+      __timer_timestamp++;
+    }
+  }
+
+  if (task_is_due(AUDIO_TASK))
+  {
+    trace_begin(TRACE_TASK, AUDIO_TASK);
     process_audio();
+    trace_end(TRACE_TASK, AUDIO_TASK);
   }
 
-  if (tasks & (1<<TURNLED_TASK))
+  if (task_is_due(TURNLED_TASK))
   {
+    trace_begin(TRACE_TASK, TURNLED_TASK);
     process_turnled();
+    trace_end(TRACE_TASK, TURNLED_TASK);
   }
 
-  if (tasks & (1<<COUNTDOWN_TASK))
+  if (task_is_due(COUNTDOWN_TASK))
   {
+    trace_begin(TRACE_TASK, COUNTDOWN_TASK);
     process_countdown();
+    trace_end(TRACE_TASK, COUNTDOWN_TASK);
   }
 
-  if (tasks & (1<<INPUTS_TASK))
+  if (task_is_due(INPUTS_TASK))
   {
+    trace_begin(TRACE_TASK, INPUTS_TASK);
     process_inputs();
+    trace_end(TRACE_TASK, INPUTS_TASK);
+  }
+
+#ifdef TELEMETRY
+  if (task_is_due(TELEMETRY_TASK))
+  {
+    trace_begin(TRACE_TASK, TELEMETRY_TASK);
+    process_telemetry();
+    trace_end(TRACE_TASK, TELEMETRY_TASK);
   }
+#endif
 
+  program_compare();
+  changed();
+#ifndef TRACE
+  TIFR2 = 1<<TOV2;
+  isr_exit_count = TCNT2;
+#endif
+
+  trace_end(TRACE_TICK, 0);
+  isr_end(ISR_TICK, &isr_start);
 }
 
-static void process_countdown(void)
+void start_countdown(uint8_t id)
 {
-  uint8_t id;
-  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
   {
-    if (Countdown[id]._running)
+    update_countdowns();
+    Countdown[id]._running = 1;
+    process_countdown();
+    changed();
+  }
+}
+
+void stop_countdown(uint8_t id)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    /* Charge the countdown right up to now, not just to the last tick */
+    update_countdowns();
+    Countdown[id]._running = 0;
+    changed();
+  }
+}
+
+void switch_countdown(uint8_t stop_id, uint8_t start_id, const TickTimeType * time_ptr)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    charge_countdowns(time_ptr->_tick, time_ptr->_count);
+    Countdown[stop_id]._running = 0;
+    Countdown[start_id]._running = 1;
+    process_countdown();
+    changed();
+  }
+}
+
+uint8_t countdown_expired_by(uint8_t id, const TickTimeType * time_ptr)
+{
+  uint8_t expired;
+  int16_t since_ticks;
+  int16_t since_counts;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    update_countdowns();
+    expired = Countdown[id]._expired;
+    if (expired)
     {
-      if (Countdown[id]._subseconds >= MULTIPLIER)
+      /* Compare how long it has been expired with how long ago the time was */
+      since_ticks = countdown_tick - time_ptr->_tick;
+      since_counts = (int16_t)countdown_count - time_ptr->_count;
+      if (since_counts < 0)
       {
-        Countdown[id]._subseconds -= MULTIPLIER;
+        since_counts += COUNTS_PER_TICK;
+        since_ticks--;
       }
-      else
+      expired = ((int32_t)since_ticks * MS_PER_TICK + since_counts * MS_PER_TICK / COUNTS_PER_TICK
+                 <= Countdown[id]._overrun);
+    }
+  }
+  return expired;
+}
+
+void set_countdown(uint8_t id, uint8_t minutes, uint8_t seconds)
+{
+  set_countdown_remaining(id, (minutes * 60U + seconds) * 1000UL);
+}
+
+void set_countdown_remaining(uint8_t id, uint32_t remaining)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    Countdown[id]._remaining = remaining;
+    Countdown[id]._residue = 0;
+    Countdown[id]._running = 0;
+    Countdown[id]._expired = 0;
+    Countdown[id]._overrun = 0;
+    changed();
+  }
+}
+
+void add_countdown_remaining(uint8_t id, int32_t delta)
+{
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    update_countdowns();
+    if ((delta < 0) && ((uint32_t)-delta > Countdown[id]._remaining))
+    {
+      Countdown[id]._remaining = 0;
+    }
+    else
+    {
+      Countdown[id]._remaining += delta;
+    }
+    process_countdown();
+    changed();
+  }
+}
+
+uint32_t countdown_remaining(uint8_t id)
+{
+  uint8_t before;
+  uint32_t remaining;
+  do
+  {
+    before = generation;
+    generation_barrier();
+    remaining = Countdown[id]._remaining;
+    generation_barrier();
+  } while (generation != before);
+  return remaining;
+}
+
+void snapshot_countdowns(CountdownSnapshotType * snapshot_ptr)
+{
+  uint8_t before;
+  uint8_t id;
+  do
+  {
+    before = generation;
+    generation_barrier();
+    snapshot_ptr->running = 0;
+    snapshot_ptr->expired = 0;
+    for (id = 0; id < NUM_COUNTDOWNS; id++)
+    {
+      snapshot_ptr->remaining[id] = Countdown[id]._remaining;
+      snapshot_ptr->running |= (Countdown[id]._running != 0)<<id;
+      snapshot_ptr->expired |= (Countdown[id]._expired != 0)<<id;
+    }
+    generation_barrier();
+  } while (generation != before);
+}
+
+void countdown_time(uint8_t id, uint8_t * minutes_ptr, uint8_t * seconds_ptr)
+{
+  uint16_t seconds;
+  seconds = countdown_remaining(id) / 1000;
+  *minutes_ptr = seconds / 60;
+  *seconds_ptr = seconds % 60;
+}
+
+/* Charges the running countdowns with the time since they were last updated.
+   Must be called with interrupts disabled */
+static void update_countdowns(void)
+{
+  uint16_t now;
+  uint8_t count;
+  now = current_time(&count);
+  charge_countdowns(now, count);
+}
+
+/* Charges the running countdowns with the time from their last update to the given time.
+   If the given time is before the last update, the time in between is given back. An expired
+   countdown counts the time since it expired instead, and if more than that is given back,
+   it runs again with the rest. Must be called with interrupts disabled */
+static void charge_countdowns(uint16_t tick, uint8_t count)
+{
+  uint8_t id;
+  int16_t elapsed_ticks;
+  int16_t elapsed_counts;
+
+  elapsed_ticks = tick - countdown_tick;
+  elapsed_counts = (int16_t)count - countdown_count;
+  if (elapsed_counts < 0)
+  {
+    elapsed_counts += COUNTS_PER_TICK;
+    elapsed_ticks--;
+  }
+  countdown_tick = tick;
+  countdown_count = count;
+
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    if (Countdown[id]._running || Countdown[id]._expired)
+    {
+      /* Whole ticks are exactly MS_PER_TICK, only the part tick needs dividing.
+         Each countdown keeps its own remainder, so none is lost or passed on at a switch */
+      int16_t part;
+      int32_t elapsed_ms;
+      part = elapsed_counts * MS_PER_TICK + Countdown[id]._residue;
+      Countdown[id]._residue = part % COUNTS_PER_TICK;
+      elapsed_ms = (int32_t)elapsed_ticks * MS_PER_TICK + part / COUNTS_PER_TICK;
+
+      if (Countdown[id]._expired)
       {
-        Countdown[id]._subseconds += DIVISOR - MULTIPLIER;
-        if (Countdown[id].seconds > 0)
+        if ((elapsed_ms < 0) && ((uint32_t)-elapsed_ms > Countdown[id]._overrun))
         {
-          Countdown[id].seconds--;
-        } /* end if seconds was non-zero */
+          /* The time given back goes to before it expired */
+          Countdown[id]._remaining = -elapsed_ms - Countdown[id]._overrun;
+          Countdown[id]._running = 1;
+          Countdown[id]._expired = 0;
+        }
+        else if ((elapsed_ms > 0) && ((uint32_t)(Countdown[id]._overrun + elapsed_ms) > 0xFFFF))
+        {
+          Countdown[id]._overrun = 0xFFFF;
+        }
         else
         {
-          if (Countdown[id].minutes > 0)
-          {
-            Countdown[id].minutes--;
-            Countdown[id].seconds = 59;
-          }
-          else
-          {
-            Countdown[id]._running = 0;
-            Countdown[id]._expired = 1;
-          }
-        } /* end else seconds was zero */
+          Countdown[id]._overrun += elapsed_ms;
+        }
+      }
+      else if (elapsed_ms < 0)
+      {
+        Countdown[id]._remaining -= elapsed_ms;
+      }
+      else if (Countdown[id]._remaining > (uint32_t)elapsed_ms)
+      {
+        Countdown[id]._remaining -= elapsed_ms;
       }
-    } /* end if running */
+      else
+      {
+        Countdown[id]._overrun = ((elapsed_ms - Countdown[id]._remaining) > 0xFFFF) ?
+                                 0xFFFF : elapsed_ms - Countdown[id]._remaining;
+        Countdown[id]._remaining = 0;
+        Countdown[id]._running = 0;
+        Countdown[id]._expired = 1;
+      }
+    } /* end if running or expired */
+  } /* end for all countdowns */
+}
+
+/* Brings the countdowns up to date and schedules the task for the tick
+   in which the displayed seconds of a running countdown next change */
+static void process_countdown(void)
+{
+  uint8_t id;
+  uint16_t next;
+
+  update_countdowns();
+  request_poll();
+
+  next = 0;
+  for (id = 0; id < NUM_COUNTDOWNS; id++)
+  {
+    if (Countdown[id]._running)
+    {
+      uint16_t due;
+      due = Countdown[id]._remaining % 1000 + 1;
+      if ((next == 0) || (due < next))
+      {
+        next = due;
+      }
+    }
   } /* end for all countdowns */
+
+  if (next == 0)
+  {
+    disable_task(COUNTDOWN_TASK);
+  }
+  else
+  {
+    /* Convert from milliseconds from now to ticks from the start of this tick */
+    next += (uint16_t)countdown_count * MS_PER_TICK / COUNTS_PER_TICK;
+    schedule_task(COUNTDOWN_TASK, (next + MS_PER_TICK - 1) / MS_PER_TICK);
+  }
 }
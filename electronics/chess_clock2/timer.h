@@ -4,6 +4,7 @@
 
 /* PRIVATE */
 extern uint8_t __timer_timestamp;
+extern volatile uint8_t __timer_poll_requested;
 /* END PRIVATE */
 
 #define timestamp() (*(volatile const uint8_t*)&__timer_timestamp)
@@ -12,6 +13,31 @@ uint8_t seconds_since(const uint8_t since_timestamp, uint8_t * new_timestamp_ptr
 
 void init_timer(void);
 
+/* Number of 128ms ticks since the timer started, including the ticks that have
+   passed since the last interrupt. The count does not advance while no task is scheduled.
+   Safe to call with interrupts enabled. */
+uint16_t timer_ticks(void);
+
+/* Interrupt handlers call request_poll() when the main loop has work to do.
+   The main loop sleeps until a poll is requested. */
+#define request_poll() do { __timer_poll_requested = 1; } while (0)
+#define poll_requested() (__timer_poll_requested != 0)
+#define clear_poll_request() do { __timer_poll_requested = 0; } while (0)
+
+/* A point in time, to within one timer count (1.024ms) */
+typedef struct
+{
+  /* private fields */
+  uint16_t _tick;
+  uint8_t _count;  /* timer counts into _tick */
+} TickTimeType;
+
+/* Gets the current time. Must be called with interrupts disabled */
+void capture_time(TickTimeType * time_ptr);
+
+/* The tick of a time, to compare with timer_ticks() */
+#define time_tick(time_ptr) ((time_ptr)->_tick)
+
 enum
 {
   AUDIO_TASK,
@@ -19,23 +45,63 @@ enum
   BACKLIGHT_TASK,
   COUNTDOWN_TASK,
   INPUTS_TASK,
+  TELEMETRY_TASK,
   NUM_TASKS
 };
-void enable_task(uint8_t id);
+
+/* Runs task id in the timer interrupt once the given number of ticks has passed.
+   Unless the task reschedules or disables itself, it then runs again on every tick. */
+void schedule_task(uint8_t id, uint8_t ticks);
+#define enable_task(id) schedule_task(id, 1)
 void disable_task(uint8_t id);
 
 uint8_t is_any_task_active(void);
 
+/* Interrupt handlers whose longest run is kept */
+enum
+{
+  ISR_TICK,            /* timer 2 compare match A */
+  ISR_SAMPLE,          /* timer 2 compare match B */
+  ISR_PIN_CHANGE_B,
+  ISR_PIN_CHANGE_D,
+  ISR_EEPROM_READY,
+  ISR_SERIAL_RX,
+  ISR_SERIAL_UDRE,
+  ISR_SERIAL_TX,
+  ISR_SERIAL_BIT,      /* timer 0 compare match B, the software transmitter */
+  ISR_TRACE_OVERFLOW,  /* timer 2 overflow, only in TRACE builds */
+  NUM_TIMED_ISRS
+};
+
+/* When a handler started. Timer 0 runs freely at F_CPU/8 to count the cycles */
 typedef struct
 {
-  /* public fields */
-  uint8_t minutes;
-  uint8_t seconds;
+  /* private fields */
+  uint8_t _count0;  /* TCNT0 */
+  uint8_t _count2;  /* TCNT2 */
+} IsrStartType;
+
+/* Call first thing in a timed handler, and isr_end() last thing. The compiler's entry and
+   exit code around them, and the 7 cycles of the vector, are not counted */
+#define isr_begin(start_ptr) do { (start_ptr)->_count0 = TCNT0; (start_ptr)->_count2 = TCNT2; } while (0)
+void isr_end(uint8_t isr, const IsrStartType * start_ptr);
 
+/* Longest run of a timed handler so far, in CPU cycles to within 8, up to 65535 */
+uint16_t isr_max_cycles(uint8_t isr);
+
+/* Returns the number of ticks that had passed by the time the tick interrupt handler could run,
+   because interrupts were disabled for too long, since this was last called. Those ticks are
+   still counted, and the countdowns charged for them. The handler requests a poll when there are any */
+uint8_t take_lost_ticks(void);
+
+typedef struct
+{
   /* private fields */
+  uint32_t _remaining;  /* milliseconds */
+  uint8_t _residue;     /* part of a millisecond not yet charged, in 1/125 ms */
   uint8_t _running;
   uint8_t _expired;
-  uint8_t _subseconds;
+  uint16_t _overrun;    /* milliseconds since it expired, up to 65535 */
 } CountdownType;
 
 enum {
@@ -47,15 +113,50 @@ enum {
 };
 extern CountdownType Countdown[NUM_COUNTDOWNS];
 
-#define start_countdown(id) do { Countdown[id]._running = 1; } while (0)
-#define stop_countdown(id) do { Countdown[id]._running = 0; } while (0)
+void start_countdown(uint8_t id);
+void stop_countdown(uint8_t id);
+
+/* Stops one countdown and starts another as at the given time, which may be
+   a little in the past. Time charged since then is given back, and a countdown
+   that has expired since then is running again with what it had left at that time. */
+void switch_countdown(uint8_t stop_id, uint8_t start_id, const TickTimeType * time_ptr);
 #define countdown_has_expired(id) (!!Countdown[id]._expired)
+
+/* Returns non-zero if countdown id had already expired at the given time, which may be
+   a little in the past */
+uint8_t countdown_expired_by(uint8_t id, const TickTimeType * time_ptr);
 #define countdown_is_running(id) (!!Countdown[id]._running)
 
-#define set_countdown(id, min, sec) do { Countdown[id].minutes = min; \
-                                         Countdown[id].seconds = sec; \
-                                         Countdown[id]._running = 0; \
-                                         Countdown[id]._expired = 0; \
-                                         Countdown[id]._subseconds = 0; \
-                                    } while(0)
+/* Sets a stopped countdown to the given time */
+void set_countdown(uint8_t id, uint8_t minutes, uint8_t seconds);
+void set_countdown_remaining(uint8_t id, uint32_t remaining);
+
+/* Adds to (or takes from) the remaining time of a countdown, which may be running.
+   It does not go below 0 */
+void add_countdown_remaining(uint8_t id, int32_t delta);
+
+/* The part of a millisecond that a stopped countdown has counted but not charged, and
+   putting it back, for a turn that should have cost nothing */
+#define countdown_residue(id) (Countdown[id]._residue)
+#define set_countdown_residue(id, residue) do { Countdown[id]._residue = (residue); } while (0)
+
+/* Returns the remaining time in milliseconds.
+   Safe to call with interrupts enabled: if a tick changes the countdown while it is
+   being read, it is read again */
+uint32_t countdown_remaining(uint8_t id);
+
+/* All of the countdowns as at one moment */
+typedef struct
+{
+  uint32_t remaining[NUM_COUNTDOWNS];  /* milliseconds */
+  uint8_t running;  /* bit id is set if countdown id is running */
+  uint8_t expired;  /* bit id is set if countdown id has expired */
+} CountdownSnapshotType;
+
+/* Copies all of the countdowns without disabling interrupts, reading them again if a tick
+   changed any of them part way through */
+void snapshot_countdowns(CountdownSnapshotType * snapshot_ptr);
+
+/* Gets the remaining time in whole minutes and seconds, for display */
+void countdown_time(uint8_t id, uint8_t * minutes_ptr, uint8_t * seconds_ptr);
 
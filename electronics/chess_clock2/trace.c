@@ -0,0 +1,151 @@
+/*
+ * trace.c
+ */
+
+#ifdef TRACE
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+
+#include "timer.h"
+#include "trace.h"
+#include "dump.h"
+
+/* 5 bytes a record. The RAM leaves 128 bytes with the move log of a trace build (movelog.h),
+   so 24 records fit, and a running clock takes about 6 records a tick, so the ring only holds
+   the last few ticks before the dump. 24 is not a power of two, so the ring wraps with a
+   compare rather than a mask. At most 128, which the host builds can have */
+#ifndef TRACE_SIZE
+#define TRACE_SIZE 24
+#endif
+#if TRACE_SIZE > 128
+#error "TRACE_SIZE must be at most 128"
+#endif
+
+/* The profile's counts take another 128 bytes, which with the ring would leave the stack
+   too little of the 1K of RAM */
+#ifdef PROFILE
+#error "PROFILE and TRACE do not fit in RAM together"
+#endif
+
+static TraceRecordType TraceRing[TRACE_SIZE];
+static uint8_t TraceIn;
+static uint8_t TraceFull;
+static uint8_t TraceStopped;  /* set while the ring is being sent */
+static volatile uint8_t TraceOverflows;
+
+void init_trace(void)
+{
+  TIFR2 = 1<<TOV2;
+  TIMSK2 |= 1<<TOIE2;
+}
+
+void trace_event(uint8_t event, uint8_t arg)
+{
+  TraceRecordType * record_ptr;
+  uint8_t count;
+  uint8_t overflows;
+  uint8_t fine;
+
+  if (TraceStopped)
+  {
+    return;
+  }
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    fine = TCNT0;
+    count = TCNT2;
+    overflows = TraceOverflows;
+
+    /* The timer may have overflowed since interrupts were disabled. If the count read
+       is low then it was read after that, so the overflow belongs in the timestamp */
+    if ((TIFR2 & (1<<TOV2)) && (count < 0x80))
+    {
+      overflows++;
+    }
+
+    record_ptr = &TraceRing[TraceIn];
+    record_ptr->event = event;
+    record_ptr->arg = arg;
+    record_ptr->count = count;
+    record_ptr->overflows = overflows;
+    record_ptr->fine = fine;
+    TraceIn++;
+    if (TraceIn == TRACE_SIZE)
+    {
+      TraceIn = 0;
+      TraceFull = 1;
+    }
+  }
+}
+
+uint8_t read_trace(uint8_t n, TraceRecordType * record_ptr)
+{
+  uint8_t found;
+  uint8_t index;
+
+  found = 0;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+  {
+    if (TraceFull && (n < TRACE_SIZE))
+    {
+      index = TraceIn + n;
+      if (index >= TRACE_SIZE)
+      {
+        index -= TRACE_SIZE;
+      }
+      *record_ptr = TraceRing[index];
+      found = 1;
+    }
+    else if (n < TraceIn)
+    {
+      *record_ptr = TraceRing[n];
+      found = 1;
+    }
+  }
+  return found;
+}
+
+/* Dump format, one line each:
+     TRACE <microseconds per count of timer 2> <microseconds per count of timer 0>
+     <event | kind, hex> <arg> <overflows * 256 + count> <timer 0 count>   for each record,
+                                                                          oldest first
+     END
+   Nothing is recorded while the dump is sent, so that the ring holds still */
+void dump_trace(void)
+{
+  TraceRecordType record;
+  uint8_t n;
+
+  TraceStopped = 1;
+  begin_dump();
+  dump_string_P("TRACE 1024 8\r\n");
+  for (n = 0; read_trace(n, &record); n++)
+  {
+    dump_number(record.event, 16);
+    dump_char(' ');
+    dump_number(record.arg, 10);
+    dump_char(' ');
+    dump_number(((uint16_t)record.overflows << 8) | record.count, 10);
+    dump_char(' ');
+    dump_number(record.fine, 10);
+    dump_string_P("\r\n");
+  }
+  dump_string_P("END\r\n");
+  end_dump();
+  TraceStopped = 0;
+}
+
+/* Interrupt handler for timer 2 overflow, to extend the timestamps */
+ISR(TIMER2_OVF_vect)
+{
+  IsrStartType isr_start;
+  isr_begin(&isr_start);
+  TraceOverflows++;
+  isr_end(ISR_TRACE_OVERFLOW, &isr_start);
+}
+
+#endif /* TRACE */
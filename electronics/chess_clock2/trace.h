@@ -0,0 +1,66 @@
+/*
+ * trace.h
+ *
+ * Event trace, only built in with TRACE defined (make TRACE=1). Each event goes into a
+ * ring in RAM with the time from timer 2, and a long push of copy sends the ring out of PD3
+ * (dump.h), as text that host/trace.py turns into a Chrome trace. The dump holds up the main
+ * loop, so it is only made once the game is won or while it is paused.
+ * The time is in timer 2 counts of 1.024ms, with the count of timer 0, which runs freely
+ * at F_CPU/8, for the part of a count. Timer 0 wraps every 2048us, which timer 2 can tell
+ * apart, so host/trace.py places events that the CPU was awake between to within 8us. Timer 0
+ * stops in power save mode, so across a sleep the time is only to within a count of timer 2.
+ * Without TRACE the trace_ macros compile to nothing.
+ */
+
+/* Events. host/trace.py has their names in the same order */
+enum
+{
+  TRACE_TICK,            /* timer 2 compare match A interrupt */
+  TRACE_TASK,            /* a task run by it, arg is the task id */
+  TRACE_SAMPLE,          /* timer 2 compare match B interrupt */
+  TRACE_PIN_CHANGE,      /* pin change interrupt, arg is 0 for port B or 2 for port D */
+  TRACE_EEPROM_READY,    /* EEPROM ready interrupt */
+  TRACE_INPUT_ASSERTED,  /* input_asserted(), arg is the input id */
+  TRACE_PLAY,            /* play() */
+  TRACE_LCD_FLUSH,       /* lcd_flush() when there is something to send */
+  TRACE_EEPROM_WRITE     /* write_eeprom(), arg is the low byte of the address */
+};
+
+/* Kinds of record, or'd with the event */
+#define TRACE_BEGIN 0x00
+#define TRACE_END   0x40
+#define TRACE_MARK  0x80
+#define TRACE_EVENT_MASK 0x3F
+
+#ifdef TRACE
+
+typedef struct
+{
+  uint8_t event;      /* event | kind */
+  uint8_t arg;
+  uint8_t count;      /* TCNT2 */
+  uint8_t overflows;  /* times that TCNT2 has overflowed */
+  uint8_t fine;       /* TCNT0 */
+} TraceRecordType;
+
+/* Enables the timer 2 overflow interrupt that extends the timestamps. Call after init_timer() */
+void init_trace(void);
+
+/* Records an event. May be called with interrupts enabled or not */
+void trace_event(uint8_t event, uint8_t arg);
+
+/* Gets the nth record still in the ring, oldest first. Returns 0 if there is no such record */
+uint8_t read_trace(uint8_t n, TraceRecordType * record_ptr);
+
+/* Sends the ring */
+void dump_trace(void);
+
+#else
+
+#define trace_event(event, arg) do { } while (0)
+
+#endif /* TRACE */
+
+#define trace_begin(event, arg) trace_event((event) | TRACE_BEGIN, (arg))
+#define trace_end(event, arg)   trace_event((event) | TRACE_END, (arg))
+#define trace_mark(event, arg)  trace_event((event) | TRACE_MARK, (arg))
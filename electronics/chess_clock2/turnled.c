@@ -5,11 +5,11 @@
 #include <stdint.h>
 #include <avr/io.h>
 #include "turnled.h"
+#include "timer.h"
 
 #define MAX_COUNT (NUM_TURNLEDS+8)
 
 static uint8_t ledstate;
-static uint8_t count;
 
 static const struct
 {
@@ -34,31 +34,65 @@ void init_turnled(void)
   }
 }
 
+/* Lights each turnLED that is on for one tick in every MAX_COUNT+1 ticks,
+   and schedules itself for the next tick in which a turnLED changes */
 void process_turnled(void)
 {
-  if (count < NUM_TURNLEDS)
+  uint8_t count;
+  uint8_t id;
+  uint8_t next;
+
+  count = timer_ticks() % (MAX_COUNT+1);
+
+  for (id = 0; id < NUM_TURNLEDS; id++)
   {
-    /* Turn off the the previous turnLED */
-    *TurnLeds[count].port_ptr &= ~TurnLeds[count].mask;
+    if ((id == count) && ((ledstate & (1<<id)) != 0))
+    {
+      /* Turn on this step's turnLED */
+      *TurnLeds[id].port_ptr |= TurnLeds[id].mask;
+    }
+    else
+    {
+      *TurnLeds[id].port_ptr &= ~TurnLeds[id].mask;
+    }
   }
 
-  /* Go to the next step */
-  count++;
-  if (count > MAX_COUNT)
+  if (ledstate == 0)
   {
-    count = 0;
+    disable_task(TURNLED_TASK);
+    return;
   }
 
+  /* Find the next step that turns a turnLED on or off */
   if ((count < NUM_TURNLEDS) && ((ledstate & (1<<count)) != 0))
   {
-    /* Turn on the next turnLED */
-    *TurnLeds[count].port_ptr |= TurnLeds[count].mask;
+    next = 1;
+  }
+  else
+  {
+    next = MAX_COUNT+1 - count;
+    for (id = count+1; id < NUM_TURNLEDS; id++)
+    {
+      if ((ledstate & (1<<id)) != 0)
+      {
+        next = id - count;
+        break;
+      }
+    }
+    if (next == MAX_COUNT+1 - count)
+    {
+      for (id = 0; (ledstate & (1<<id)) == 0; id++)
+        ;
+      next += id;
+    }
   }
+  schedule_task(TURNLED_TASK, next);
 }
 
 void turnled_on(uint8_t id)
 {
   ledstate |= 1<<id;
+  enable_task(TURNLED_TASK);
 }
 
 void turnled_off(uint8_t id)